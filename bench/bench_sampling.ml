@@ -0,0 +1,204 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Cost of the sampling loop and of the RPC handlers as the number of GPUs
+   and vGPUs grows, measured against the NVML simulator in sim/. Prints one
+   JSON object per configuration so that results of different releases can
+   be diffed.
+
+   With -gpu-lost, checks instead that the GPUs of sim/gpu-lost.scenario
+   keep being reported after one of them is lost. *)
+
+let gpu_counts = [1; 2; 4; 8; 16]
+
+let vgpus_per_gpu = [0; 1; 8; 32]
+
+let ticks = ref 50
+
+let rpc_calls = ref 200
+
+let gpu_lost = ref false
+
+let bus_id gpu = Printf.sprintf "0000:%02x:00.0" (gpu + 4)
+
+let domid ~vgpus gpu vgpu = 1 + (gpu * vgpus) + vgpu
+
+(* GRID K2, which the default config monitors *)
+let write_scenario path ~gpus ~vgpus =
+  let oc = open_out path in
+  Fun.protect
+    ~finally:(fun () -> close_out oc)
+    (fun () ->
+      Printf.fprintf oc "driver 470.82\n" ;
+      for gpu = 0 to gpus - 1 do
+        Printf.fprintf oc "gpu %s 0x11bf10de 0x100a10de\n" (bus_id gpu) ;
+        for vgpu = 0 to vgpus - 1 do
+          Printf.fprintf oc "vgpu %d 00000000-0000-0000-%04x-%012x\n"
+            (domid ~vgpus gpu vgpu) gpu vgpu
+        done
+      done
+    )
+
+type measurement = {
+    wall: float  (** seconds *)
+  ; nvml_calls: int
+  ; minor_words: float
+  ; major_words: float
+}
+
+let measure n f =
+  let gc = Gc.quick_stat () in
+  let calls = Nvml.call_count () in
+  let start = Unix.gettimeofday () in
+  for _ = 1 to n do
+    f ()
+  done ;
+  let wall = Unix.gettimeofday () -. start in
+  let gc' = Gc.quick_stat () in
+  let n' = float_of_int n in
+  {
+    wall= wall /. n'
+  ; nvml_calls= (Nvml.call_count () - calls) / n
+  ; minor_words= (gc'.Gc.minor_words -. gc.Gc.minor_words) /. n'
+  ; major_words= (gc'.Gc.major_words -. gc.Gc.major_words) /. n'
+  }
+
+module Server = Gpumon_server.Make (struct
+  let interface () = Nvml.NVML.get ()
+end)
+
+let bench_configuration scenario ~gpus ~vgpus ~vgpu_metrics =
+  write_scenario scenario ~gpus ~vgpus ;
+  Gpumon_sampler.vgpu_metrics := vgpu_metrics ;
+  Nvml.NVML.attach () ;
+  Fun.protect ~finally:Nvml.NVML.detach (fun () ->
+      let interface = Option.get (Nvml.NVML.get ()) in
+      let tick () =
+        let gpus = Gpumon_sampler.Inventory.get interface in
+        ignore (Gpumon_sampler.generate_all_gpu_dss interface gpus)
+      in
+      (* The first tick builds the inventory *)
+      let first = measure 1 tick in
+      let steady = measure !ticks tick in
+      let compat =
+        if vgpus > 0 then
+          let pgpu = bus_id (gpus - 1) in
+          let metadata = Server.Nvidia.get_pgpu_metadata "bench" pgpu in
+          let domid = domid ~vgpus (gpus - 1) (vgpus - 1) in
+          Some
+            (measure !rpc_calls (fun () ->
+                 ignore
+                   (Server.Nvidia.get_pgpu_vm_compatibility "bench" pgpu domid
+                      metadata
+                   )
+             )
+            )
+        else
+          None
+      in
+      Printf.printf
+        "{\"gpus\": %d, \"vgpus_per_gpu\": %d, \"vgpu_metrics\": %b, \
+         \"ticks\": %d, \
+         \"first_tick_us\": %.1f, \"first_tick_nvml_calls\": %d, \
+         \"tick_us\": %.1f, \"tick_nvml_calls\": %d, \
+         \"tick_minor_words\": %.1f, \"tick_major_words\": %.1f%s}\n%!"
+        gpus vgpus vgpu_metrics !ticks (first.wall *. 1e6) first.nvml_calls
+        (steady.wall *. 1e6) steady.nvml_calls steady.minor_words
+        steady.major_words
+        ( match compat with
+        | Some m ->
+            Printf.sprintf
+              ", \"vm_compat_rpc_us\": %.1f, \"vm_compat_rpc_nvml_calls\": %d"
+              (m.wall *. 1e6) m.nvml_calls
+        | None ->
+            ""
+        )
+  )
+
+(* The GPU of sim/gpu-lost.scenario that falls off the bus and reports
+   XID 79 three seconds in. The event thread then has the inventory
+   rebuilt, which must leave out that GPU only. *)
+let lost_bus_id = "0000:05:00.0"
+
+let check_gpu_lost () =
+  Gpumon_sampler.event_monitoring := true ;
+  Nvml.NVML.attach () ;
+  Fun.protect ~finally:Nvml.NVML.detach (fun () ->
+      let interface = Option.get (Nvml.NVML.get ()) in
+      (* Bus IDs of the GPUs reported with fresh values by a tick *)
+      let tick () =
+        let gpus = Gpumon_sampler.Inventory.get interface in
+        ignore (Gpumon_sampler.generate_all_gpu_dss interface gpus) ;
+        gpus
+        |> List.filter (fun gpu ->
+               not (Gpumon_health.stale gpu.Gpumon_sampler.health)
+           )
+        |> List.map (fun gpu -> gpu.Gpumon_sampler.bus_id)
+      in
+      let before = tick () in
+      Gpumon_sampler.start_event_monitoring () ;
+      for _ = 1 to 10 do
+        Thread.delay 1.0 ; ignore (tick ())
+      done ;
+      let after = tick () in
+      Printf.printf
+        "{\"scenario\": \"gpu_lost\", \"reporting_before\": [%s], \
+         \"reporting_after\": [%s]}\n%!"
+        (String.concat ", " (List.map (Printf.sprintf "%S") before))
+        (String.concat ", " (List.map (Printf.sprintf "%S") after)) ;
+      if
+        List.length before <> 4
+        || after <> List.filter (( <> ) lost_bus_id) before
+      then (
+        prerr_endline "The GPUs not lost are no longer all reported" ;
+        exit 1
+      )
+  )
+
+let run_benchmarks () =
+  let scenario = Filename.temp_file "gpumon-bench" ".scenario" in
+  Unix.putenv "NVML_SIM_SCENARIO" scenario ;
+  Fun.protect
+    ~finally:(fun () -> Sys.remove scenario)
+    (fun () ->
+      List.iter
+        (fun gpus ->
+          List.iter
+            (fun vgpus ->
+              (* Without vGPU metrics, vGPUs only cost the RPC handlers *)
+              List.iter
+                (fun vgpu_metrics ->
+                  bench_configuration scenario ~gpus ~vgpus ~vgpu_metrics
+                )
+                (if vgpus > 0 then [false; true] else [false])
+            )
+            vgpus_per_gpu
+        )
+        gpu_counts
+    )
+
+let () =
+  Arg.parse
+    [
+      ("-ticks", Arg.Set_int ticks, "Ticks measured per configuration")
+    ; ("-rpc-calls", Arg.Set_int rpc_calls, "RPC calls measured")
+    ; ( "-gpu-lost"
+      , Arg.Set gpu_lost
+      , "Check that the other GPUs keep reporting when one is lost, with \
+         NVML_SIM_SCENARIO set to sim/gpu-lost.scenario"
+      )
+    ]
+    (fun _ -> raise (Arg.Bad "unexpected argument"))
+    "Benchmark gpumon's sampling loop against the NVML simulator" ;
+  if !gpu_lost then check_gpu_lost () else run_benchmarks ()
@@ -4,318 +4,98 @@ let plugin_name = "xcp-rrdd-gpumon"
 
 module Process = Process (struct let name = plugin_name end)
 
-let nvidia_vendor_id = 0x10del
-
-let vgpu_config_dir = "/usr/share/nvidia/vgpu"
-
-(* acquire NVML interface but give up after timeout. Note that this does
-   not attach the NVML libarary but it waits for someone else to attach it
-   if necessary. *)
-let get_nvml_or_wait ~log ?(timeout = 30.0) () =
-  let rec loop delay waited =
-    match Nvml.NVML.get () with
-    | Some _ as interface ->
-        interface
-    | None when waited > timeout ->
-        Process.D.info "Could not open NVML interface - giving up" ;
-        None
-    | None ->
-        Process.D.info "Could not open NVML interface - retry in %4.1f" delay ;
-        Thread.delay delay ;
-        loop (delay *. 1.2) (waited +. delay)
-  in
-  match Sys.file_exists vgpu_config_dir with
-  | true ->
-      loop 2.0 0.0
-  | false ->
-      if log then
-        Process.D.info "%s not found - assuming NVML library unavailable"
-          vgpu_config_dir ;
-      None
-
-(* Like get_nvml_or_wait but keep looping. Only call this in a thread
-   that does not block the main interaction like the RPC server. Again,
-   this is not attaching the library but waits for it to be attached by
-   some other thread. *)
-let get_nvml_or_wait_forever () =
-  let rec try_again_after ~log delay =
-    match get_nvml_or_wait ~log () with
-    | Some interface ->
-        interface
-    | None ->
-        if log then
-          Process.D.info "Failed to open NVML interface - retrying in %4.0f"
-            delay ;
-        Thread.delay delay ;
-        try_again_after ~log:false (min (delay *. 1.5) (20.0 *. 60.0))
-  in
-  try_again_after ~log:true 60.0
-
-let default_config : (int32 * Gpumon_config.config) list =
-  let open Gpumon_config in
+let options =
   [
-    (* NVIDIA Corporation *)
-    ( nvidia_vendor_id
-    , {
-        device_types=
-          [
-            (* GRID K1 *)
-            {
-              device_id= 0x0ff2l
-            ; subsystem_device_id= Any
-            ; metrics=
-                [
-                  Memory Free
-                ; Memory Used
-                ; Other Temperature
-                ; Other PowerUsage
-                ; Utilisation Compute
-                ; Utilisation MemoryIO
-                ]
-            }
-          ; (* GRID K2 *)
-            {
-              device_id= 0x11bfl
-            ; subsystem_device_id= Any
-            ; metrics=
-                [
-                  Memory Free
-                ; Memory Used
-                ; Other Temperature
-                ; Other PowerUsage
-                ; Utilisation Compute
-                ; Utilisation MemoryIO
-                ]
-            }
-          ]
-      }
+    ( "nvml-library"
+    , Arg.Set_string Nvml.library_path
+    , (fun () -> !Nvml.library_path)
+    , "NVML library to load, e.g. the NVML simulator"
     )
-  ]
-
-let categorise_metrics =
-  List.fold_left
-    (fun (memory_metrics, other_metrics, utilisation_metrics) metric ->
-      match metric with
-      | Gpumon_config.Memory x ->
-          (x :: memory_metrics, other_metrics, utilisation_metrics)
-      | Gpumon_config.Other x ->
-          (memory_metrics, x :: other_metrics, utilisation_metrics)
-      | Gpumon_config.Utilisation x ->
-          (memory_metrics, other_metrics, x :: utilisation_metrics)
+  ; ( "sampling-threads"
+    , Arg.Set_int Gpumon_sampler.sampling_threads
+    , (fun () -> string_of_int !Gpumon_sampler.sampling_threads)
+    , "Number of threads sampling GPUs concurrently. With a sampling \
+       deadline, GPUs are sampled on at least one worker thread even if this \
+       is 0; only with a deadline of 0 as well are they sampled one after \
+       the other on the reporting thread"
     )
-    ([], [], [])
-
-(** NVML returns the PCI ID and PCI subsystem ID as int32s, where the most
- *  significant 16 bits make up the device ID and the least significant 16 bits
- *  make up the vendor ID. This function checks that a device has a supported
- *  combination of vendor ID, device ID and, if applicable, subsystem device ID.
- *
- *  If all these IDs match, the required list of metrics for this device is
- *  returned. *)
-let get_required_metrics config pci_info =
-  let vendor_id = Int32.logand 0xffffl pci_info.Nvml.pci_device_id in
-  let device_id = Int32.shift_right_logical pci_info.Nvml.pci_device_id 16 in
-  let subsystem_device_id =
-    Int32.shift_right_logical pci_info.Nvml.pci_subsystem_id 16
-  in
-  try
-    let open Gpumon_config in
-    let vendor_config = List.assoc vendor_id config in
-    let device =
-      List.find
-        (fun device ->
-          (* Check that the device ID matches. *)
-          device.device_id = device_id
-          &&
-          (* Check that the subsystem device ID matches, if necessary. *)
-          match device.subsystem_device_id with
-          | Match id ->
-              id = subsystem_device_id
-          | Any ->
-              true
-        )
-        vendor_config.device_types
-    in
-    Some (categorise_metrics device.metrics)
-  with Not_found -> None
-
-let nvidia_config_path = "/usr/share/nvidia/monitoring.conf"
-
-(** Try to load the config file; if this fails fall back to default_config.
- *  See perf-tools.hg/scripts/monitoring.conf.example for an example of the
- *  expected config file format. *)
-let load_config () =
-  match Gpumon_config.of_file nvidia_config_path with
-  | Ok config ->
-      [(nvidia_vendor_id, config)]
-  | Error `Does_not_exist ->
-      Process.D.error "Config file %s not found" nvidia_config_path ;
-      Process.D.warn "Using default config" ;
-      default_config
-  | Error (`Parse_failure msg) ->
-      Process.D.error "Caught exception parsing config file: %s" msg ;
-      Process.D.warn "Using default config" ;
-      default_config
-  | Error (`Unknown_version version) ->
-      Process.D.error "Unknown config file version: %s" version ;
-      Process.D.warn "Using default config" ;
-      default_config
-
-type gpu = {
-    device: Nvml.device
-  ; bus_id: string
-  ; bus_id_escaped: string
-  ; memory_metrics: Gpumon_config.memory_metric list
-  ; utilisation_metrics: Gpumon_config.utilisation_metric list
-  ; other_metrics: Gpumon_config.other_metric list
-}
-
-(* Adding colons to datasource names confuses RRD parsers, so replace all
- * colons with "/" *)
-let escape_bus_id bus_id = String.concat "/" (String.split_on_char ':' bus_id)
-
-(** Get the list of devices recognised by NVML. *)
-let get_gpus interface =
-  let config = load_config () in
-  let device_count = Nvml.device_get_count interface in
-  let rec make_gpu_list acc index =
-    if index >= 0 then
-      let device = Nvml.device_get_handle_by_index interface index in
-      let pci_info = Nvml.device_get_pci_info interface device in
-      match get_required_metrics config pci_info with
-      | Some (memory_metrics, other_metrics, utilisation_metrics) ->
-          Nvml.device_set_persistence_mode interface device Nvml.Enabled ;
-          let bus_id = String.lowercase_ascii pci_info.Nvml.bus_id in
-          let gpu =
-            {
-              device
-            ; bus_id
-            ; bus_id_escaped= escape_bus_id bus_id
-            ; memory_metrics
-            ; other_metrics
-            ; utilisation_metrics
-            }
-          in
-          make_gpu_list (gpu :: acc) (index - 1)
-      | None ->
-          make_gpu_list acc (index - 1)
-    else
-      acc
-  in
-  make_gpu_list [] (device_count - 1)
-
-(** Generate datasources for one GPU. *)
-let generate_gpu_dss interface gpu =
-  let memory_dss =
-    match gpu.memory_metrics with
-    | [] ->
-        []
-    | metrics ->
-        let memory_info = Nvml.device_get_memory_info interface gpu.device in
-        List.map
-          (function
-            | Gpumon_config.Free ->
-                ( Rrd.Host
-                , Ds.ds_make
-                    ~name:("gpu_memory_free_" ^ gpu.bus_id_escaped)
-                    ~description:"Unallocated framebuffer memory"
-                    ~value:(Rrd.VT_Int64 memory_info.Nvml.free) ~ty:Rrd.Gauge
-                    ~default:false ~units:"B" ()
-                )
-            | Gpumon_config.Used ->
-                ( Rrd.Host
-                , Ds.ds_make
-                    ~name:("gpu_memory_used_" ^ gpu.bus_id_escaped)
-                    ~description:"Allocated framebuffer memory"
-                    ~value:(Rrd.VT_Int64 memory_info.Nvml.used) ~ty:Rrd.Gauge
-                    ~default:false ~units:"B" ()
-                )
-            )
-          metrics
-  in
-  let other_dss =
-    List.map
-      (function
-        | Gpumon_config.PowerUsage ->
-            let power_usage =
-              Nvml.device_get_power_usage interface gpu.device
-            in
-            ( Rrd.Host
-            , Ds.ds_make
-                ~name:("gpu_power_usage_" ^ gpu.bus_id_escaped)
-                ~description:"Power usage of this GPU"
-                ~value:(Rrd.VT_Int64 (Int64.of_int power_usage))
-                ~ty:Rrd.Gauge ~default:false ~units:"mW" ()
-            )
-        | Gpumon_config.Temperature ->
-            let temperature =
-              Nvml.device_get_temperature interface gpu.device
-            in
-            ( Rrd.Host
-            , Ds.ds_make
-                ~name:("gpu_temperature_" ^ gpu.bus_id_escaped)
-                ~description:"Temperature of this GPU"
-                ~value:(Rrd.VT_Int64 (Int64.of_int temperature))
-                ~ty:Rrd.Gauge ~default:false ~units:"°C" ()
-            )
-        )
-      gpu.other_metrics
-  in
-  let utilisation_dss =
-    match gpu.utilisation_metrics with
-    | [] ->
-        []
-    | metrics ->
-        let utilization =
-          Nvml.device_get_utilization_rates interface gpu.device
-        in
-        List.map
-          (function
-            | Gpumon_config.Compute ->
-                ( Rrd.Host
-                , Ds.ds_make
-                    ~name:("gpu_utilisation_compute_" ^ gpu.bus_id_escaped)
-                    ~description:
-                      ("Proportion of time over the past sample period during"
-                      ^ " which one or more kernels was executing on this GPU"
-                      )
-                    ~value:
-                      (Rrd.VT_Float (float_of_int utilization.Nvml.gpu /. 100.0))
-                    ~ty:Rrd.Gauge ~default:false ~min:0.0 ~max:1.0
-                    ~units:"(fraction)" ()
-                )
-            | Gpumon_config.MemoryIO ->
-                ( Rrd.Host
-                , Ds.ds_make
-                    ~name:("gpu_utilisation_memory_io_" ^ gpu.bus_id_escaped)
-                    ~description:
-                      ("Proportion of time over the past sample period during"
-                      ^ " which global (device) memory was being read or \
-                         written on this GPU"
-                      )
-                    ~value:
-                      (Rrd.VT_Float
-                         (float_of_int utilization.Nvml.memory /. 100.0)
-                      )
-                    ~ty:Rrd.Gauge ~default:false ~min:0.0 ~max:1.0
-                    ~units:"(fraction)" ()
-                )
-            )
-          metrics
-  in
-  List.fold_left
-    (fun acc metrics -> List.rev_append metrics acc)
-    []
-    [memory_dss; other_dss; utilisation_dss]
-
-(** Generate datasources for all GPUs. *)
-let generate_all_gpu_dss interface gpus =
-  List.fold_left
-    (fun acc gpu ->
-      let dss = generate_gpu_dss interface gpu in
-      List.rev_append dss acc
+  ; ( "sampling-deadline"
+    , Arg.Set_float Gpumon_sampler.sampling_deadline
+    , (fun () -> string_of_float !Gpumon_sampler.sampling_deadline)
+    , "Seconds to wait for the GPUs to be sampled on each tick; a GPU that \
+       takes longer is reported with its previous values until its sample \
+       finishes, keeping one thread busy meanwhile. 0 waits for as long as \
+       sampling takes"
+    )
+  ; ( "stale-flags"
+    , Arg.Bool (fun b -> Gpumon_sampler.stale_flags := b)
+    , (fun () -> string_of_bool !Gpumon_sampler.stale_flags)
+    , "Report for each GPU whether its values are from an earlier sample, \
+       because sampling it failed or missed the deadline; off by default"
     )
-    [] gpus
+  ; ( "high-frequency-interval"
+    , Arg.Set_float Gpumon_high_frequency.interval
+    , (fun () -> string_of_float !Gpumon_high_frequency.interval)
+    , "Seconds between readings of GPU utilisation and power usage, reported \
+       as minimum, maximum, average and 99th percentile over each sample \
+       period; 0 disables these readings"
+    )
+  ; ( "event-monitoring"
+    , Arg.Bool (fun b -> Gpumon_sampler.event_monitoring := b)
+    , (fun () -> string_of_bool !Gpumon_sampler.event_monitoring)
+    , "Count XID errors, ECC errors and clock changes of each GPU as they \
+       are reported by the driver; off by default"
+    )
+  ; ( "self-stats"
+    , Arg.Bool (fun b -> Gpumon_stats.enabled := b)
+    , (fun () -> string_of_bool !Gpumon_stats.enabled)
+    , "Report gpumon's own overhead: the latency of its NVML calls, ticks \
+       and RPCs, its GC activity and the hits and misses of its caches; off \
+       by default"
+    )
+  ; ( "sysfs-gpus"
+    , Arg.Bool (fun b -> Gpumon_sysfs.enabled := b)
+    , (fun () -> string_of_bool !Gpumon_sysfs.enabled)
+    , "Report the GPUs of other vendors found under /sys/class/drm, such as \
+       AMD and Intel GPUs, from the sensors and counters their drivers \
+       expose; off by default"
+    )
+  ; ( "openmetrics-socket"
+    , Arg.Set_string Gpumon_openmetrics.socket_path
+    , (fun () -> !Gpumon_openmetrics.socket_path)
+    , "Unix socket on which to serve the latest report over HTTP in \
+       OpenMetrics text format; empty to not serve it"
+    )
+  ; ( "history-file"
+    , Arg.Set_string Gpumon_history.path
+    , (fun () -> !Gpumon_history.path)
+    , "File keeping a ring of recent readings of each GPU, which survives \
+       restarts; see gpumon_history_dump"
+    )
+  ; ( "history-size"
+    , Arg.Set_int Gpumon_history.size_mib
+    , (fun () -> string_of_int !Gpumon_history.size_mib)
+    , "Size of the history file in MiB, which bounds how far back it goes; \
+       0 keeps no history"
+    )
+  ; ( "history-interval"
+    , Arg.Set_float Gpumon_history.interval
+    , (fun () -> string_of_float !Gpumon_history.interval)
+    , "Seconds between two history records of a GPU"
+    )
+  ; ( "inventory-file"
+    , Arg.Set_string Gpumon_inventory_cache.path
+    , (fun () -> !Gpumon_inventory_cache.path)
+    , "File remembering the GPUs found and the shared pages used, so that a \
+       restarted gpumon reports at once; it should be on a tmpfs"
+    )
+  ; ( "vgpu-metrics"
+    , Arg.Set Gpumon_sampler.vgpu_metrics
+    , (fun () -> string_of_bool !Gpumon_sampler.vgpu_metrics)
+    , "Report framebuffer usage, utilisation and frame rate limit of each \
+       vGPU against the VM it is assigned to"
+    )
+  ]
 
 let start server =
   let (_ : Thread.t) =
@@ -329,22 +109,49 @@ let handle_shutdown handler () =
   Sys.set_signal Sys.sigint (Sys.Signal_handle handler) ;
   Sys.set_signal Sys.sigpipe Sys.Signal_ignore
 
+(* GPUs that NVML does not know about *)
+module Sysfs_gpus = Gpumon_backend.Make (Gpumon_sysfs)
+
 (* PPX-based server generation *)
 module Server = Gpumon_interface.RPC_API (Idl.Exn.GenServer ())
 
+(* Record the time taken by each call of an RPC *)
+let timed1 name f =
+  let series = Gpumon_stats.rpc name in
+  fun a -> Gpumon_stats.time series (fun () -> f a)
+
+let timed2 name f =
+  let series = Gpumon_stats.rpc name in
+  fun a b -> Gpumon_stats.time series (fun () -> f a b)
+
+let timed3 name f =
+  let series = Gpumon_stats.rpc name in
+  fun a b c -> Gpumon_stats.time series (fun () -> f a b c)
+
+let timed4 name f =
+  let series = Gpumon_stats.rpc name in
+  fun a b c d -> Gpumon_stats.time series (fun () -> f a b c d)
+
 (* Provide server API calls *)
 module Make (Impl : Gpumon_server.IMPLEMENTATION) = struct
   (* bind server method declarations to implementations *)
   let bind () =
-    Server.Nvidia.get_pgpu_metadata Impl.Nvidia.get_pgpu_metadata ;
-    Server.Nvidia.get_vgpu_metadata Impl.Nvidia.get_vgpu_metadata ;
+    Server.Nvidia.get_pgpu_metadata
+      (timed2 "get_pgpu_metadata" Impl.Nvidia.get_pgpu_metadata) ;
+    Server.Nvidia.get_vgpu_metadata
+      (timed4 "get_vgpu_metadata" Impl.Nvidia.get_vgpu_metadata) ;
     Server.Nvidia.get_pgpu_vgpu_compatibility
-      Impl.Nvidia.get_pgpu_vgpu_compatibility ;
+      (timed3 "get_pgpu_vgpu_compatibility"
+         Impl.Nvidia.get_pgpu_vgpu_compatibility
+      ) ;
     Server.Nvidia.get_pgpu_vm_compatibility
-      Impl.Nvidia.get_pgpu_vm_compatibility ;
-    Server.Nvidia.nvml_attach Impl.Nvidia.attach ;
-    Server.Nvidia.nvml_detach Impl.Nvidia.detach ;
-    Server.Nvidia.nvml_is_attached Impl.Nvidia.is_attached
+      (timed4 "get_pgpu_vm_compatibility"
+         Impl.Nvidia.get_pgpu_vm_compatibility
+      ) ;
+    Server.Nvidia.nvml_attach (timed1 "nvml_attach" Impl.Nvidia.attach) ;
+    Server.Nvidia.nvml_detach (timed1 "nvml_detach" Impl.Nvidia.detach) ;
+    Server.Nvidia.nvml_is_attached
+      (timed1 "nvml_is_attached" Impl.Nvidia.is_attached)
 end
 
 let doc = "GPU monitoring daemon"
@@ -354,15 +161,21 @@ let () =
   Process.initialise () ;
   (* Define the new signal handler *)
   let stop_handler signal =
-    Nvml.NVML.detach () ;
+    ( try Nvml.NVML.detach ()
+      with e ->
+        Process.D.warn "Stopping without detaching NVML: %s"
+          (Printexc.to_string e)
+    ) ;
     Process.D.info "Caught signal in %s for PID %d" __FUNCTION__ pid ;
     Process.D.info "Received signal %d: deregistering plugin %s..." signal
       plugin_name ;
     Process.D.info "About to terminate process PID %d" pid ;
     exit 0
   in
+  (* Calls made while NVML is detached fail at once rather than waiting for
+     it to be attached. *)
   let module Gpumon_server = Gpumon_server.Make (struct
-    let interface () = get_nvml_or_wait ~log:true ()
+    let interface () = Nvml.NVML.get ()
   end) in
   (* create daemon module to bind server call declarations to implementations *)
   let module Daemon = Make (Gpumon_server) in
@@ -374,33 +187,109 @@ let () =
       ()
   in
   (* call after setting up RPC server to catch unimplemented API errors early *)
-  Xcp_service.configure () ;
-  ( try Nvml.NVML.attach ()
-    with e ->
-      Process.D.error "%s NVML attach failed: %s" __LOC__ (Printexc.to_string e)
-  ) ;
+  Xcp_service.configure ~options () ;
+  let cache = Gpumon_inventory_cache.load () in
+  (* Initialising NVML takes seconds on a host with many GPUs; meanwhile the
+     reporter starts on the pages the cached inventory needs. *)
+  let _ =
+    Thread.create
+      (fun () ->
+        try Nvml.NVML.attach ()
+        with e ->
+          Process.D.error "%s NVML attach failed: %s" __LOC__
+            (Printexc.to_string e)
+      )
+      ()
+  in
   let _ =
     handle_shutdown stop_handler () ;
     start server
   in
+  Gpumon_sampler.start_high_frequency_sampling () ;
+  Gpumon_sampler.start_event_monitoring () ;
+  Gpumon_sampler.start_history () ;
+  Gpumon_openmetrics.start () ;
   (* gpumon rrdd interface *)
-  let rec rrdd_loop () =
-    try
-      let interface = get_nvml_or_wait_forever () in
-      let shared_page_count = get_gpus interface |> List.length in
-      (* Share one page per GPU - this is plenty for the six
-         datasources per GPU which we currently report. *)
-      let dss_f () =
-        let interface = get_nvml_or_wait_forever () in
-        let gpus = get_gpus interface in
-        generate_all_gpu_dss interface gpus
-      in
-      Process.main_loop ~neg_shift:0.5
-        ~target:(Reporter.Local shared_page_count) ~protocol:Rrd_interface.V2
-        ~dss_f
-    with e ->
-      Process.D.error "Unexpected exception: %s" (Printexc.to_string e) ;
-      Thread.delay 5.0 ;
-      rrdd_loop ()
+  (* Pages the GPUs took in the last run, kept until they are reported so
+     that the reporter is not resized when they appear. *)
+  let reserved_pages =
+    match cache with
+    | Some cache ->
+        ref cache.Gpumon_inventory_cache.pages
+    | None ->
+        ref 1
+  in
+  (* Pages needed for the datasources of the last report *)
+  let pages_needed = ref !reserved_pages in
+  (* Whether the last tick reported GPU metrics. The tick never waits for
+     NVML: while it is detached at most gpumon's own statistics are reported,
+     and the first tick after an attach rebuilds the inventory. *)
+  let reporting_gpus = ref true in
+  let dss_f () =
+    let dss =
+      Gpumon_stats.time Gpumon_stats.tick (fun () ->
+          match Nvml.NVML.get () with
+          | Some interface ->
+              if not !reporting_gpus then (
+                Process.D.info "NVML attached - reporting GPU metrics" ;
+                reporting_gpus := true
+              ) ;
+              let gpus = Gpumon_sampler.Inventory.get interface in
+              Gpumon_sampler.generate_all_gpu_dss interface gpus
+          | None ->
+              if !reporting_gpus then (
+                Process.D.info "NVML not attached - not reporting GPU metrics" ;
+                reporting_gpus := false
+              ) ;
+              []
+      )
+      |> (if !Gpumon_sysfs.enabled then Sysfs_gpus.generate_dss else Fun.id)
+      |> (if !Gpumon_stats.enabled then Gpumon_stats.generate_dss else Fun.id)
+    in
+    Gpumon_openmetrics.publish dss ;
+    let needed = Gpumon_sampler.shared_pages_needed dss in
+    if !reporting_gpus then (
+      reserved_pages := 1 ;
+      Gpumon_inventory_cache.set_pages needed
+    ) ;
+    pages_needed := max needed !reserved_pages ;
+    dss
+  in
+  (* Shrink only once the datasources use less than half of the pages, so
+     that a datasource coming and going does not cause repeated resizes. *)
+  let fits pages = !pages_needed <= pages && !pages_needed > pages / 2 in
+  let rec rrdd_loop pages =
+    Process.D.info "Reporting on %d shared pages" pages ;
+    let reporter =
+      Reporter.start_async
+        (module Process.D)
+        ~uid:plugin_name ~neg_shift:0.5 ~target:(Reporter.Local pages)
+        ~protocol:Rrd_interface.V2 ~dss_f
+    in
+    let rec supervise () =
+      Thread.delay 1.0 ;
+      match Reporter.get_state ~reporter with
+      | Reporter.Running when fits pages ->
+          supervise ()
+      | Reporter.Running ->
+          (* The reporter and the samplers keep their state, so the next
+             report continues where this one left off. *)
+          Reporter.cancel ~reporter ;
+          Reporter.wait_until_stopped ~reporter
+      | Reporter.Stopped (`Failed e) when !pages_needed > pages ->
+          (* Most likely the payload outgrew the shared pages *)
+          Process.D.info "Datasources no longer fit: %s" (Printexc.to_string e)
+      | Reporter.Stopped (`Failed e) ->
+          Process.D.error "Unexpected exception: %s" (Printexc.to_string e) ;
+          (* A failure may have been caused by a device disappearing;
+             rediscover the GPUs before trying again. *)
+          Gpumon_sampler.Inventory.invalidate () ;
+          Sysfs_gpus.invalidate () ;
+          Thread.delay 5.0
+      | Reporter.Stopped _ | Reporter.Cancelled ->
+          Reporter.wait_until_stopped ~reporter
+    in
+    supervise () ;
+    rrdd_loop !pages_needed
   in
-  rrdd_loop ()
+  rrdd_loop !pages_needed
@@ -0,0 +1,137 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Sources of GPU metrics other than the NVML sampler, and the reporting of
+   their devices *)
+
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+type pci_ids = {vendor_id: int32; device_id: int32; subsystem_device_id: int32}
+
+(** A way of discovering GPUs and reading their metrics. Readings use the
+    slots and units of [Nvml.Metric] and the buffers of [Nvml.sample]
+    whatever the backend, so that the metrics of [Gpumon_metric.registry]
+    describe them all. Only [Gpumon_sysfs] implements it for now: NVIDIA
+    GPUs are reported by [Gpumon_sampler], which adds vGPUs, events and
+    sampling deadlines. *)
+module type S = sig
+  type device
+
+  val name : string
+  (** Used in log messages *)
+
+  val devices : unit -> device list
+  (** The GPUs this backend reports on, each ready to be sampled until
+      [close]d *)
+
+  val bus_id : device -> string
+  (** domain:bus:device.function PCI identifier, in lower case *)
+
+  val pci_ids : device -> pci_ids
+
+  val capabilities : device -> int
+  (** [Nvml.Metric] bits of the metrics [sample] can read from the device *)
+
+  val sample : device -> int -> Nvml.sample -> unit
+  (** [sample device mask sample] reads the metrics of [mask] into
+      [sample], recording failures per metric in [sample.status] rather
+      than raising. *)
+
+  val close : device -> unit
+end
+
+(* Adding colons to datasource names confuses RRD parsers, so replace all
+   colons with "/" *)
+let escape_bus_id bus_id = String.concat "/" (String.split_on_char ':' bus_id)
+
+(** Datasources of [metrics] of a GPU, reading its [sample] buffer. *)
+let make_dss bus_id_escaped sample metrics =
+  List.map
+    (fun m ->
+      let open Gpumon_metric in
+      Gpumon_dss.make ~owner:Rrd.Host ~sample ~slot:m.slot
+        ~value:(to_ds_value m)
+        ~name:(m.ds_prefix ^ bus_id_escaped)
+        ~description:m.description ~units:m.units ~ty:m.ty ~min:m.min
+        ~max:m.max ()
+    )
+    metrics
+
+(** Report every metric of the registry that a backend can read from each
+    of its devices. The devices are discovered on the first report and
+    kept, with their files or handles, until [invalidate]. *)
+module Make (B : S) = struct
+  type gpu = {
+      device: B.device
+    ; mask: int
+    ; sample: Nvml.sample  (** reused for every sample of this GPU *)
+    ; dss: Gpumon_dss.t list
+  }
+
+  let current = ref (None : gpu list option)
+
+  let discover () =
+    List.filter_map
+      (fun device ->
+        let bus_id = B.bus_id device in
+        let available = B.capabilities device in
+        let metrics =
+          List.filter
+            (fun m -> available land Nvml.Metric.bit m.Gpumon_metric.slot <> 0)
+            Gpumon_metric.registry
+        in
+        match metrics with
+        | [] ->
+            D.info "%s: GPU %s has no metrics we can read" B.name bus_id ;
+            B.close device ;
+            None
+        | _ ->
+            D.info "%s: reporting %d metrics of GPU %s" B.name
+              (List.length metrics) bus_id ;
+            let slots = List.map (fun m -> m.Gpumon_metric.slot) metrics in
+            let mask = Nvml.Metric.mask slots in
+            let sample = Nvml.make_sample () in
+            Some
+              {
+                device
+              ; mask
+              ; sample
+              ; dss= make_dss (escape_bus_id bus_id) sample metrics
+              }
+      )
+      (B.devices ())
+
+  let gpus () =
+    match !current with
+    | Some gpus ->
+        gpus
+    | None ->
+        let gpus = discover () in
+        current := Some gpus ;
+        gpus
+
+  (** Forget the devices, so that the next report discovers them again. *)
+  let invalidate () =
+    Option.iter (List.iter (fun gpu -> B.close gpu.device)) !current ;
+    current := None
+
+  (** Sample all devices and add their datasources to [acc]. *)
+  let generate_dss acc =
+    List.fold_left
+      (fun acc gpu ->
+        B.sample gpu.device gpu.mask gpu.sample ;
+        Gpumon_dss.generate gpu.dss acc
+      )
+      acc (gpus ())
+end
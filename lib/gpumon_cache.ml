@@ -0,0 +1,112 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+(* Version of the loaded kernel module; reading it is much cheaper than
+   asking NVML. *)
+let driver_version_path = "/sys/module/nvidia/version"
+
+let driver_version () =
+  try
+    let ic = open_in driver_version_path in
+    Fun.protect
+      ~finally:(fun () -> close_in ic)
+      (fun () -> Some (input_line ic))
+  with Sys_error _ | End_of_file -> None
+
+(* Seconds for which a driver version read stays current, unless NVML is
+   re-attached sooner *)
+let driver_check_interval = 60.0
+
+type stamp = {generation: int; driver: string option}
+
+(* The driver version last read, with the generation and time at which it
+   was read, so that lookups do not read the file every time. *)
+let driver = Atomic.make (-1, 0.0, None)
+
+let current_stamp generation =
+  let generation = generation () in
+  let now = Unix.gettimeofday () in
+  match Atomic.get driver with
+  | g, read_at, version
+    when g = generation && now -. read_at < driver_check_interval ->
+      {generation; driver= version}
+  | _ ->
+      let version = driver_version () in
+      Atomic.set driver (generation, now, version) ;
+      {generation; driver= version}
+
+type ('k, 'v) t = {
+    name: string
+  ; capacity: int
+  ; attach_generation: unit -> int
+  ; m: Mutex.t
+  ; table: ('k, 'v) Hashtbl.t
+  ; mutable stamp: stamp
+  ; mutable hits: int
+  ; mutable misses: int
+}
+
+let create ?(capacity = 1024) ?(generation = Nvml.NVML.generation) name =
+  {
+    name
+  ; capacity
+  ; attach_generation= generation
+  ; m= Mutex.create ()
+  ; table= Hashtbl.create 16
+  ; stamp= current_stamp generation
+  ; hits= 0
+  ; misses= 0
+  }
+
+let with_lock t f =
+  Mutex.lock t.m ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock t.m) f
+
+let find_or_add t key compute =
+  let stamp = current_stamp t.attach_generation in
+  let cached =
+    with_lock t @@ fun () ->
+    if stamp <> t.stamp then (
+      D.info "%s cache: NVML or driver changed, dropping %d entries" t.name
+        (Hashtbl.length t.table) ;
+      Hashtbl.reset t.table ;
+      t.stamp <- stamp
+    ) ;
+    match Hashtbl.find_opt t.table key with
+    | Some _ as v ->
+        t.hits <- t.hits + 1 ;
+        v
+    | None ->
+        t.misses <- t.misses + 1 ;
+        None
+  in
+  match cached with
+  | Some v ->
+      v
+  | None ->
+      let v = compute () in
+      ( with_lock t @@ fun () ->
+        (* Do not cache a value computed against a previous NVML *)
+        if stamp = t.stamp then (
+          if Hashtbl.length t.table >= t.capacity then Hashtbl.reset t.table ;
+          Hashtbl.replace t.table key v
+        )
+      ) ;
+      v
+
+let hits t = with_lock t @@ fun () -> t.hits
+
+let misses t = with_lock t @@ fun () -> t.misses
@@ -0,0 +1,23 @@
+(** Memoisation of NVML query results that only change when NVML is
+    re-attached or the host driver changes. *)
+
+type ('k, 'v) t
+
+val create :
+  ?capacity:int -> ?generation:(unit -> int) -> string -> ('k, 'v) t
+(** [create name] makes an empty cache, named [name] in logs. Once it holds
+    [capacity] entries (default 1024) it is emptied before adding more.
+    [generation] is the NVML attach generation, [Nvml.NVML.generation] by
+    default. *)
+
+val find_or_add : ('k, 'v) t -> 'k -> (unit -> 'v) -> 'v
+(** [find_or_add t key compute] returns the value cached for [key], or the
+    result of [compute ()], which is cached unless it raises. [compute] runs
+    without holding the cache's lock. All entries are dropped whenever the
+    NVML attach generation or the version of the loaded driver changed since
+    the last lookup. The driver version is only read again after a change of
+    generation or once a minute. *)
+
+val hits : ('k, 'v) t -> int
+
+val misses : ('k, 'v) t -> int
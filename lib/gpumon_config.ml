@@ -11,50 +11,17 @@ let bind_map f items =
   in
   aux [] items
 
-(* Metrics which require calling nvmlDeviceGetMemoryInfo *)
-type memory_metric = Free | Used
-
-(* Metrics which have their own NVML calls. *)
-type other_metric = PowerUsage | Temperature
-
-(* Metrics which require calling nvmlDeviceGetUtilizationRates *)
-type utilisation_metric = Compute | MemoryIO
-
-type metric =
-  | Memory of memory_metric
-  | Utilisation of utilisation_metric
-  | Other of other_metric
+(* See Gpumon_metric.registry for the metrics that can be configured *)
+type metric = Gpumon_metric.t
 
 let metric_of_string str =
-  match String.lowercase_ascii str with
-  | "memoryfree" ->
-      Ok (Memory Free)
-  | "memoryused" ->
-      Ok (Memory Used)
-  | "temperature" ->
-      Ok (Other Temperature)
-  | "powerusage" ->
-      Ok (Other PowerUsage)
-  | "compute" ->
-      Ok (Utilisation Compute)
-  | "memoryio" ->
-      Ok (Utilisation MemoryIO)
-  | _ ->
+  match Gpumon_metric.of_name str with
+  | Some metric ->
+      Ok metric
+  | None ->
       Error (`Parse_failure str)
 
-let string_of_metric = function
-  | Memory Free ->
-      "memoryfree"
-  | Memory Used ->
-      "memoryused"
-  | Other Temperature ->
-      "temperature"
-  | Other PowerUsage ->
-      "powerusage"
-  | Utilisation Compute ->
-      "compute"
-  | Utilisation MemoryIO ->
-      "memoryio"
+let string_of_metric metric = metric.Gpumon_metric.name
 
 let metric_of_rpc = function
   | Rpc.String str ->
@@ -186,6 +153,100 @@ let of_file path =
   else
     Error `Does_not_exist
 
+type error =
+  [`Parse_failure of string | `Unknown_version of string | `Does_not_exist]
+
+(* A device type matching any subsystem is stored under [Any], so a lookup
+   first tries the exact subsystem and then falls back to it. *)
+type 'a index = (int32 * int32 * int32 requirement, 'a) Hashtbl.t
+
+let index compile configs =
+  let table = Hashtbl.create 64 in
+  List.iter
+    (fun (vendor_id, config) ->
+      List.iter
+        (fun {device_id; subsystem_device_id; metrics} ->
+          let key = (vendor_id, device_id, subsystem_device_id) in
+          (* Keep the first entry for a key, as a linear search would. *)
+          if not (Hashtbl.mem table key) then
+            Hashtbl.add table key (compile metrics)
+        )
+        config.device_types
+    )
+    configs ;
+  table
+
+let lookup table ~vendor_id ~device_id ~subsystem_device_id =
+  match
+    Hashtbl.find_opt table (vendor_id, device_id, Match subsystem_device_id)
+  with
+  | Some _ as plan ->
+      plan
+  | None ->
+      Hashtbl.find_opt table (vendor_id, device_id, Any)
+
+module Watch = struct
+  type 'a t = {
+      path: string
+    ; load: config -> 'a
+    ; default: 'a
+    ; on_error: error -> unit
+    ; mutable stamp: (float * int * int) option
+    ; mutable current: 'a
+    ; mutable generation: int
+  }
+
+  let create ~path ~load ~default ~on_error =
+    {
+      path
+    ; load
+    ; default
+    ; on_error
+    ; stamp= None
+    ; current= default
+    ; generation= 0
+    }
+
+  (* Modification time, size and inode together also catch a file being
+     atomically replaced within the mtime granularity. *)
+  let stamp_of path =
+    match Unix.stat path with
+    | {Unix.st_mtime; st_size; st_ino; _} ->
+        Some (st_mtime, st_size, st_ino)
+    | exception Unix.Unix_error _ ->
+        None
+
+  let replace t stamp value =
+    t.stamp <- stamp ;
+    t.current <- value ;
+    t.generation <- t.generation + 1
+
+  let refresh t =
+    let stamp = stamp_of t.path in
+    if stamp <> t.stamp || t.generation = 0 then
+      match stamp with
+      | None ->
+          t.on_error `Does_not_exist ;
+          replace t None t.default
+      | Some _ -> (
+        match of_file t.path with
+        | Ok config ->
+            replace t stamp (t.load config)
+        | Error err ->
+            t.on_error err ;
+            (* Remember the stamp so a broken file is reported once, but
+               keep serving the last configuration that did load. *)
+            if t.generation = 0 then
+              replace t stamp t.default
+            else
+              t.stamp <- stamp
+      )
+
+  let get t = refresh t ; t.current
+
+  let generation t = t.generation
+end
+
 let to_string config =
   Rpc.Dict
     (List.map
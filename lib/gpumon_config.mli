@@ -1,16 +1,7 @@
-(* Metrics which require calling nvmlDeviceGetMemoryInfo *)
-type memory_metric = Free | Used
+type metric = Gpumon_metric.t
+(** Metrics are named in the config file as in Gpumon_metric.registry. *)
 
-(* Metrics which have their own NVML calls. *)
-type other_metric = PowerUsage | Temperature
-
-(* Metrics which require calling nvmlDeviceGetUtilizationRates *)
-type utilisation_metric = Compute | MemoryIO
-
-type metric =
-  | Memory of memory_metric
-  | Utilisation of utilisation_metric
-  | Other of other_metric
+val string_of_metric : metric -> string
 
 type 'a requirement = Match of 'a | Any
 
@@ -22,6 +13,9 @@ type device_type = {
 
 type config = {device_types: device_type list}
 
+type error =
+  [`Parse_failure of string | `Unknown_version of string | `Does_not_exist]
+
 val of_string :
      string
   -> (config, [`Parse_failure of string | `Unknown_version of string]) result
@@ -34,3 +28,44 @@ val of_file :
      result
 
 val to_string : config -> string
+
+type 'a index
+(** Device types of several vendors' configs, indexed by
+    (vendor ID, device ID, subsystem device ID). *)
+
+val index : (metric list -> 'a) -> (int32 * config) list -> 'a index
+(** [index compile configs] compiles the metric list of every device type
+    with [compile] and indexes the result. If several device types share a
+    key, the first one wins. *)
+
+val lookup :
+     'a index
+  -> vendor_id:int32
+  -> device_id:int32
+  -> subsystem_device_id:int32
+  -> 'a option
+(** Find the entry for a device. An entry matching the subsystem device ID
+    exactly takes precedence over one that accepts [Any] subsystem. *)
+
+(** A config file that is only re-read when it changes on disk. *)
+module Watch : sig
+  type 'a t
+
+  val create :
+       path:string
+    -> load:(config -> 'a)
+    -> default:'a
+    -> on_error:(error -> unit)
+    -> 'a t
+  (** [load] turns a freshly parsed config into the value handed out by
+      [get]. [default] is used while the file does not exist or has never
+      been parsed successfully; once it has, a later parse failure keeps
+      the last good value. *)
+
+  val get : 'a t -> 'a
+  (** Return the current value, first re-reading the file if its
+      modification time, size or inode changed. *)
+
+  val generation : 'a t -> int
+  (** Incremented whenever the value returned by [get] is replaced. *)
+end
@@ -0,0 +1,56 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(** A datasource whose name, description and other metadata are built once,
+    when a device is discovered; each report only fills in its value from
+    slot [slot] of [sample]. *)
+type t = {
+    owner: Rrd.ds_owner
+  ; ds: Ds.ds
+  ; sample: Nvml.sample
+  ; slot: int
+  ; value: float -> Rrd.ds_value_type
+}
+
+let make ~owner ~sample ~slot ~value ~name ~description ~units
+    ?(ty = Rrd.Gauge) ?min ?max () =
+  {
+    owner
+  ; ds=
+      Ds.ds_make ~name ~description ~value:(value 0.0) ~ty ~default:false
+        ~units ?min ?max ()
+  ; sample
+  ; slot
+  ; value
+  }
+
+let int64 x = Rrd.VT_Int64 (Int64.of_float x)
+
+let float x = Rrd.VT_Float x
+
+(** A percentage reported as a fraction *)
+let fraction x = Rrd.VT_Float (x /. 100.0)
+
+(** Add the datasources of those templates whose last reading succeeded to
+    [acc]. *)
+let generate templates acc =
+  List.fold_left
+    (fun acc t ->
+      if t.sample.Nvml.status.(t.slot) = 0 then
+        let value = t.value t.sample.Nvml.values.(t.slot) in
+        (t.owner, {t.ds with Ds.ds_value= value}) :: acc
+      else
+        acc
+    )
+    acc templates
@@ -0,0 +1,110 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Counts of the NVML events of each GPU, reported as counters. They are
+   filled in by the event thread of Gpumon_sampler. *)
+
+(* Slots of the counts *)
+module Slot = struct
+  let xid = 0
+
+  let page_retirement = 1
+
+  let ecc_single_bit = 2
+
+  let ecc_double_bit = 3
+
+  let clock = 4
+
+  let count = 5
+end
+
+(** Event types waited for *)
+let mask =
+  Nvml.Event.(
+    xid_critical_error lor single_bit_ecc_error lor double_bit_ecc_error
+    lor clock
+  )
+
+(* XIDs recording that a page of framebuffer memory has been retired *)
+let page_retirement_xids = [63; 64]
+
+(* XIDs after which a GPU may be unusable or may have disappeared: double
+   bit ECC error, NVLink error, fallen off the bus, ECC errors and
+   uncontained ECC errors *)
+let critical_xids = [48; 74; 79; 92; 94; 95]
+
+type t = {counts: Nvml.sample}
+
+(* The counts survive rediscovery of the GPUs, as the RRDs expect counters
+   to keep counting. Only used by the thread maintaining the inventory. *)
+let by_bus_id = Hashtbl.create 8
+
+let find_or_create bus_id =
+  match Hashtbl.find_opt by_bus_id bus_id with
+  | Some t ->
+      t
+  | None ->
+      (* Not reported until the GPU's events are being waited for *)
+      let t =
+        {
+          counts=
+            {
+              Nvml.values= Array.make Slot.count 0.0
+            ; status= Array.make Slot.count 1
+            }
+        }
+      in
+      Hashtbl.replace by_bus_id bus_id t ;
+      t
+
+let enable t = Array.fill t.counts.Nvml.status 0 Slot.count 0
+
+let count t slot =
+  t.counts.Nvml.values.(slot) <- t.counts.Nvml.values.(slot) +. 1.0
+
+(** Count an event of the GPU. Returns whether the event is critical, that
+    is whether the GPU should be looked at again right away. *)
+let record t event_type data =
+  if event_type = Nvml.Event.xid_critical_error then (
+    count t Slot.xid ;
+    if List.mem data page_retirement_xids then count t Slot.page_retirement ;
+    List.mem data critical_xids
+  ) else if event_type = Nvml.Event.double_bit_ecc_error then (
+    count t Slot.ecc_double_bit ; true
+  ) else if event_type = Nvml.Event.single_bit_ecc_error then (
+    count t Slot.ecc_single_bit ; false
+  ) else if event_type = Nvml.Event.clock then (
+    count t Slot.clock ; false
+  ) else
+    false
+
+let make_dss bus_id_escaped t =
+  let counter slot name description =
+    Gpumon_dss.make ~owner:Rrd.Host ~sample:t.counts ~slot
+      ~value:Gpumon_dss.int64
+      ~name:(Printf.sprintf "gpu_%s_%s" name bus_id_escaped)
+      ~description ~units:"events" ~ty:Rrd.Derive ~min:0.0 ()
+  in
+  [
+    counter Slot.xid "xid_errors" "XID errors reported by this GPU"
+  ; counter Slot.page_retirement "page_retirements"
+      "XID errors of this GPU recording the retirement of memory pages"
+  ; counter Slot.ecc_single_bit "ecc_single_bit_events"
+      "Single bit ECC errors of this GPU"
+  ; counter Slot.ecc_double_bit "ecc_double_bit_events"
+      "Double bit ECC errors of this GPU"
+  ; counter Slot.clock "clock_events"
+      "Changes of the clocks of this GPU, such as throttling"
+  ]
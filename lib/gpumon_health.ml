@@ -0,0 +1,91 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Whether the last sample of a GPU succeeded, and when to try again if it
+   did not. A GPU whose sampling fails is retried with exponential backoff,
+   so that a GPU that has fallen off the bus costs little, while the other
+   GPUs keep being sampled. Its datasources keep reporting the last good
+   values, flagged as stale. *)
+
+(** Delay after the first failure, in seconds; it doubles with each further
+    failure. *)
+let initial_backoff = 5.0
+
+let max_backoff = 300.0
+
+type t = {
+    mx: Mutex.t
+  ; mutable busy: bool  (** a sample has been started and not finished *)
+  ; mutable failures: int  (** consecutive failed samples *)
+  ; mutable retry_at: float
+  ; mutable overran: bool  (** the sample in progress missed its deadline *)
+  ; sample: Nvml.sample  (** slot 0 is 1 when stale, 0 otherwise *)
+}
+
+let create () =
+  {
+    mx= Mutex.create ()
+  ; busy= false
+  ; failures= 0
+  ; retry_at= 0.0
+  ; overran= false
+  ; sample= {Nvml.values= [|0.0|]; status= [|0|]}
+  }
+
+let with_lock t f =
+  Mutex.lock t.mx ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock t.mx) f
+
+let backoff failures =
+  Float.min max_backoff
+    (initial_backoff *. (2.0 ** float_of_int (max 0 (failures - 1))))
+
+(** Whether a sample should be started at [now]: none is in progress and
+    the device is not backing off. If so, the device is marked busy until
+    [finish] is called. *)
+let start t now =
+  with_lock t @@ fun () ->
+  let due = (not t.busy) && now >= t.retry_at in
+  if due then t.busy <- true ;
+  due
+
+(** Record the outcome of the sample started last. Returns the number of
+    consecutive failures. *)
+let finish t now ~ok =
+  with_lock t @@ fun () ->
+  t.busy <- false ;
+  t.overran <- false ;
+  if ok then (
+    t.failures <- 0 ;
+    t.retry_at <- 0.0
+  ) else (
+    t.failures <- t.failures + 1 ;
+    t.retry_at <- now +. backoff t.failures
+  ) ;
+  t.failures
+
+(** Note that the sample in progress missed its deadline. Returns [true]
+    the first time for that sample. *)
+let overrun t =
+  with_lock t @@ fun () ->
+  let first = t.busy && not t.overran in
+  if t.busy then t.overran <- true ;
+  first
+
+let busy t = with_lock t @@ fun () -> t.busy
+
+let stale t = with_lock t @@ fun () -> t.busy || t.failures > 0
+
+(** Set the value of the stale flag datasource *)
+let update t = t.sample.Nvml.values.(0) <- (if stale t then 1.0 else 0.0)
@@ -0,0 +1,147 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Readings taken several times per reporting interval, so that spikes
+   shorter than the interval show up in the reported minimum, maximum and
+   99th percentile. *)
+
+(** Seconds between readings; 0 disables high-frequency sampling. *)
+let interval = ref 0.0
+
+(** Seconds between two reports to rrdd. *)
+let report_interval = 5.0
+
+(* Room for the readings of two reporting intervals, in case one report is
+   late, but never more than this. *)
+let max_capacity = 1024
+
+let enabled () = !interval > 0.0
+
+type t = {
+    m: Mutex.t
+  ; mutable mask: int
+        (** less the metrics found unsupported, see [sample] *)
+  ; sample: Nvml.sample
+  ; compute: Gpumon_ring.t
+  ; power: Gpumon_ring.t
+  ; summary: Gpumon_ring.summary
+  ; summaries: Nvml.sample  (** the statistics reported, see [stat] *)
+  ; dss: Gpumon_dss.t list
+}
+
+let sampled_metrics =
+  Nvml.Metric.mask [Nvml.Metric.utilisation_compute; Nvml.Metric.power_usage]
+
+(* Slots of the statistics of a ring in [summaries] *)
+let stats = ["min"; "max"; "avg"; "p99"]
+
+let stat_count = List.length stats
+
+let compute_base = 0
+
+let power_base = stat_count
+
+let make_dss bus_id_escaped mask summaries =
+  let dss metric base name ~value ~units ~description =
+    if mask land Nvml.Metric.bit metric = 0 then
+      []
+    else
+      List.mapi
+        (fun i stat ->
+          Gpumon_dss.make ~owner:Rrd.Host ~sample:summaries ~slot:(base + i)
+            ~value
+            ~name:(Printf.sprintf "%s_%s_%s" name stat bus_id_escaped)
+            ~description:(Printf.sprintf "%s (%s)" description stat)
+            ~units ()
+        )
+        stats
+  in
+  dss Nvml.Metric.utilisation_compute compute_base "gpu_utilisation_compute"
+    ~value:Gpumon_dss.fraction ~units:"(fraction)"
+    ~description:
+      "Proportion of time during which one or more kernels was executing on \
+       this GPU, over readings taken within the last sample period"
+  @ dss Nvml.Metric.power_usage power_base "gpu_power_usage"
+      ~value:Gpumon_dss.float ~units:"mW"
+      ~description:
+        "Power usage of this GPU, over readings taken within the last sample \
+         period"
+
+(** High-frequency sampling of those of [mask]'s metrics that are worth it,
+    if any. *)
+let create bus_id_escaped mask =
+  let mask = mask land sampled_metrics in
+  if enabled () && mask <> 0 then
+    let capacity =
+      min max_capacity
+        (2 * int_of_float (Float.ceil (report_interval /. !interval)))
+    in
+    let summaries =
+      {
+        Nvml.values= Array.make (2 * stat_count) 0.0
+      ; status= Array.make (2 * stat_count) 1
+      }
+    in
+    Some
+      {
+        m= Mutex.create ()
+      ; mask
+      ; sample= Nvml.make_sample ()
+      ; compute= Gpumon_ring.create capacity
+      ; power= Gpumon_ring.create capacity
+      ; summary= Gpumon_ring.make_summary ()
+      ; summaries
+      ; dss= make_dss bus_id_escaped mask summaries
+      }
+  else
+    None
+
+let with_lock t f =
+  Mutex.lock t.m ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock t.m) f
+
+let push t ring metric =
+  if t.sample.Nvml.status.(metric) = 0 then
+    Gpumon_ring.push ring t.sample.Nvml.values.(metric)
+
+(** Take one reading. Only called from the high-frequency sampling thread,
+    which owns [t.sample]. *)
+let sample interface device t =
+  Nvml.device_sample interface device t.mask t.sample ;
+  (* Like the sampler, stop asking for what the GPU refuses *)
+  t.mask <- t.mask land lnot (Nvml.unsupported_metrics t.mask t.sample) ;
+  with_lock t @@ fun () ->
+  push t t.compute Nvml.Metric.utilisation_compute ;
+  push t t.power Nvml.Metric.power_usage
+
+(* Move the statistics of the readings in [ring] to [summaries] and start
+   over; without readings, the statistics are not reported. *)
+let summarise t ring base =
+  let ok = Gpumon_ring.summarise ring t.summary in
+  let s = t.summary and values = t.summaries.Nvml.values in
+  values.(base) <- s.Gpumon_ring.min ;
+  values.(base + 1) <- s.Gpumon_ring.max ;
+  values.(base + 2) <- s.Gpumon_ring.mean ;
+  values.(base + 3) <- s.Gpumon_ring.p99 ;
+  Array.fill t.summaries.Nvml.status base stat_count (if ok then 0 else 1) ;
+  Gpumon_ring.clear ring
+
+(** Add datasources summarising the readings taken since the last call to
+    [acc]. *)
+let generate_dss t acc =
+  with_lock t (fun () ->
+      summarise t t.compute compute_base ;
+      summarise t t.power power_base
+  ) ;
+  Gpumon_dss.generate t.dss acc
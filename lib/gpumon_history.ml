@@ -0,0 +1,176 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* History of recent readings, for post-mortems: a ring of fixed-size
+   records in a memory-mapped file. The file's size is fixed when it is
+   created, appending a record only stores into the mapping, and the
+   records survive a restart of the daemon. gpumon_history_dump in tools/
+   prints them.
+
+   The file is an array of float64 in host byte order: a header, see
+   [Header], followed by [capacity] records, see [Record]. Record [i] of
+   all those ever appended is in slot [i mod capacity]. *)
+
+open Bigarray
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+(** The ring file; it must not be on a tmpfs to survive a reboot. *)
+let path = ref "/var/lib/xcp/gpumon-history"
+
+(** Size of the ring file in MiB; 0 disables the history. *)
+let size_mib = ref 0
+
+(** Seconds between two records of a GPU *)
+let interval = ref 1.0
+
+let enabled () = !size_mib > 0 && !interval > 0.0
+
+let magic = 0x47504d48 (* GPMH *)
+
+let version = 1
+
+module Header = struct
+  let magic = 0
+
+  let version = 1
+
+  let capacity = 2  (** records *)
+
+  let record_size = 3  (** floats *)
+
+  let appended = 4  (** records appended since the file was created *)
+
+  let size = 8
+end
+
+(** A record is the readings of one GPU at one time. A reading that failed
+    is nan, as is the timestamp of a record being written. *)
+module Record = struct
+  let timestamp = 0  (** Unix time *)
+
+  let bus_id = 1  (** see [encode_bus_id] *)
+
+  let values = 2  (** metric [m] is at [values + m], in NVML's units *)
+
+  let size = values + Nvml.Metric.count
+end
+
+type t = {data: (float, float64_elt, c_layout) Array1.t; capacity: int}
+
+(* Bus IDs are stored as domain << 16 | bus << 8 | device << 3 | function *)
+let encode_bus_id bus_id =
+  try
+    Scanf.sscanf bus_id "%x:%x:%x.%x%!" (fun domain bus device fn ->
+        float_of_int
+          ((domain lsl 16) lor (bus lsl 8) lor (device lsl 3) lor fn)
+    )
+  with _ -> Float.nan
+
+let decode_bus_id x =
+  if Float.is_nan x then
+    "unknown"
+  else
+    let n = int_of_float x in
+    Printf.sprintf "%04x:%02x:%02x.%x" (n lsr 16)
+      ((n lsr 8) land 0xff)
+      ((n lsr 3) land 0x1f)
+      (n land 7)
+
+let floats capacity = Header.size + (capacity * Record.size)
+
+(** The number of records that fit in a file of [bytes] bytes *)
+let capacity_of_bytes bytes = max 1 (((bytes / 8) - Header.size) / Record.size)
+
+let map fd ~shared length =
+  array1_of_genarray (Unix.map_file fd float64 c_layout shared [|length|])
+
+let is_valid data capacity =
+  data.{Header.magic} = float_of_int magic
+  && data.{Header.version} = float_of_int version
+  && data.{Header.capacity} = float_of_int capacity
+  && data.{Header.record_size} = float_of_int Record.size
+
+(** Open the ring file at [path] for appending. Its records are kept if it
+    has the layout and capacity asked for; otherwise it starts out
+    empty. *)
+let create path ~capacity =
+  let fd = Unix.openfile path Unix.[O_RDWR; O_CREAT; O_CLOEXEC] 0o644 in
+  Fun.protect ~finally:(fun () -> Unix.close fd) @@ fun () ->
+  let length = floats capacity in
+  if (Unix.fstat fd).Unix.st_size <> length * 8 then Unix.ftruncate fd 0 ;
+  (* The mapping outlives the descriptor, and grows the file if needed *)
+  let data = map fd ~shared:true length in
+  if not (is_valid data capacity) then (
+    D.info "Starting a new history of %d records in %s" capacity path ;
+    Array1.fill data 0.0 ;
+    data.{Header.magic} <- float_of_int magic ;
+    data.{Header.version} <- float_of_int version ;
+    data.{Header.capacity} <- float_of_int capacity ;
+    data.{Header.record_size} <- float_of_int Record.size
+  ) ;
+  {data; capacity}
+
+(** Record the readings of [mask] in [sample]. Only stores into the
+    mapping; must not be called from more than one thread. *)
+let append t ~timestamp ~bus_id ~mask sample =
+  let data = t.data in
+  let appended = int_of_float data.{Header.appended} in
+  let base = Header.size + ((appended mod t.capacity) * Record.size) in
+  data.{base + Record.timestamp} <- Float.nan ;
+  data.{base + Record.bus_id} <- bus_id ;
+  for m = 0 to Nvml.Metric.count - 1 do
+    data.{base + Record.values + m} <-
+      ( if mask land Nvml.Metric.bit m <> 0 && sample.Nvml.status.(m) = 0 then
+          sample.Nvml.values.(m)
+      else
+        Float.nan
+      )
+  done ;
+  data.{base + Record.timestamp} <- timestamp ;
+  data.{Header.appended} <- float_of_int (appended + 1)
+
+(** Open an existing ring file for reading, while gpumon may be appending
+    to it. *)
+let open_in path =
+  let fd = Unix.openfile path Unix.[O_RDONLY; O_CLOEXEC] 0 in
+  Fun.protect ~finally:(fun () -> Unix.close fd) @@ fun () ->
+  let length = (Unix.fstat fd).Unix.st_size / 8 in
+  let invalid () = failwith (path ^ " is not a gpumon history file") in
+  if length < Header.size then invalid () ;
+  let data = map fd ~shared:false length in
+  let capacity = int_of_float data.{Header.capacity} in
+  if not (is_valid data capacity && length >= floats capacity) then
+    invalid () ;
+  {data; capacity}
+
+type record = {timestamp: float; bus_id: string; values: float array}
+
+(** Call [f] on each complete record, from the oldest to the newest. *)
+let iter t f =
+  let data = t.data in
+  let appended = int_of_float data.{Header.appended} in
+  for i = max 0 (appended - t.capacity) to appended - 1 do
+    let base = Header.size + ((i mod t.capacity) * Record.size) in
+    let timestamp = data.{base + Record.timestamp} in
+    if not (Float.is_nan timestamp) then
+      f
+        {
+          timestamp
+        ; bus_id= decode_bus_id data.{base + Record.bus_id}
+        ; values=
+            Array.init Nvml.Metric.count (fun m ->
+                data.{base + Record.values + m}
+            )
+        }
+  done
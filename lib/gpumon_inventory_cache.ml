@@ -0,0 +1,144 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* What gpumon found out about the host last time it ran, kept so that a
+   restarted gpumon can report at once: the shared pages its datasources
+   took and the devices NVML reported, with their PCI IDs and the metrics
+   resolved for them. The file is on a tmpfs, so it does not outlive the
+   boot whose hardware it describes.
+
+   Nothing in the cache is trusted without checking it against NVML: it is
+   only used for the first discovery after startup, and only if NVML still
+   reports as many devices and finds each at its cached bus ID. *)
+
+module Unixext = Xapi_stdext_unix.Unixext
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+let path = ref "/var/run/gpumon/inventory"
+
+type gpu = {
+    bus_id: string
+  ; ids: Gpumon_backend.pci_ids
+  ; metrics: string list
+        (** names of the metrics resolved for the GPU; none if unmonitored *)
+}
+
+type t = {
+    pages: int  (** shared pages the datasources needed *)
+  ; gpus: gpu list  (** in NVML index order *)
+}
+
+let empty = {pages= 1; gpus= []}
+
+let header = "gpumon-inventory 1"
+
+let to_string t =
+  let b = Buffer.create 256 in
+  Printf.bprintf b "%s\npages %d\n" header t.pages ;
+  List.iter
+    (fun g ->
+      Printf.bprintf b "gpu %s 0x%lx 0x%lx 0x%lx %s\n" g.bus_id
+        g.ids.Gpumon_backend.vendor_id g.ids.device_id g.ids.subsystem_device_id
+        (String.concat "," g.metrics)
+    )
+    t.gpus ;
+  Buffer.contents b
+
+let gpu_of_line line =
+  Scanf.sscanf line "gpu %s %li %li %li %s%!"
+    (fun bus_id vendor_id device_id subsystem_device_id metrics ->
+      {
+        bus_id
+      ; ids= {Gpumon_backend.vendor_id; device_id; subsystem_device_id}
+      ; metrics= String.split_on_char ',' metrics |> List.filter (( <> ) "")
+      }
+  )
+
+(** The cache in [s], or None unless [s] is a cache of this version *)
+let of_string s =
+  match String.split_on_char '\n' s with
+  | h :: pages :: gpus when h = header -> (
+    try
+      Some
+        {
+          pages= Scanf.sscanf pages "pages %d%!" Fun.id
+        ; gpus= List.filter (( <> ) "") gpus |> List.map gpu_of_line
+        }
+    with Scanf.Scan_failure _ | Failure _ | End_of_file -> None
+  )
+  | _ ->
+      None
+
+(* What the file holds, as far as we know *)
+let saved = ref None
+
+(* The cache loaded at startup, until the first discovery takes it *)
+let loaded = ref None
+
+let current = ref empty
+
+let m = Mutex.create ()
+
+let with_lock f =
+  Mutex.lock m ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock m) f
+
+(** Read the cache left by the previous run, if any *)
+let load () =
+  let t =
+    try of_string (Unixext.string_of_file !path)
+    with Sys_error _ | Unix.Unix_error _ -> None
+  in
+  ( match t with
+  | Some t ->
+      D.info "Loaded the inventory of %d GPUs on %d pages from %s"
+        (List.length t.gpus) t.pages !path
+  | None ->
+      D.info "No usable inventory in %s" !path
+  ) ;
+  with_lock (fun () ->
+      saved := t ;
+      loaded := t ;
+      current := Option.value ~default:empty t
+  ) ;
+  t
+
+(** The cache loaded at startup, once: later discoveries must not rely on
+    it. *)
+let take () =
+  with_lock @@ fun () ->
+  let t = !loaded in
+  loaded := None ; t
+
+(* The file is only rewritten when its content changes, which is rare; a
+   failed write is not retried until then either, as this runs every tick. *)
+let update f =
+  with_lock @@ fun () ->
+  let t = f !current in
+  current := t ;
+  if !saved <> Some t then (
+    saved := Some t ;
+    try
+      D.info "Saving the inventory of %d devices on %d pages to %s"
+        (List.length t.gpus) t.pages !path ;
+      Unixext.mkdir_rec (Filename.dirname !path) 0o755 ;
+      Unixext.write_string_to_file !path (to_string t)
+    with e ->
+      D.warn "Could not save the inventory to %s: %s" !path
+        (Printexc.to_string e)
+  )
+
+let set_pages pages = update (fun t -> {t with pages})
+
+let set_gpus gpus = update (fun t -> {t with gpus})
@@ -0,0 +1,199 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* The GPU metrics gpumon knows how to read. Adding a metric means adding
+   an entry here, its slot to Nvml.Metric, and its reading to the
+   sample_calls table in nvml_stubs.c; a new NVML call also needs an
+   Nvml.Capability. *)
+
+(** How a reading is turned into a datasource value *)
+type value = Int  (** rounded to an integer *) | Float | Percent_as_fraction
+
+type t = {
+    name: string  (** as used in monitoring.conf *)
+  ; slot: int  (** Nvml.Metric slot the reading is stored in *)
+  ; capability: Nvml.Capability.t  (** needed to make the call *)
+  ; call: string
+        (** NVML function providing the reading; all enabled metrics of the
+            same call are read with a single call *)
+  ; ds_prefix: string  (** datasource name, followed by the bus ID *)
+  ; description: string
+  ; units: string
+  ; ty: Rrd.ds_type
+  ; value: value
+  ; min: float
+  ; max: float
+}
+
+let metric ?(ty = Rrd.Gauge) ?(value = Int) ?(min = neg_infinity)
+    ?(max = infinity) name slot (capability, call) ds_prefix description units
+    =
+  {
+    name
+  ; slot
+  ; capability
+  ; call
+  ; ds_prefix
+  ; description
+  ; units
+  ; ty
+  ; value
+  ; min
+  ; max
+  }
+
+let fraction name slot call ds_prefix description =
+  metric ~value:Percent_as_fraction ~min:0.0 ~max:1.0 name slot call ds_prefix
+    description "(fraction)"
+
+let counter name slot call ds_prefix description units =
+  metric ~ty:Rrd.Derive ~min:0.0 name slot call ds_prefix description units
+
+module M = Nvml.Metric
+
+(* The NVML calls providing the readings *)
+module Call = struct
+  module C = Nvml.Capability
+
+  let memory_info = (C.memory_info, "nvmlDeviceGetMemoryInfo")
+
+  let temperature = (C.temperature, "nvmlDeviceGetTemperature")
+
+  let power_usage = (C.power_usage, "nvmlDeviceGetPowerUsage")
+
+  let utilization_rates =
+    (C.utilization_rates, "nvmlDeviceGetUtilizationRates")
+
+  let clock_info = (C.clock_info, "nvmlDeviceGetClockInfo")
+
+  let pcie_throughput = (C.pcie_throughput, "nvmlDeviceGetPcieThroughput")
+
+  let encoder_utilization =
+    (C.encoder_utilization, "nvmlDeviceGetEncoderUtilization")
+
+  let decoder_utilization =
+    (C.decoder_utilization, "nvmlDeviceGetDecoderUtilization")
+
+  let total_ecc_errors = (C.total_ecc_errors, "nvmlDeviceGetTotalEccErrors")
+
+  let total_energy_consumption =
+    (C.total_energy_consumption, "nvmlDeviceGetTotalEnergyConsumption")
+end
+
+let memory_free =
+  metric "memoryfree" M.memory_free Call.memory_info
+    "gpu_memory_free_" "Unallocated framebuffer memory" "B"
+
+let memory_used =
+  metric "memoryused" M.memory_used Call.memory_info "gpu_memory_used_"
+    "Allocated framebuffer memory" "B"
+
+let temperature =
+  metric "temperature" M.temperature Call.temperature "gpu_temperature_"
+    "Temperature of this GPU" "°C"
+
+let power_usage =
+  metric "powerusage" M.power_usage Call.power_usage "gpu_power_usage_"
+    "Power usage of this GPU" "mW"
+
+let compute =
+  fraction "compute" M.utilisation_compute Call.utilization_rates
+    "gpu_utilisation_compute_"
+    "Proportion of time over the past sample period during which one or \
+     more kernels was executing on this GPU"
+
+let memory_io =
+  fraction "memoryio" M.utilisation_memory_io Call.utilization_rates
+    "gpu_utilisation_memory_io_"
+    "Proportion of time over the past sample period during which global \
+     (device) memory was being read or written on this GPU"
+
+let clock_sm =
+  metric "clocksm" M.clock_sm Call.clock_info "gpu_clock_sm_"
+    "Clock speed of the streaming multiprocessors of this GPU" "MHz"
+
+let clock_memory =
+  metric "clockmemory" M.clock_memory Call.clock_info "gpu_clock_memory_"
+    "Clock speed of the memory of this GPU" "MHz"
+
+let pcie_tx =
+  metric "pcietx" M.pcie_tx Call.pcie_throughput "gpu_pcie_tx_"
+    "PCIe bytes transmitted by this GPU per second, over the last 20ms"
+    "B/s"
+
+let pcie_rx =
+  metric "pcierx" M.pcie_rx Call.pcie_throughput "gpu_pcie_rx_"
+    "PCIe bytes received by this GPU per second, over the last 20ms" "B/s"
+
+let encoder =
+  fraction "encoder" M.utilisation_encoder Call.encoder_utilization
+    "gpu_utilisation_encoder_"
+    "Proportion of time over the past sample period during which the video \
+     encoder of this GPU was busy"
+
+let decoder =
+  fraction "decoder" M.utilisation_decoder Call.decoder_utilization
+    "gpu_utilisation_decoder_"
+    "Proportion of time over the past sample period during which the video \
+     decoder of this GPU was busy"
+
+let ecc_corrected =
+  counter "ecccorrected" M.ecc_corrected Call.total_ecc_errors
+    "gpu_ecc_errors_corrected_"
+    "Corrected memory errors of this GPU since the driver was loaded"
+    "errors"
+
+let ecc_uncorrected =
+  counter "eccuncorrected" M.ecc_uncorrected Call.total_ecc_errors
+    "gpu_ecc_errors_uncorrected_"
+    "Uncorrected memory errors of this GPU since the driver was loaded"
+    "errors"
+
+let energy =
+  counter "energy" M.energy Call.total_energy_consumption "gpu_energy_"
+    "Energy consumed by this GPU since the driver was loaded; its rate is \
+     the average power usage"
+    "mJ"
+
+let registry =
+  [
+    memory_free
+  ; memory_used
+  ; temperature
+  ; power_usage
+  ; compute
+  ; memory_io
+  ; clock_sm
+  ; clock_memory
+  ; pcie_tx
+  ; pcie_rx
+  ; encoder
+  ; decoder
+  ; ecc_corrected
+  ; ecc_uncorrected
+  ; energy
+  ]
+
+let of_name name =
+  let name = String.lowercase_ascii name in
+  List.find_opt (fun m -> m.name = name) registry
+
+let to_ds_value metric reading =
+  match metric.value with
+  | Int ->
+      Rrd.VT_Int64 (Int64.of_float reading)
+  | Float ->
+      Rrd.VT_Float reading
+  | Percent_as_fraction ->
+      Rrd.VT_Float (reading /. 100.0)
@@ -0,0 +1,224 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* The latest report in OpenMetrics text format, served over HTTP on a
+   Unix socket. A report is rendered once, together with the whole HTTP
+   response carrying it, when the reporting thread publishes it; a scrape
+   only writes that response out, so it never calls into NVML and never
+   waits for the sampler. *)
+
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+(** The socket to serve the metrics on; empty to not serve them *)
+let socket_path = ref ""
+
+(* Seconds a client may take to send its request or to read the response *)
+let client_timeout = 2.0
+
+let max_request = 8192
+
+let content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+let response body =
+  Printf.sprintf
+    "HTTP/1.1 200 OK\r\n\
+     Content-Type: %s\r\n\
+     Content-Length: %d\r\n\
+     Connection: close\r\n\
+     \r\n\
+     %s"
+    content_type (String.length body) body
+
+let method_not_allowed =
+  "HTTP/1.1 405 Method Not Allowed\r\n\
+   Allow: GET\r\n\
+   Content-Length: 0\r\n\
+   Connection: close\r\n\
+   \r\n"
+
+(* Replaced, never modified, by [publish] *)
+let latest = Atomic.make (response "# EOF\n")
+
+let is_name_char = function
+  | 'a' .. 'z' | 'A' .. 'Z' | '0' .. '9' | '_' | ':' ->
+      true
+  | _ ->
+      false
+
+(** Datasource names carry bus IDs, which contain characters not allowed in
+    metric names. *)
+let metric_name name =
+  let name = String.map (fun c -> if is_name_char c then c else '_') name in
+  match name with
+  | "" ->
+      "_"
+  | _ when name.[0] >= '0' && name.[0] <= '9' ->
+      "_" ^ name
+  | _ ->
+      name
+
+let add_escaped buf ~quote s =
+  String.iter
+    (function
+      | '\\' ->
+          Buffer.add_string buf "\\\\"
+      | '\n' ->
+          Buffer.add_string buf "\\n"
+      | '"' when quote ->
+          Buffer.add_string buf "\\\""
+      | c ->
+          Buffer.add_char buf c
+      )
+    s
+
+let add_float buf x =
+  match Float.classify_float x with
+  | FP_nan ->
+      Buffer.add_string buf "NaN"
+  | FP_infinite ->
+      Buffer.add_string buf (if x > 0.0 then "+Inf" else "-Inf")
+  | FP_normal | FP_subnormal | FP_zero ->
+      Printf.bprintf buf "%.15g" x
+
+let add_sample buf name owner ds =
+  Buffer.add_string buf name ;
+  if ds.Ds.ds_type = Rrd.Derive then Buffer.add_string buf "_total" ;
+  ( match owner with
+  | Rrd.Host ->
+      ()
+  | Rrd.VM uuid ->
+      Printf.bprintf buf "{vm=\"%a\"}" (add_escaped ~quote:true) uuid
+  | Rrd.SR uuid ->
+      Printf.bprintf buf "{sr=\"%a\"}" (add_escaped ~quote:true) uuid
+  ) ;
+  Buffer.add_char buf ' ' ;
+  ( match ds.Ds.ds_value with
+  | Rrd.VT_Int64 x ->
+      Buffer.add_string buf (Int64.to_string x)
+  | Rrd.VT_Float x ->
+      add_float buf x
+  | Rrd.VT_Unknown ->
+      Buffer.add_string buf "NaN"
+  ) ;
+  Buffer.add_char buf '\n'
+
+(* Only used by the reporting thread *)
+let buffer = Buffer.create 65536
+
+(** [dss] in OpenMetrics text format. Datasources of the same name, such as
+    those of the vGPUs of different VMs, form one metric family labelled by
+    their owner. Derive datasources are counters, the others gauges. *)
+let render dss =
+  Buffer.clear buffer ;
+  let named =
+    List.map (fun (owner, ds) -> (metric_name ds.Ds.ds_name, owner, ds)) dss
+  in
+  let sorted =
+    List.stable_sort (fun (a, _, _) (b, _, _) -> String.compare a b) named
+  in
+  let family = ref "" in
+  List.iter
+    (fun (name, owner, ds) ->
+      if name <> !family then (
+        family := name ;
+        Printf.bprintf buffer "# TYPE %s %s\n# HELP %s %a\n" name
+          (if ds.Ds.ds_type = Rrd.Derive then "counter" else "gauge")
+          name (add_escaped ~quote:false) ds.Ds.ds_description
+      ) ;
+      add_sample buffer name owner ds
+    )
+    sorted ;
+  Buffer.add_string buffer "# EOF\n" ;
+  Buffer.contents buffer
+
+(** Make [dss] the metrics served from now on. Called by the reporting
+    thread after each report. *)
+let publish dss =
+  if !socket_path <> "" then Atomic.set latest (response (render dss))
+
+(* Whether the request read so far is complete: its headers end with an
+   empty line. *)
+let is_complete request len =
+  len >= 4 && Bytes.sub_string request (len - 4) 4 = "\r\n\r\n"
+
+let read_request fd =
+  let request = Bytes.create max_request in
+  let rec read len =
+    if len = max_request || is_complete request len then
+      len
+    else
+      match Unix.read fd request len (max_request - len) with
+      | 0 ->
+          len
+      | n ->
+          read (len + n)
+  in
+  let len = read 0 in
+  Bytes.sub_string request 0 len
+
+let write_all fd s =
+  let len = String.length s in
+  let rec write offset =
+    if offset < len then
+      write (offset + Unix.write_substring fd s offset (len - offset))
+  in
+  write 0
+
+let serve_client fd =
+  Fun.protect ~finally:(fun () -> Unix.close fd) @@ fun () ->
+  Unix.setsockopt_float fd Unix.SO_RCVTIMEO client_timeout ;
+  Unix.setsockopt_float fd Unix.SO_SNDTIMEO client_timeout ;
+  let request = read_request fd in
+  if String.length request >= 4 && String.sub request 0 4 = "GET " then
+    write_all fd (Atomic.get latest)
+  else
+    write_all fd method_not_allowed
+
+(* A thread per client, so that a slow client does not hold up others *)
+let rec accept_loop socket =
+  ( match Unix.accept ~cloexec:true socket with
+  | fd, _ ->
+      let serve fd =
+        try serve_client fd
+        with e ->
+          D.debug "OpenMetrics client failed: %s" (Printexc.to_string e)
+      in
+      ignore (Thread.create serve fd)
+  | exception Unix.Unix_error (Unix.EINTR, _, _) ->
+      ()
+  | exception e ->
+      D.warn "OpenMetrics accept failed: %s" (Printexc.to_string e) ;
+      Thread.delay 1.0
+  ) ;
+  accept_loop socket
+
+(** Serve the metrics on [socket_path], if set. *)
+let start () =
+  match !socket_path with
+  | "" ->
+      ()
+  | path -> (
+      D.info "Serving OpenMetrics on %s" path ;
+      try
+        (try Unix.unlink path with Unix.Unix_error (Unix.ENOENT, _, _) -> ()) ;
+        let socket =
+          Unix.socket ~cloexec:true Unix.PF_UNIX Unix.SOCK_STREAM 0
+        in
+        Unix.bind socket (Unix.ADDR_UNIX path) ;
+        Unix.listen socket 16 ;
+        ignore (Thread.create accept_loop socket)
+      with e ->
+        D.error "Could not serve OpenMetrics on %s: %s" path
+          (Printexc.to_string e)
+    )
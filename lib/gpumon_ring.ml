@@ -0,0 +1,115 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+type t = {
+    readings: float array
+  ; scratch: float array  (** for selecting percentiles *)
+  ; mutable next: int
+  ; mutable length: int
+}
+
+let create capacity =
+  if capacity < 1 then invalid_arg "Gpumon_ring.create" ;
+  {
+    readings= Array.make capacity 0.0
+  ; scratch= Array.make capacity 0.0
+  ; next= 0
+  ; length= 0
+  }
+
+let push t reading =
+  let capacity = Array.length t.readings in
+  t.readings.(t.next) <- reading ;
+  t.next <- (t.next + 1) mod capacity ;
+  if t.length < capacity then t.length <- t.length + 1
+
+let length t = t.length
+
+let clear t = t.next <- 0 ; t.length <- 0
+
+type summary = {
+    mutable min: float
+  ; mutable max: float
+  ; mutable mean: float
+  ; mutable p99: float
+}
+
+let make_summary () = {min= 0.0; max= 0.0; mean= 0.0; p99= 0.0}
+
+let swap (a : float array) i j =
+  let x = a.(i) in
+  a.(i) <- a.(j) ;
+  a.(j) <- x
+
+(* Move the k-th smallest of the first n elements of a to a.(k)
+   (quickselect), in linear time on average and without boxing the floats
+   it compares, unlike Array.sort. Partitioning is three-way, so that rings
+   full of equal readings, such as an idle GPU's, stay linear too. *)
+let select (a : float array) n k =
+  let lo = ref 0 and hi = ref (n - 1) in
+  while !lo < !hi do
+    (* Median of the first, middle and last elements *)
+    let x = a.(!lo) and y = a.((!lo + !hi) / 2) and z = a.(!hi) in
+    let pivot =
+      if x < y then
+        if y < z then y else if x < z then z else x
+      else if x < z then
+        x
+      else if y < z then
+        z
+      else
+        y
+    in
+    (* a.(lo .. lt - 1) < pivot = a.(lt .. gt) < a.(gt + 1 .. hi) *)
+    let lt = ref !lo and i = ref !lo and gt = ref !hi in
+    while !i <= !gt do
+      if a.(!i) < pivot then (
+        swap a !lt !i ; incr lt ; incr i
+      ) else if a.(!i) > pivot then (
+        swap a !i !gt ; decr gt
+      ) else
+        incr i
+    done ;
+    if k < !lt then
+      hi := !lt - 1
+    else if k > !gt then
+      lo := !gt + 1
+    else
+      lo := !hi
+  done
+
+let summarise t s =
+  let n = t.length in
+  if n = 0 then
+    false
+  else (
+    (* The readings are the first n slots whether or not the ring wrapped *)
+    let r = t.readings in
+    let sum = ref 0.0 and lo = ref r.(0) and hi = ref r.(0) in
+    for i = 0 to n - 1 do
+      let x = r.(i) in
+      sum := !sum +. x ;
+      if x < !lo then lo := x ;
+      if x > !hi then hi := x
+    done ;
+    s.min <- !lo ;
+    s.max <- !hi ;
+    s.mean <- !sum /. float_of_int n ;
+    (* Nearest rank *)
+    let k = max 0 ((((99 * n) + 99) / 100) - 1) in
+    Array.blit r 0 t.scratch 0 n ;
+    select t.scratch n k ;
+    s.p99 <- t.scratch.(k) ;
+    true
+  )
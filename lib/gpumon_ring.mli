@@ -0,0 +1,27 @@
+(** Fixed-size ring buffers of readings, summarised once per reporting
+    interval. Nothing is allocated after [create]. *)
+
+type t
+
+val create : int -> t
+(** [create capacity] holds up to [capacity] readings; once full, each new
+    reading replaces the oldest one. *)
+
+val push : t -> float -> unit
+
+val length : t -> int
+
+val clear : t -> unit
+
+type summary = {
+    mutable min: float
+  ; mutable max: float
+  ; mutable mean: float
+  ; mutable p99: float
+}
+
+val make_summary : unit -> summary
+
+val summarise : t -> summary -> bool
+(** [summarise t s] stores the statistics of the readings in [t] into [s].
+    Returns [false], leaving [s] untouched, if [t] is empty. *)
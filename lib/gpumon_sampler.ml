@@ -0,0 +1,753 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Discovery of the monitored GPUs and generation of their datasources *)
+
+open Rrdd_plugin
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+let nvidia_vendor_id = 0x10del
+
+(* The metrics monitored before monitoring.conf could select others *)
+let default_metrics =
+  Gpumon_metric.
+    [memory_free; memory_used; temperature; power_usage; compute; memory_io]
+
+let default_config : (int32 * Gpumon_config.config) list =
+  let open Gpumon_config in
+  [
+    (* NVIDIA Corporation *)
+    ( nvidia_vendor_id
+    , {
+        device_types=
+          [
+            (* GRID K1 *)
+            {
+              device_id= 0x0ff2l
+            ; subsystem_device_id= Any
+            ; metrics= default_metrics
+            }
+          ; (* GRID K2 *)
+            {
+              device_id= 0x11bfl
+            ; subsystem_device_id= Any
+            ; metrics= default_metrics
+            }
+          ]
+      }
+    )
+  ]
+
+(** Check that a device has a supported combination of vendor ID, device
+ *  ID and, if applicable, subsystem device ID.
+ *
+ *  If all these IDs match, the required list of metrics for this device is
+ *  returned. *)
+let get_required_metrics plans ids =
+  let open Gpumon_backend in
+  Gpumon_config.lookup plans ~vendor_id:ids.vendor_id ~device_id:ids.device_id
+    ~subsystem_device_id:ids.subsystem_device_id
+
+(** An NVIDIA GPU as found by NVML, before its metrics are chosen *)
+type nvml_device = {
+    handle: Nvml.device
+  ; nvml_bus_id: string
+  ; ids: Gpumon_backend.pci_ids
+}
+
+(** NVML returns the PCI ID and PCI subsystem ID as int32s, where the most
+ *  significant 16 bits make up the device ID and the least significant 16
+ *  bits make up the vendor ID. *)
+let pci_ids_of_pci_info pci_info =
+  {
+    Gpumon_backend.vendor_id= Int32.logand 0xffffl pci_info.Nvml.pci_device_id
+  ; device_id= Int32.shift_right_logical pci_info.Nvml.pci_device_id 16
+  ; subsystem_device_id=
+      Int32.shift_right_logical pci_info.Nvml.pci_subsystem_id 16
+  }
+
+let nvml_device interface index =
+  let handle = Nvml.device_get_handle_by_index interface index in
+  let pci_info = Nvml.device_get_pci_info interface handle in
+  {
+    handle
+  ; nvml_bus_id= String.lowercase_ascii pci_info.Nvml.bus_id
+  ; ids= pci_ids_of_pci_info pci_info
+  }
+
+(** The device at [bus_id], whose PCI IDs are already known, without asking
+ *  NVML for its PCI information. *)
+let nvml_device_of_bus_id interface bus_id ids =
+  let handle = Nvml.device_get_handle_by_pci_bus_id interface bus_id in
+  {handle; nvml_bus_id= bus_id; ids}
+
+let nvidia_config_path = "/usr/share/nvidia/monitoring.conf"
+
+(** The config file compiled into per-device metric plans. It is only
+ *  re-read when it changes; if it no longer parses, the last good config
+ *  stays in use, and default_config is only used while no config file has
+ *  ever loaded. See scripts/monitoring.conf.example for an example of the
+ *  expected config file format. *)
+let config =
+  let compile = Gpumon_config.index Fun.id in
+  Gpumon_config.Watch.create ~path:nvidia_config_path
+    ~load:(fun config -> compile [(nvidia_vendor_id, config)])
+    ~default:(compile default_config)
+    ~on_error:(function
+      | `Does_not_exist ->
+          D.error "Config file %s not found" nvidia_config_path ;
+          D.warn "Using default config"
+      | `Parse_failure msg ->
+          D.error "Caught exception parsing config file: %s" msg ;
+          D.warn "Keeping previous config"
+      | `Unknown_version version ->
+          D.error "Unknown config file version: %s" version ;
+          D.warn "Keeping previous config"
+      )
+
+type gpu = {
+    device: Nvml.device
+  ; bus_id: string
+  ; bus_id_escaped: string
+  ; metrics: Gpumon_metric.t list
+  ; mutable mask: int
+        (** Nvml.Metric bits of the metrics, less those the GPU refused *)
+  ; sample: Nvml.sample  (** reused for every sample of this GPU *)
+  ; dss: Gpumon_dss.t list  (** datasources of the metrics *)
+  ; vgpus: Gpumon_vgpus.t
+  ; mutable sample_vgpus: bool  (** false once the GPU refused *)
+  ; high_frequency: Gpumon_high_frequency.t option
+  ; health: Gpumon_health.t
+  ; events: Gpumon_events.t
+}
+
+let metric_mask metrics =
+  Nvml.Metric.mask (List.map (fun m -> m.Gpumon_metric.slot) metrics)
+
+(** Whether to report, for each GPU, whether its values are stale. Off by
+ *  default, so that an upgrade does not change the datasources reported. *)
+let stale_flags = ref false
+
+(** Datasources of the configured metrics of a GPU, reading the GPU's
+ *  sample buffer, and whether they are stale if [stale_flags] is set. *)
+let make_gpu_dss bus_id_escaped sample health metrics =
+  let dss = Gpumon_backend.make_dss bus_id_escaped sample metrics in
+  if !stale_flags then
+    Gpumon_dss.make ~owner:Rrd.Host ~sample:health.Gpumon_health.sample
+      ~slot:0 ~value:Gpumon_dss.int64
+      ~name:("gpu_stale_" ^ bus_id_escaped)
+      ~description:
+        "1 if the other values of this GPU are from an earlier sample, \
+         because sampling it failed or did not finish in time"
+      ~units:"" ~min:0.0 ~max:1.0 ()
+    :: dss
+  else
+    dss
+
+(** The metrics whose NVML call the library provides, so that the others
+ *  are never attempted. Only the entry points of configured metrics are
+ *  looked up. *)
+let supported_metrics interface bus_id metrics =
+  let capability m = m.Gpumon_metric.capability in
+  let available =
+    Nvml.capabilities interface
+      (Nvml.Capability.mask (List.map capability metrics))
+  in
+  let supported, unsupported =
+    List.partition
+      (fun m -> Nvml.Capability.mem (capability m) available)
+      metrics
+  in
+  List.iter
+    (fun m ->
+      D.warn "GPU %s: not reporting %s, the NVML library lacks %s" bus_id
+        m.Gpumon_metric.name m.Gpumon_metric.call
+    )
+    unsupported ;
+  supported
+
+(** Whether to wait for XID errors and other events of the GPUs on a thread
+ *  of their own, and report their counts. Off by default, so that an
+ *  upgrade does not change the datasources reported. *)
+let event_monitoring = ref false
+
+(** The GPU to report on for the NVML device [nvml], or None if no metrics
+ *  are configured for it. *)
+let make_gpu interface plans nvml =
+  match get_required_metrics plans nvml.ids with
+  | Some metrics ->
+      let device = nvml.handle in
+      let bus_id = nvml.nvml_bus_id in
+      let metrics = supported_metrics interface bus_id metrics in
+      let bus_id_escaped = Gpumon_backend.escape_bus_id bus_id in
+      let mask = metric_mask metrics in
+      let sample = Nvml.make_sample () in
+      let health = Gpumon_health.create () in
+      let events = Gpumon_events.find_or_create bus_id in
+      let dss =
+        make_gpu_dss bus_id_escaped sample health metrics
+        @
+        if !event_monitoring then
+          Gpumon_events.make_dss bus_id_escaped events
+        else
+          []
+      in
+      Some
+        {
+          device
+        ; bus_id
+        ; bus_id_escaped
+        ; metrics
+        ; mask
+        ; sample
+        ; dss
+        ; vgpus= Gpumon_vgpus.create ()
+        ; sample_vgpus= true
+        ; high_frequency= Gpumon_high_frequency.create bus_id_escaped mask
+        ; health
+        ; events
+        }
+  | None ->
+      None
+
+(* Indexes of the devices whose discovery failed, so that a device that
+   keeps failing is only logged once. *)
+let undiscoverable = Hashtbl.create 4
+
+(** Get the list of devices recognised by NVML. A device NVML fails to
+ *  describe, such as one that has fallen off the bus, is left out rather
+ *  than failing the discovery of the others. *)
+let get_devices interface device_count =
+  List.init device_count Fun.id
+  |> List.filter_map (fun index ->
+         match nvml_device interface index with
+         | nvml ->
+             Hashtbl.remove undiscoverable index ;
+             Some nvml
+         | exception Nvml.Error (_, msg) ->
+             if not (Hashtbl.mem undiscoverable index) then (
+               D.warn "Leaving out device %d, NVML cannot describe it: %s"
+                 index msg ;
+               Hashtbl.replace undiscoverable index ()
+             ) ;
+             None
+     )
+
+(** The devices of the inventory cached by the previous run, provided NVML
+ *  reports as many devices and finds each at its cached bus ID. Their PCI
+ *  information is not read again. *)
+let get_cached_devices interface device_count =
+  let module C = Gpumon_inventory_cache in
+  match C.take () with
+  | Some cache when List.length cache.C.gpus = device_count -> (
+    try
+      Some
+        (List.map
+           (fun g -> nvml_device_of_bus_id interface g.C.bus_id g.C.ids)
+           cache.C.gpus
+        )
+    with Nvml.Error (_, msg) ->
+      D.info "Not using the cached inventory, a device is gone: %s" msg ;
+      None
+  )
+  | Some cache ->
+      D.info "Not using the cached inventory of %d devices, NVML reports %d"
+        (List.length cache.C.gpus) device_count ;
+      None
+  | None ->
+      None
+
+(** The GPUs we report on, discovered once and reused on every tick.
+ *  Discovery makes several NVML calls per device, so it is only repeated
+ *  when NVML has been (re-)attached, the number of devices changes or a
+ *  changed config file has been loaded. *)
+module Inventory = struct
+  type t = {
+      generation: int  (** NVML attach generation the handles belong to *)
+    ; device_count: int
+    ; config_generation: int
+    ; gpus: gpu list
+    ; retry_at: float option
+          (** when to look again for devices that could not be discovered *)
+  }
+
+  let current = ref (None : t option)
+
+  (* Seconds until devices left out of the inventory are looked for again;
+     doubled on every discovery that leaves some out. *)
+  let min_retry_delay = 30.0
+
+  let max_retry_delay = 600.0
+
+  let retry_delay = ref min_retry_delay
+
+  (* Bus IDs of the devices we have put into persistence mode, together
+     with the NVML generation in which we did so. *)
+  let persistent = Hashtbl.create 16
+
+  let enable_persistence_mode interface generation gpu =
+    match Hashtbl.find_opt persistent gpu.bus_id with
+    | Some g when g = generation ->
+        ()
+    | _ when not Nvml.(supports interface Capability.persistence_mode) ->
+        ()
+    | _ ->
+        (* Tried once per attach: a device refusing it is still sampled *)
+        ( try Nvml.device_set_persistence_mode interface gpu.device Nvml.Enabled
+          with Nvml.Error (_, msg) ->
+            D.warn "GPU %s: could not enable persistence mode: %s" gpu.bus_id
+              msg
+        ) ;
+        Hashtbl.replace persistent gpu.bus_id generation
+
+  (* The cache lists every device, monitored or not, so that a device a
+     changed config file now covers is not missed. *)
+  let cache_entry gpus nvml =
+    let bus_id = nvml.nvml_bus_id in
+    let metrics =
+      match List.find_opt (fun gpu -> gpu.bus_id = bus_id) gpus with
+      | Some gpu ->
+          List.map (fun m -> m.Gpumon_metric.name) gpu.metrics
+      | None ->
+          []
+    in
+    {
+      Gpumon_inventory_cache.bus_id
+    ; ids= nvml.ids
+    ; metrics
+    }
+
+  let build interface generation device_count plans config_generation =
+    let devices =
+      match get_cached_devices interface device_count with
+      | Some devices ->
+          D.info "GPU inventory: using the devices cached by the last run" ;
+          devices
+      | None ->
+          get_devices interface device_count
+    in
+    let gpus = List.filter_map (make_gpu interface plans) devices in
+    List.iter (enable_persistence_mode interface generation) gpus ;
+    D.info "GPU inventory: %d of %d devices monitored"
+      (List.length gpus) device_count ;
+    let retry_at =
+      if List.length devices < device_count then (
+        let delay = !retry_delay in
+        D.info "GPU inventory: looking for %d missing devices in %.0fs"
+          (device_count - List.length devices)
+          delay ;
+        retry_delay := Float.min max_retry_delay (2.0 *. delay) ;
+        Some (Unix.gettimeofday () +. delay)
+      ) else (
+        retry_delay := min_retry_delay ;
+        (* The cache has to list every device *)
+        Gpumon_inventory_cache.set_gpus (List.map (cache_entry gpus) devices) ;
+        None
+      )
+    in
+    let t = {generation; device_count; config_generation; gpus; retry_at} in
+    current := Some t ;
+    t
+
+  let is_valid t generation device_count config_generation =
+    t.generation = generation
+    && t.device_count = device_count
+    && t.config_generation = config_generation
+    && Option.fold ~none:true
+         ~some:(fun at -> Unix.gettimeofday () < at)
+         t.retry_at
+
+  (** Return the current inventory, rebuilding it if it is stale. *)
+  let get interface =
+    let generation = Nvml.NVML.generation () in
+    let device_count = Nvml.device_get_count interface in
+    let plans = Gpumon_config.Watch.get config in
+    let config_generation = Gpumon_config.Watch.generation config in
+    match !current with
+    | Some t when is_valid t generation device_count config_generation ->
+        t.gpus
+    | Some _ | None ->
+        (build interface generation device_count plans config_generation).gpus
+
+  let invalidate () = current := None
+end
+
+(** Whether to report metrics of each vGPU against the VM it belongs to. *)
+let vgpu_metrics = ref false
+
+(* Stop making the NVML calls of metrics the GPU does not support or we may
+   not read. The inventory, and with it the mask, is rebuilt when NVML is
+   re-attached. *)
+let forget_unsupported gpu =
+  let unsupported = Nvml.unsupported_metrics gpu.mask gpu.sample in
+  if unsupported <> 0 then (
+    List.iter
+      (fun m ->
+        let slot = m.Gpumon_metric.slot in
+        if unsupported land Nvml.Metric.bit slot <> 0 then
+          D.info "GPU %s: %s failed with NVML error %d; not asking again"
+            gpu.bus_id m.Gpumon_metric.call gpu.sample.Nvml.status.(slot)
+      )
+      gpu.metrics ;
+    gpu.mask <- gpu.mask land lnot unsupported
+  )
+
+(** Read all configured metrics of a GPU into its sample buffer, with a
+ *  single call into the NVML stubs. *)
+let sample_gpu interface gpu =
+  Nvml.device_sample interface gpu.device gpu.mask gpu.sample ;
+  forget_unsupported gpu ;
+  if
+    !vgpu_metrics
+    && gpu.sample_vgpus
+    && Nvml.(supports interface Capability.vgpu_instances)
+  then
+    try Gpumon_vgpus.sample interface gpu.device gpu.vgpus with
+    | Nvml.Error (error, msg) when Nvml.Error.is_unsupported error ->
+        D.info "GPU %s: not sampling vGPUs: %s" gpu.bus_id msg ;
+        gpu.sample_vgpus <- false
+    | e ->
+        D.warn "GPU %s: could not sample vGPUs: %s" gpu.bus_id
+          (Printexc.to_string e)
+
+(** Datasources of a vGPU, owned by the VM it is assigned to. *)
+let make_vgpu_dss bus_id_escaped vgpu vm_uuid =
+  let owner = Rrd.VM vm_uuid in
+  let utilisation slot name description =
+    Gpumon_dss.make ~owner ~sample:vgpu.Gpumon_vgpus.utilisation ~slot
+      ~value:Gpumon_dss.fraction
+      ~name:(Printf.sprintf "vgpu_utilisation_%s_%s" name bus_id_escaped)
+      ~description ~min:0.0 ~max:1.0 ~units:"(fraction)" ()
+  in
+  [
+    Gpumon_dss.make ~owner ~sample:vgpu.Gpumon_vgpus.sample
+      ~slot:Nvml.Vgpu_metric.fb_usage ~value:Gpumon_dss.int64
+      ~name:("vgpu_memory_used_" ^ bus_id_escaped)
+      ~description:"Framebuffer memory used by this vGPU" ~units:"B" ()
+  ; Gpumon_dss.make ~owner ~sample:vgpu.Gpumon_vgpus.sample
+      ~slot:Nvml.Vgpu_metric.frame_rate_limit ~value:Gpumon_dss.int64
+      ~name:("vgpu_frame_rate_limit_" ^ bus_id_escaped)
+      ~description:"Frame rate limit of this vGPU" ~units:"fps" ()
+  ; utilisation Nvml.Vgpu_utilization.sm "sm"
+      "Proportion of time during which this vGPU was executing kernels"
+  ; utilisation Nvml.Vgpu_utilization.encoder "encoder"
+      "Proportion of time during which the video encoder was busy for this \
+       vGPU"
+  ; utilisation Nvml.Vgpu_utilization.decoder "decoder"
+      "Proportion of time during which the video decoder was busy for this \
+       vGPU"
+  ]
+
+(** Add datasources for the vGPUs of one GPU to [acc]. A vGPU is only
+ *  reported once the VM it belongs to is known. *)
+let generate_vgpu_dss gpu acc =
+  let acc = ref acc in
+  Gpumon_vgpus.iter
+    (fun vgpu ->
+      match (vgpu.Gpumon_vgpus.dss, vgpu.Gpumon_vgpus.vm_uuid) with
+      | [], Some vm_uuid ->
+          let dss = make_vgpu_dss gpu.bus_id_escaped vgpu vm_uuid in
+          vgpu.Gpumon_vgpus.dss <- dss ;
+          acc := Gpumon_dss.generate dss !acc
+      | dss, _ ->
+          acc := Gpumon_dss.generate dss !acc
+    )
+    gpu.vgpus ;
+  !acc
+
+let sampling_threads = ref 0
+
+(** Seconds a tick waits for the GPUs to be sampled; 0 waits for as long as
+ *  it takes. *)
+let sampling_deadline = ref 2.0
+
+(* Created on first use, once the configuration has been read. *)
+let sampling_workers =
+  lazy
+    ( D.info "Sampling GPUs on %d threads" !sampling_threads ;
+      Gpumon_workers.create !sampling_threads
+    )
+
+(* Sample a GPU unless it is backing off after failures or still busy with
+   an earlier sample. A failure only affects this GPU. *)
+let sample_gpu_job interface gpu () =
+  let health = gpu.health in
+  let ok =
+    try sample_gpu interface gpu ; true
+    with e ->
+      D.warn "GPU %s: sampling failed: %s" gpu.bus_id (Printexc.to_string e) ;
+      false
+  in
+  let failures = Gpumon_health.finish health (Unix.gettimeofday ()) ~ok in
+  if failures > 0 then
+    D.warn "GPU %s: %d consecutive failures, next attempt in %.0fs"
+      gpu.bus_id failures
+      (Gpumon_health.backoff failures)
+
+(** Sample all GPUs, concurrently if sampling threads are configured, so that
+ *  a tick takes as long as the slowest GPU rather than the sum over all of
+ *  them. With a deadline, a GPU whose sample has not finished by then, for
+ *  example because an NVML call hangs, is reported with its previous values
+ *  while its sample carries on in the background.
+ *
+ *  A thread stuck in NVML cannot be interrupted. Its GPU is not sampled
+ *  again until the call returns, and is reported stale meanwhile; another
+ *  thread is started in its place for the other GPUs. So at most one thread
+ *  per GPU is ever stuck, and a GPU that hangs for good costs one thread.
+ *  RPCs are not covered: one calling into a hung driver blocks its caller,
+ *  and a detach gives up waiting for it (see [Nvml.NVML.detach]). *)
+let sample_all_gpus interface gpus =
+  let now = Unix.gettimeofday () in
+  let busy = List.filter (fun gpu -> Gpumon_health.busy gpu.health) gpus in
+  let due = List.filter (fun gpu -> Gpumon_health.start gpu.health now) gpus in
+  let jobs = List.map (sample_gpu_job interface) due in
+  ( match due with
+  | _ :: _ when !sampling_deadline > 0.0 ->
+      let workers = Lazy.force sampling_workers in
+      (* The threads of samples still busy may be stuck in NVML: replace
+         them, one for each such GPU *)
+      Gpumon_workers.grow workers (max 1 !sampling_threads + List.length busy) ;
+      let deadline = now +. !sampling_deadline in
+      if Gpumon_workers.run_until workers ~deadline jobs > 0 then
+        List.iter
+          (fun gpu ->
+            if Gpumon_health.overrun gpu.health then
+              D.warn
+                "GPU %s: sampling did not finish within %.1fs; reporting it \
+                 stale, and sampling the other GPUs on another thread, until \
+                 it does"
+                gpu.bus_id !sampling_deadline
+          )
+          due
+  | _ :: _ :: _ when !sampling_threads > 0 ->
+      Gpumon_workers.run (Lazy.force sampling_workers) jobs
+  | _ ->
+      List.iter (fun job -> job ()) jobs
+  ) ;
+  List.iter (fun gpu -> Gpumon_health.update gpu.health) gpus
+
+(** Generate datasources for all GPUs. *)
+let generate_all_gpu_dss interface gpus =
+  sample_all_gpus interface gpus ;
+  List.fold_left
+    (fun acc gpu ->
+      let acc = Gpumon_dss.generate gpu.dss acc in
+      let acc =
+        match gpu.high_frequency with
+        | Some hf ->
+            Gpumon_high_frequency.generate_dss hf acc
+        | None ->
+            acc
+      in
+      if !vgpu_metrics then generate_vgpu_dss gpu acc else acc
+    )
+    [] gpus
+
+let page_size = 4096
+
+(** Number of shared pages needed to report [dss], with some headroom. The
+ *  size of the V2 protocol payload is estimated from the length of the
+ *  strings in each datasource's metadata plus a fixed overhead for its
+ *  value and the JSON encoding of the other fields. *)
+let shared_pages_needed dss =
+  let bytes =
+    List.fold_left
+      (fun acc (owner, ds) ->
+        let owner =
+          match owner with
+          | Rrd.VM uuid | Rrd.SR uuid ->
+              String.length uuid + 8
+          | Rrd.Host ->
+              4
+        in
+        acc
+        + owner
+        + String.length ds.Ds.ds_name
+        + String.length ds.Ds.ds_description
+        + String.length ds.Ds.ds_units
+        + 160
+      )
+      64 dss
+  in
+  let bytes = bytes + (bytes / 4) in
+  max 1 ((bytes + page_size - 1) / page_size)
+
+(** Keep taking high-frequency readings of the GPUs of the current
+ *  inventory. The inventory is only ever rebuilt by the reporting thread;
+ *  readings pause while it is missing or stale. *)
+let rec high_frequency_loop () =
+  let start = Unix.gettimeofday () in
+  ( match (Nvml.NVML.get (), !Inventory.current) with
+  | Some interface, Some inventory
+    when inventory.Inventory.generation = Nvml.NVML.generation () ->
+      List.iter
+        (fun gpu ->
+          match gpu.high_frequency with
+          | Some hf -> (
+            try Gpumon_high_frequency.sample interface gpu.device hf
+            with e ->
+              D.debug "GPU %s: high-frequency reading failed: %s" gpu.bus_id
+                (Printexc.to_string e)
+          )
+          | None ->
+              ()
+        )
+        inventory.Inventory.gpus
+  | _ ->
+      ()
+  ) ;
+  let elapsed = Unix.gettimeofday () -. start in
+  Thread.delay (Float.max 0.0 (!Gpumon_high_frequency.interval -. elapsed)) ;
+  high_frequency_loop ()
+
+let start_high_frequency_sampling () =
+  if Gpumon_high_frequency.enabled () then (
+    D.info "Taking high-frequency readings every %.3fs"
+      !Gpumon_high_frequency.interval ;
+    ignore (Thread.create high_frequency_loop ())
+  )
+
+(** Keep appending the readings of the GPUs of the current inventory to the
+ *  history, reading them into a buffer of its own. GPUs whose sampling is
+ *  failing or has not finished are skipped, rather than risk holding up
+ *  the records of the others. *)
+let rec history_loop history sample =
+  let start = Unix.gettimeofday () in
+  ( match (Nvml.NVML.get (), !Inventory.current) with
+  | Some interface, Some inventory
+    when inventory.Inventory.generation = Nvml.NVML.generation () ->
+      List.iter
+        (fun gpu ->
+          if not (Gpumon_health.stale gpu.health) then
+            try
+              Nvml.device_sample interface gpu.device gpu.mask sample ;
+              Gpumon_history.append history ~timestamp:start
+                ~bus_id:(Gpumon_history.encode_bus_id gpu.bus_id)
+                ~mask:gpu.mask sample
+            with e ->
+              D.debug "GPU %s: history reading failed: %s" gpu.bus_id
+                (Printexc.to_string e)
+        )
+        inventory.Inventory.gpus
+  | _ ->
+      ()
+  ) ;
+  let elapsed = Unix.gettimeofday () -. start in
+  Thread.delay (Float.max 0.0 (!Gpumon_history.interval -. elapsed)) ;
+  history_loop history sample
+
+let start_history () =
+  if Gpumon_history.enabled () then
+    let path = !Gpumon_history.path in
+    let bytes = !Gpumon_history.size_mib * 1024 * 1024 in
+    match
+      Gpumon_history.create path
+        ~capacity:(Gpumon_history.capacity_of_bytes bytes)
+    with
+    | history ->
+        D.info "Recording GPU readings every %.1fs in %s"
+          !Gpumon_history.interval path ;
+        ignore (Thread.create (history_loop history) (Nvml.make_sample ()))
+    | exception e ->
+        D.error "Could not open the history file %s: %s" path
+          (Printexc.to_string e)
+
+(* Milliseconds an event wait lasts at most. Detaching NVML waits for the
+   wait in progress, and a new inventory is only picked up between waits. *)
+let event_wait_ms = 1000
+
+let is_current inventory =
+  match !Inventory.current with
+  | Some current ->
+      current == inventory
+      && inventory.Inventory.generation = Nvml.NVML.generation ()
+      && Option.is_some (Nvml.NVML.get ())
+  | None ->
+      false
+
+(* Wait for the events of the GPUs of an inventory until it is replaced *)
+let watch_events interface inventory =
+  let set = Nvml.event_set_create interface in
+  (* In the order of the indices by which events identify their GPU *)
+  let gpus =
+    inventory.Inventory.gpus
+    |> List.filter (fun gpu ->
+           try
+             ignore
+               (Nvml.device_register_events interface set gpu.device
+                  Gpumon_events.mask
+               ) ;
+             Gpumon_events.enable gpu.events ;
+             true
+           with e ->
+             D.info "GPU %s: not monitoring events: %s" gpu.bus_id
+               (Printexc.to_string e) ;
+             false
+       )
+    |> Array.of_list
+  in
+  let event = Nvml.Event.make () in
+  let wait () =
+    if Array.length gpus = 0 then
+      Thread.delay (float_of_int event_wait_ms /. 1000.0)
+    else if Nvml.event_set_wait interface set event_wait_ms event then
+      let index = event.(Nvml.Event.device) in
+      if index >= 0 && index < Array.length gpus then
+        let gpu = gpus.(index) in
+        let event_type = event.(Nvml.Event.event_type) in
+        let data = event.(Nvml.Event.data) in
+        if Gpumon_events.record gpu.events event_type data then (
+          D.error "GPU %s: critical event 0x%x (data %d); rediscovering GPUs"
+            gpu.bus_id event_type data ;
+          Inventory.invalidate ()
+        )
+  in
+  Fun.protect
+    ~finally:(fun () ->
+      (* The set went away with the library if it was detached *)
+      if
+        Option.is_some (Nvml.NVML.get ())
+        && Nvml.NVML.generation () = inventory.Inventory.generation
+      then
+        try Nvml.event_set_free interface set with _ -> ()
+    )
+    (fun () ->
+      while is_current inventory do
+        wait ()
+      done
+    )
+
+let rec event_loop () =
+  (* Sleep through detaches rather than polling for the library *)
+  let interface = Nvml.NVML.wait_attached () in
+  ( match !Inventory.current with
+  | Some inventory
+    when is_current inventory
+         && Nvml.(supports interface Capability.events) -> (
+      try watch_events interface inventory
+      with e ->
+        D.warn "Monitoring GPU events failed: %s" (Printexc.to_string e) ;
+        Thread.delay 5.0
+    )
+  | _ ->
+      (* The inventory is rebuilt by the next tick *)
+      Thread.delay 1.0
+  ) ;
+  event_loop ()
+
+let start_event_monitoring () =
+  if !event_monitoring then (
+    D.info "Monitoring GPU events" ;
+    ignore (Thread.create event_loop ())
+  )
@@ -66,56 +66,110 @@ module Make (I : Interface) : IMPLEMENTATION = struct
       | None ->
           raise Gpumon_interface.(Gpumon_error NvmlInterfaceNotAvailable)
 
-    let get_pgpu_metadata _dbg pgpu_address =
+    let pgpu_metadata_cache = Gpumon_cache.create "pGPU metadata"
+
+    (* Keyed on the digests of the vGPU and pGPU metadata, which are several
+       KB each *)
+    let compatibility_cache = Gpumon_cache.create "vGPU compatibility"
+
+    let () =
+      Gpumon_stats.cache "gpumon_cache_pgpu_metadata" "pGPU metadata cache"
+        ~hits:(fun () -> Gpumon_cache.hits pgpu_metadata_cache)
+        ~misses:(fun () -> Gpumon_cache.misses pgpu_metadata_cache) ;
+      Gpumon_stats.cache "gpumon_cache_vgpu_compatibility"
+        "vGPU compatibility cache"
+        ~hits:(fun () -> Gpumon_cache.hits compatibility_cache)
+        ~misses:(fun () -> Gpumon_cache.misses compatibility_cache)
+
+    (* Returns Error for a pGPU that cannot be migrated to, so that this
+       verdict is cached as well. *)
+    let read_pgpu_metadata interface pgpu_address =
       let this = "get_pgpu_metadata" in
+      let device =
+        Nvml.device_get_handle_by_pci_bus_id interface pgpu_address
+      in
+      let compat = Nvml.device_get_pgpu_metadata interface device in
+      let version, revision, driver =
+        ( Nvml.pgpu_metadata_get_pgpu_version compat
+        , Nvml.pgpu_metadata_get_pgpu_revision compat
+        , Nvml.pgpu_metadata_get_pgpu_host_driver_version compat
+        )
+      in
+      let major = Scanf.sscanf driver "%d." (fun x -> x) in
+      info "%s: pGPU version=%d revision=%d driver='%s' (%d)" this version
+        revision driver major ;
+      if major >= host_driver_supporting_migration then
+        Ok compat
+      else
+        Error
+          (Printf.sprintf
+             "%s: pGPU host driver version %d < %d does not support migration"
+             this major host_driver_supporting_migration
+          )
+
+    let get_pgpu_metadata _dbg pgpu_address =
       let interface = get_interface_exn () in
-      try
-        let device =
-          Nvml.device_get_handle_by_pci_bus_id interface pgpu_address
-        in
-        let compat = Nvml.device_get_pgpu_metadata interface device in
-        let version, revision, driver =
-          ( Nvml.pgpu_metadata_get_pgpu_version compat
-          , Nvml.pgpu_metadata_get_pgpu_revision compat
-          , Nvml.pgpu_metadata_get_pgpu_host_driver_version compat
+      let verdict =
+        try
+          Gpumon_cache.find_or_add pgpu_metadata_cache pgpu_address (fun () ->
+              read_pgpu_metadata interface pgpu_address
           )
-        in
-        let major = Scanf.sscanf driver "%d." (fun x -> x) in
-        info "%s: pGPU version=%d revision=%d driver='%s' (%d)" this version
-          revision driver major ;
-        if major >= host_driver_supporting_migration then
-          compat
-        else
-          let msg =
-            Printf.sprintf
-              "%s: pGPU host driver version %d < %d does not support migration"
-              this major host_driver_supporting_migration
-          in
-          raise Gpumon_interface.(Gpumon_error (NvmlFailure msg))
-      with
-      | Gpumon_interface.(Gpumon_error (NvmlFailure _)) as err ->
-          raise err
-      | err ->
+        with err ->
           raise
             Gpumon_interface.(
               Gpumon_error (NvmlFailure (Printexc.to_string err))
             )
+      in
+      match verdict with
+      | Ok compat ->
+          compat
+      | Error msg ->
+          raise Gpumon_interface.(Gpumon_error (NvmlFailure msg))
+
+    (* The vGPUs of each pGPU queried so far, with its device handle and the
+       NVML attach generation the handle belongs to. *)
+    let vgpu_index = Hashtbl.create 8
+
+    let vgpu_index_m = Mutex.create ()
+
+    let with_vgpus interface pgpu_address f =
+      Mutex.lock vgpu_index_m ;
+      Fun.protect
+        ~finally:(fun () -> Mutex.unlock vgpu_index_m)
+        (fun () ->
+          let generation = Nvml.NVML.generation () in
+          let device, vgpus =
+            match Hashtbl.find_opt vgpu_index pgpu_address with
+            | Some (g, device, vgpus) when g = generation ->
+                (device, vgpus)
+            | Some _ | None ->
+                let device =
+                  Nvml.device_get_handle_by_pci_bus_id interface pgpu_address
+                in
+                let vgpus = Gpumon_vgpus.create () in
+                Hashtbl.replace vgpu_index pgpu_address
+                  (generation, device, vgpus) ;
+                (device, vgpus)
+          in
+          Gpumon_vgpus.refresh interface device vgpus ;
+          f vgpus
+        )
 
     let get_vgpu_metadata _dbg domid pgpu_address vgpu_uuid =
       let interface = get_interface_exn () in
-      let domid' = string_of_int domid in
-      let filter_instances =
-        match vgpu_uuid with
-        | "" ->
-            List.map (fun vgpu -> vgpu)
-        | _ ->
-            Nvml.get_vgpu_for_uuid interface vgpu_uuid
-      in
       try
-        Nvml.device_get_handle_by_pci_bus_id interface pgpu_address
-        |> (fun device -> Nvml.get_vgpus_for_vm interface device domid')
-        |> filter_instances
-        |> List.map (Nvml.get_vgpu_metadata interface)
+        with_vgpus interface pgpu_address (fun vgpus ->
+            match vgpu_uuid with
+            | "" ->
+                Gpumon_vgpus.find_by_domid vgpus domid
+            | _ ->
+                Gpumon_vgpus.find_by_uuid vgpus vgpu_uuid
+                |> Option.to_list
+                |> List.filter (fun vgpu -> vgpu.Gpumon_vgpus.domid = domid)
+        )
+        |> List.map (fun vgpu ->
+               Nvml.get_vgpu_metadata interface vgpu.Gpumon_vgpus.instance
+           )
       with err ->
         raise
           Gpumon_interface.(Gpumon_error (NvmlFailure (Printexc.to_string err)))
@@ -126,13 +180,17 @@ module Make (I : Interface) : IMPLEMENTATION = struct
         try
           (* Return a tuple vm_compat, pgpu_compat_limit for convenience:
            * we have List helpers that later help to split the list *)
+          let pgpu_digest = Digest.string pgpu_metadata in
           let vgpu_to_compat vgpu_metadata =
-            let vgpu_compat =
-              Nvml.get_pgpu_vgpu_compatibility interface vgpu_metadata
-                pgpu_metadata
-            in
-            ( Nvml.vgpu_compat_get_vm_compat vgpu_compat
-            , Nvml.vgpu_compat_get_pgpu_compat_limit vgpu_compat
+            Gpumon_cache.find_or_add compatibility_cache
+              (Digest.string vgpu_metadata, pgpu_digest) (fun () ->
+                let vgpu_compat =
+                  Nvml.get_pgpu_vgpu_compatibility interface vgpu_metadata
+                    pgpu_metadata
+                in
+                ( Nvml.vgpu_compat_get_vm_compat vgpu_compat
+                , Nvml.vgpu_compat_get_pgpu_compat_limit vgpu_compat
+                )
             )
           in
           List.map vgpu_to_compat vgpu_metadata
@@ -0,0 +1,250 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* gpumon's own overhead: the calls it makes into NVML, the time it takes
+   to produce a report and to handle RPCs, its GC activity and the hits and
+   misses of its caches. Reported as gpumon_* host datasources. *)
+
+module Stats = Nvml.Stats
+
+(** Whether to report gpumon's own datasources. The statistics are gathered
+    either way. Off by default, so that an upgrade does not change the
+    datasources reported. *)
+let enabled = ref false
+
+(* Fields of the sample of a series *)
+let calls = 0
+
+let errors = 1
+
+let latency = 2
+
+let latency_p99 = 3
+
+(** Counts and latencies of one kind of operation: [current] holds
+    cumulative statistics laid out like those of an NVML entry point,
+    starting at [offset]; [previous] is a copy as of the last report. *)
+type series = {
+    prefix: string
+  ; current: int array
+  ; offset: int
+  ; previous: int array
+  ; sample: Nvml.sample
+  ; dss: Gpumon_dss.t list
+}
+
+let make_series current offset prefix description =
+  let sample = {Nvml.values= Array.make 4 0.0; status= Array.make 4 1} in
+  let ds = Gpumon_dss.make ~owner:Rrd.Host ~sample in
+  {
+    prefix
+  ; current
+  ; offset
+  ; previous= Array.make Stats.fields 0
+  ; sample
+  ; dss=
+      [
+        ds ~slot:calls ~value:Gpumon_dss.int64 ~ty:Rrd.Derive
+          ~name:(prefix ^ "_calls") ~units:"calls/s"
+          ~description:(description ^ ": calls") ~min:0.0 ()
+      ; ds ~slot:errors ~value:Gpumon_dss.int64 ~ty:Rrd.Derive
+          ~name:(prefix ^ "_errors") ~units:"errors/s"
+          ~description:(description ^ ": failed calls") ~min:0.0 ()
+      ; ds ~slot:latency ~value:Gpumon_dss.float
+          ~name:(prefix ^ "_latency") ~units:"s"
+          ~description:(description ^ ": mean latency over the last period")
+          ()
+      ; ds ~slot:latency_p99 ~value:Gpumon_dss.float
+          ~name:(prefix ^ "_latency_p99") ~units:"s"
+          ~description:
+            (description
+            ^ ": upper bound of the 99th percentile latency over the last \
+               period"
+            )
+          ()
+      ]
+  }
+
+let bucket_of_us us =
+  let rec loop bucket =
+    if bucket < Stats.bucket_count - 1 && us lsr bucket > 0 then
+      loop (bucket + 1)
+    else
+      bucket
+  in
+  loop 0
+
+(* Upper bound of a bucket's latencies, in seconds; the last bucket has
+   none and is reported by its lower bound. *)
+let bucket_limit bucket =
+  let bucket = min bucket (Stats.bucket_count - 2) in
+  float_of_int (1 lsl bucket) *. 1e-6
+
+(* Bring the sample of a series up to date with the statistics gathered
+   since the last report. *)
+let update series =
+  let s i = series.current.(series.offset + i) and p i = series.previous.(i) in
+  let values = series.sample.Nvml.values
+  and status = series.sample.Nvml.status in
+  let total = s Stats.calls and delta = s Stats.calls - p Stats.calls in
+  values.(calls) <- float_of_int total ;
+  values.(errors) <- float_of_int (s Stats.errors) ;
+  status.(calls) <- (if total > 0 then 0 else 1) ;
+  status.(errors) <- status.(calls) ;
+  if delta > 0 then (
+    values.(latency) <-
+      float_of_int (s Stats.total_us - p Stats.total_us)
+      /. float_of_int delta
+      *. 1e-6 ;
+    (* The bucket in which the 99th percentile call lies *)
+    let rank = ((99 * delta) + 99) / 100 in
+    let rec find bucket seen =
+      let field = Stats.buckets + bucket in
+      let seen = seen + s field - p field in
+      if seen >= rank || bucket = Stats.bucket_count - 1 then
+        bucket
+      else
+        find (bucket + 1) seen
+    in
+    values.(latency_p99) <- bucket_limit (find 0 0) ;
+    status.(latency) <- 0 ;
+    status.(latency_p99) <- 0
+  ) else (
+    status.(latency) <- 1 ;
+    status.(latency_p99) <- 1
+  ) ;
+  Array.blit series.current series.offset series.previous 0 Stats.fields
+
+let nvml_current = Stats.make ()
+
+let nvml_series =
+  Array.to_list
+    (Array.mapi
+       (fun i entry_point ->
+         make_series nvml_current (i * Stats.fields)
+           ("gpumon_nvml_" ^ entry_point)
+           ("NVML " ^ entry_point)
+       )
+       Stats.entry_points
+    )
+
+(* Series kept on the OCaml side, updated under [m] *)
+let m = Mutex.create ()
+
+let with_lock f =
+  Mutex.lock m ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock m) f
+
+let own_series = ref []
+
+let series name description =
+  with_lock @@ fun () ->
+  let series = make_series (Array.make Stats.fields 0) 0 name description in
+  own_series := series :: !own_series ;
+  series
+
+let record series ~failed seconds =
+  let us = int_of_float (seconds *. 1e6) in
+  let add field n = series.current.(field) <- series.current.(field) + n in
+  with_lock @@ fun () ->
+  add Stats.calls 1 ;
+  if failed then add Stats.errors 1 ;
+  add Stats.total_us us ;
+  add (Stats.buckets + bucket_of_us us) 1
+
+(** Run [f], recording how long it took and whether it raised. *)
+let time series f =
+  let start = Unix.gettimeofday () in
+  match f () with
+  | result ->
+      record series ~failed:false (Unix.gettimeofday () -. start) ;
+      result
+  | exception e ->
+      record series ~failed:true (Unix.gettimeofday () -. start) ;
+      raise e
+
+let tick = series "gpumon_tick" "Report to rrdd"
+
+let rpcs = Hashtbl.create 8
+
+(** The series of the RPC [name], created on first use. *)
+let rpc name =
+  match with_lock (fun () -> Hashtbl.find_opt rpcs name) with
+  | Some series ->
+      series
+  | None ->
+      let series = series ("gpumon_rpc_" ^ name) ("RPC " ^ name) in
+      with_lock (fun () -> Hashtbl.replace rpcs name series) ;
+      series
+
+let caches = ref []
+
+(** Report the [hits] and [misses] of a cache as [prefix]_hits and
+    [prefix]_misses. *)
+let cache prefix description ~hits ~misses =
+  with_lock @@ fun () ->
+  caches := (prefix, description, hits, misses) :: !caches
+
+let cache_dss acc =
+  let ds name ~units ~description n =
+    ( Rrd.Host
+    , Ds.ds_make ~name ~description
+        ~value:(Rrd.VT_Int64 (Int64.of_int n))
+        ~ty:Rrd.Derive ~default:false ~units ~min:0.0 ()
+    )
+  in
+  List.fold_left
+    (fun acc (prefix, description, hits, misses) ->
+      ds (prefix ^ "_hits") ~units:"hits/s"
+        ~description:(description ^ ": lookups answered from the cache")
+        (hits ())
+      :: ds (prefix ^ "_misses") ~units:"misses/s"
+           ~description:(description ^ ": lookups that queried NVML")
+           (misses ())
+      :: acc
+    )
+    acc
+    (with_lock (fun () -> !caches))
+
+let gc_dss () =
+  let gc = Gc.quick_stat () in
+  let ds name ~ty ~units ~description value =
+    ( Rrd.Host
+    , Ds.ds_make ~name ~description ~value ~ty ~default:false ~units ()
+    )
+  in
+  [
+    ds "gpumon_gc_minor_words" ~ty:Rrd.Derive ~units:"words/s"
+      ~description:"Words allocated in the minor heap by gpumon"
+      (Rrd.VT_Int64 (Int64.of_float gc.Gc.minor_words))
+  ; ds "gpumon_gc_major_words" ~ty:Rrd.Derive ~units:"words/s"
+      ~description:"Words allocated in the major heap by gpumon"
+      (Rrd.VT_Int64 (Int64.of_float gc.Gc.major_words))
+  ; ds "gpumon_gc_major_collections" ~ty:Rrd.Derive ~units:"collections/s"
+      ~description:"Major collections completed by gpumon"
+      (Rrd.VT_Int64 (Int64.of_int gc.Gc.major_collections))
+  ; ds "gpumon_heap_size" ~ty:Rrd.Gauge ~units:"B"
+      ~description:"Size of gpumon's major heap"
+      (Rrd.VT_Int64 (Int64.of_int (gc.Gc.heap_words * (Sys.word_size / 8))))
+  ]
+
+(** Add gpumon's own datasources to [acc]. *)
+let generate_dss acc =
+  Stats.read nvml_current ;
+  List.iter update nvml_series ;
+  let own = with_lock (fun () -> List.iter update !own_series ; !own_series) in
+  List.fold_left
+    (fun acc series -> Gpumon_dss.generate series.dss acc)
+    (cache_dss (List.rev_append (gc_dss ()) acc))
+    (List.rev_append nvml_series own)
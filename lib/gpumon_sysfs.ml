@@ -0,0 +1,251 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* GPUs of other vendors, found under /sys/class/drm and read through the
+   attributes of their PCI device and of its hwmon directory. Each
+   attribute is opened once, when the GPU is discovered, and re-read from
+   offset 0 with pread on every sample. NVIDIA GPUs are left to NVML. *)
+
+module D = Debug.Make (struct let name = __MODULE__ end)
+module Unixext = Xapi_stdext_unix.Unixext
+
+(** The directory of the DRM cards; tests point it at a fake tree. *)
+let root = ref "/sys/class/drm"
+
+(** Whether to report the GPUs found in sysfs *)
+let enabled = ref false
+
+let nvidia_vendor_id = 0x10del
+
+(* The status of a metric whose attribute could not be read or parsed:
+   NVML_ERROR_UNKNOWN *)
+let read_error = 999
+
+external pread : Unix.file_descr -> Bytes.t -> int -> int = "stub_gpumon_pread"
+(** [pread fd buf len] reads from the start of [fd] into [buf]; returns the
+    number of bytes read, or minus errno. *)
+
+type location = Device | Hwmon
+
+(* Where each metric is read from, with the factor converting the value to
+   NVML's units from those of sysfs: millidegrees C, microwatts, Hz and
+   microjoules. The first attribute present is used. *)
+let sources =
+  Nvml.Metric.
+    [
+      (memory_used, [(Device, "mem_info_vram_used", 1.0)])
+    ; (temperature, [(Hwmon, "temp1_input", 1e-3)])
+    ; ( power_usage
+      , [(Hwmon, "power1_average", 1e-3); (Hwmon, "power1_input", 1e-3)]
+      )
+    ; (utilisation_compute, [(Device, "gpu_busy_percent", 1.0)])
+    ; (utilisation_memory_io, [(Device, "mem_busy_percent", 1.0)])
+    ; (clock_sm, [(Hwmon, "freq1_input", 1e-6)])
+    ; (clock_memory, [(Hwmon, "freq2_input", 1e-6)])
+    ; (energy, [(Hwmon, "energy1_input", 1e-3)])
+    ]
+
+type attribute = {fd: Unix.file_descr; scale: float}
+
+type device = {
+    bus_id: string
+  ; ids: Gpumon_backend.pci_ids
+  ; attributes: attribute option array  (** by [Nvml.Metric] slot *)
+  ; vram_total: float option  (** bytes; free memory is derived from it *)
+  ; buffer: Bytes.t
+}
+
+let name = "sysfs"
+
+let bus_id t = t.bus_id
+
+let pci_ids t = t.ids
+
+let read_file path =
+  try Some (String.trim (Unixext.string_of_file path)) with _ -> None
+
+let read_id dir file =
+  Option.bind (read_file (Filename.concat dir file)) Int32.of_string_opt
+
+(* The PCI address of the device, from its uevent *)
+let read_bus_id dir =
+  let slot_name line =
+    match String.split_on_char '=' line with
+    | ["PCI_SLOT_NAME"; bus_id] ->
+        Some (String.lowercase_ascii bus_id)
+    | _ ->
+        None
+  in
+  Option.bind
+    (read_file (Filename.concat dir "uevent"))
+    (fun uevent -> List.find_map slot_name (String.split_on_char '\n' uevent))
+
+let hwmon_dir dir =
+  let hwmon = Filename.concat dir "hwmon" in
+  match Sys.readdir hwmon with
+  | exception Sys_error _ ->
+      None
+  | entries -> (
+      Array.sort compare entries ;
+      match Array.to_list entries with
+      | first :: _ ->
+          Some (Filename.concat hwmon first)
+      | [] ->
+          None
+    )
+
+let open_attribute ~device ~hwmon (location, file, scale) =
+  let dir = match location with Device -> Some device | Hwmon -> hwmon in
+  Option.bind dir (fun dir ->
+      let path = Filename.concat dir file in
+      match Unix.openfile path [Unix.O_RDONLY; Unix.O_CLOEXEC] 0 with
+      | fd ->
+          Some {fd; scale}
+      | exception Unix.Unix_error _ ->
+          None
+  )
+
+let open_card card =
+  let dir = Filename.concat (Filename.concat !root card) "device" in
+  match
+    ( read_bus_id dir
+    , read_id dir "vendor"
+    , read_id dir "device"
+    , read_id dir "subsystem_device"
+    )
+  with
+  | Some _, Some vendor_id, Some _, _ when vendor_id = nvidia_vendor_id ->
+      None
+  | Some bus_id, Some vendor_id, Some device_id, subsystem_device_id ->
+      let hwmon = hwmon_dir dir in
+      let attributes = Array.make Nvml.Metric.count None in
+      List.iter
+        (fun (m, candidates) ->
+          attributes.(m) <-
+            List.find_map (open_attribute ~device:dir ~hwmon) candidates
+        )
+        sources ;
+      let vram_total =
+        Option.bind
+          (read_file (Filename.concat dir "mem_info_vram_total"))
+          float_of_string_opt
+      in
+      Some
+        {
+          bus_id
+        ; ids=
+            {
+              vendor_id
+            ; device_id
+            ; subsystem_device_id= Option.value ~default:0l subsystem_device_id
+            }
+        ; attributes
+        ; vram_total
+        ; buffer= Bytes.create 32
+        }
+  | _ ->
+      D.debug "%s is not a PCI device" card ;
+      None
+
+(* card0, card1... but not their connectors, such as card0-DP-1 *)
+let is_card name =
+  match Scanf.sscanf name "card%u%!" Fun.id with
+  | _ ->
+      true
+  | exception _ ->
+      false
+
+let devices () =
+  match Sys.readdir !root with
+  | exception Sys_error _ ->
+      []
+  | names ->
+      Array.sort compare names ;
+      Array.to_list names |> List.filter is_card |> List.filter_map open_card
+
+let close t =
+  Array.iter (Option.iter (fun a -> Unix.close a.fd)) t.attributes
+
+let capabilities t =
+  let mask = ref 0 in
+  Array.iteri
+    (fun m attribute ->
+      if Option.is_some attribute then mask := !mask lor Nvml.Metric.bit m
+    )
+    t.attributes ;
+  if
+    Option.is_some t.vram_total
+    && Option.is_some t.attributes.(Nvml.Metric.memory_used)
+  then
+    mask := !mask lor Nvml.Metric.bit Nvml.Metric.memory_free ;
+  !mask
+
+(* The decimal integer at the start of the first [len] bytes of [buf], as
+   sysfs attributes hold them, or nan if there is none *)
+let parse buf len =
+  let negative = len > 0 && Bytes.get buf 0 = '-' in
+  let start = if negative then 1 else 0 in
+  let is_digit i =
+    i < len && match Bytes.get buf i with '0' .. '9' -> true | _ -> false
+  in
+  let rec digits i acc =
+    if is_digit i then
+      digits (i + 1) ((acc * 10) + Char.code (Bytes.get buf i) - Char.code '0')
+    else if i = start then
+      Float.nan
+    else
+      float_of_int (if negative then -acc else acc)
+  in
+  digits start 0
+
+let read t attribute =
+  let n = pread attribute.fd t.buffer (Bytes.length t.buffer) in
+  if n > 0 then
+    parse t.buffer n *. attribute.scale
+  else
+    Float.nan
+
+let store sample m value =
+  if Float.is_nan value then
+    sample.Nvml.status.(m) <- read_error
+  else (
+    sample.Nvml.values.(m) <- value ;
+    sample.Nvml.status.(m) <- 0
+  )
+
+let sample t mask sample =
+  let selected m = mask land Nvml.Metric.bit m <> 0 in
+  for m = 0 to Nvml.Metric.count - 1 do
+    match t.attributes.(m) with
+    | Some attribute when selected m ->
+        store sample m (read t attribute)
+    | Some _ | None ->
+        ()
+  done ;
+  let memory_used = Nvml.Metric.memory_used in
+  if selected Nvml.Metric.memory_free then
+    let used =
+      match t.attributes.(memory_used) with
+      | Some _ when selected memory_used ->
+          if sample.Nvml.status.(memory_used) = 0 then
+            sample.Nvml.values.(memory_used)
+          else
+            Float.nan
+      | Some attribute ->
+          read t attribute
+      | None ->
+          Float.nan
+    in
+    let total = Option.value ~default:Float.nan t.vram_total in
+    store sample Nvml.Metric.memory_free (total -. used)
@@ -0,0 +1,184 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+module D = Debug.Make (struct let name = __MODULE__ end)
+
+type vgpu = {
+    instance: Nvml.vgpu_instance
+  ; domid: int
+  ; uuid: Nvml.vgpu_uuid
+  ; mutable vm_uuid: string option
+  ; mutable vm_lookups: int  (** failed lookups of vm_uuid *)
+  ; mutable vm_lookup_at: float  (** when to look vm_uuid up again *)
+  ; sample: Nvml.sample  (** framebuffer usage and frame rate limit *)
+  ; utilisation: Nvml.sample
+        (** last utilisation sample, indexed like Nvml.Vgpu_utilization *)
+  ; mutable dss: Gpumon_dss.t list
+        (** built by the sampler once the VM is known *)
+}
+
+(** The vGPUs active on one GPU, indexed by instance, by domain ID and by
+    vGPU UUID. A refresh only lists the active instances; NVML is only asked
+    about instances not seen before. *)
+type t = {
+    vgpus: (Nvml.vgpu_instance, vgpu) Hashtbl.t
+  ; by_domid: (int, vgpu list) Hashtbl.t
+  ; by_uuid: (Nvml.vgpu_uuid, vgpu) Hashtbl.t
+  ; utilisation: Nvml.vgpu_utilization
+  ; mutable last_seen: float
+        (** timestamp of the newest utilisation sample read *)
+}
+
+let create () =
+  {
+    vgpus= Hashtbl.create 8
+  ; by_domid= Hashtbl.create 8
+  ; by_uuid= Hashtbl.create 8
+  ; utilisation= Nvml.make_vgpu_utilization 8
+  ; last_seen= 0.0
+  }
+
+let find_by_domid t domid =
+  Option.value ~default:[] (Hashtbl.find_opt t.by_domid domid)
+
+let find_by_uuid t uuid = Hashtbl.find_opt t.by_uuid uuid
+
+let vm_uuid_of_domid domid =
+  let path = Printf.sprintf "/local/domain/%d/vm" domid in
+  (* The value is a path of the form /vm/<uuid> *)
+  Ezxenstore_core.Xenstore.(
+    with_xs (fun xs -> xs.Xs.read path) |> Filename.basename
+  )
+
+(* Seconds between lookups of the VM of a vGPU, doubled after each failed
+   one: its domain may still be being built, or may be stale. *)
+let min_lookup_delay = 5.0
+
+let max_lookup_delay = 300.0
+
+(* Look up the VM of a vGPU unless a failed lookup was too recent. Only
+   the first failure of each vGPU is logged as a warning. *)
+let lookup_vm_uuid vgpu now =
+  if vgpu.vm_uuid = None && now >= vgpu.vm_lookup_at then
+    match vm_uuid_of_domid vgpu.domid with
+    | vm_uuid ->
+        if vgpu.vm_lookups > 0 then
+          D.info "Found the VM of domain %d after %d attempts" vgpu.domid
+            (vgpu.vm_lookups + 1) ;
+        vgpu.vm_uuid <- Some vm_uuid
+    | exception e ->
+        let log = if vgpu.vm_lookups = 0 then D.warn else D.debug in
+        log "Could not find the VM of domain %d: %s" vgpu.domid
+          (Printexc.to_string e) ;
+        let delay =
+          Float.min max_lookup_delay
+            (min_lookup_delay *. (2.0 ** float_of_int vgpu.vm_lookups))
+        in
+        vgpu.vm_lookups <- vgpu.vm_lookups + 1 ;
+        vgpu.vm_lookup_at <- now +. delay
+
+let add interface t instance =
+  match
+    int_of_string_opt (Nvml.vgpu_instance_get_vm_domid interface instance)
+  with
+  | Some domid ->
+      let vgpu =
+        {
+          instance
+        ; domid
+        ; uuid= Nvml.vgpu_instance_get_vgpu_uuid interface instance
+        ; vm_uuid= None
+        ; vm_lookups= 0
+        ; vm_lookup_at= 0.0
+        ; sample= Nvml.make_sample ()
+        ; utilisation=
+            (* No sample until the first one is read *)
+            {
+              Nvml.values= Array.make Nvml.Vgpu_utilization.fields 0.0
+            ; status= Array.make Nvml.Vgpu_utilization.fields 1
+            }
+        ; dss= []
+        }
+      in
+      Hashtbl.replace t.vgpus instance vgpu ;
+      Hashtbl.replace t.by_domid domid (vgpu :: find_by_domid t domid) ;
+      Hashtbl.replace t.by_uuid vgpu.uuid vgpu
+  | None ->
+      D.warn "vGPU instance %d has no domain ID" instance
+
+let remove t vgpu =
+  Hashtbl.remove t.vgpus vgpu.instance ;
+  ( match List.filter (fun v -> v != vgpu) (find_by_domid t vgpu.domid) with
+  | [] ->
+      Hashtbl.remove t.by_domid vgpu.domid
+  | vgpus ->
+      Hashtbl.replace t.by_domid vgpu.domid vgpus
+  ) ;
+  match Hashtbl.find_opt t.by_uuid vgpu.uuid with
+  | Some v when v == vgpu ->
+      Hashtbl.remove t.by_uuid vgpu.uuid
+  | Some _ | None ->
+      ()
+
+let refresh interface device t =
+  let active = Nvml.device_get_active_vgpus interface device in
+  let gone =
+    Hashtbl.fold
+      (fun instance vgpu acc ->
+        if List.mem instance active then acc else vgpu :: acc
+      )
+      t.vgpus []
+  in
+  List.iter (remove t) gone ;
+  List.iter
+    (fun instance ->
+      if not (Hashtbl.mem t.vgpus instance) then add interface t instance
+    )
+    active
+
+(* Only samples taken since the last call are fetched; vGPUs without a new
+   sample keep their previous utilisation. *)
+let update_utilisation interface device t =
+  let module U = Nvml.Vgpu_utilization in
+  let count =
+    Nvml.device_get_vgpu_utilization interface device ~last_seen:t.last_seen
+      t.utilisation
+  in
+  let samples = t.utilisation.Nvml.samples in
+  for i = 0 to count - 1 do
+    let base = i * U.fields in
+    let timestamp = samples.(base + U.timestamp) in
+    if timestamp > t.last_seen then t.last_seen <- timestamp ;
+    match Hashtbl.find_opt t.vgpus t.utilisation.Nvml.instances.(i) with
+    | Some vgpu when timestamp >= vgpu.utilisation.Nvml.values.(U.timestamp) ->
+        Array.blit samples base vgpu.utilisation.Nvml.values 0 U.fields ;
+        Array.fill vgpu.utilisation.Nvml.status 0 U.fields 0
+    | Some _ | None ->
+        ()
+  done
+
+let sample interface device t =
+  refresh interface device t ;
+  let now = Unix.gettimeofday () in
+  Hashtbl.iter
+    (fun instance vgpu ->
+      (* The domain may not have been fully set up when first seen *)
+      lookup_vm_uuid vgpu now ;
+      Nvml.vgpu_instance_sample interface instance vgpu.sample
+    )
+    t.vgpus ;
+  if Nvml.(supports interface Capability.vgpu_utilization) then
+    update_utilisation interface device t
+
+let iter f t = Hashtbl.iter (fun _ vgpu -> f vgpu) t.vgpus
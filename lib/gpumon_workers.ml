@@ -0,0 +1,125 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* The NVML stubs release the runtime lock while calling into the driver,
+   so jobs that mostly wait for NVML do run concurrently on these threads. *)
+
+type t = {
+    mx: Mutex.t
+  ; jobs: (unit -> unit) Queue.t
+  ; job_ready: Condition.t
+  ; job_done: Condition.t
+  ; wakeup_r: Unix.file_descr
+  ; wakeup_w: Unix.file_descr
+        (** written to whenever a job finishes, for [run_until] to wait on
+            with a timeout *)
+  ; mutable threads: int
+}
+
+(* The jobs of one call of run or run_until *)
+type batch = {mutable unfinished: int; mutable failure: exn option}
+
+let with_mutex mx f =
+  Mutex.lock mx ;
+  Fun.protect ~finally:(fun () -> Mutex.unlock mx) f
+
+let wakeup_byte = Bytes.make 1 '.'
+
+let rec worker t =
+  let job =
+    with_mutex t.mx @@ fun () ->
+    while Queue.is_empty t.jobs do
+      Condition.wait t.job_ready t.mx
+    done ;
+    Queue.pop t.jobs
+  in
+  job () ; worker t
+
+let grow t threads =
+  with_mutex t.mx @@ fun () ->
+  while t.threads < threads do
+    ignore (Thread.create worker t) ;
+    t.threads <- t.threads + 1
+  done
+
+let create threads =
+  let wakeup_r, wakeup_w = Unix.pipe ~cloexec:true () in
+  (* Nobody may be reading; a full pipe wakes up readers just as well *)
+  Unix.set_nonblock wakeup_w ;
+  let t =
+    {
+      mx= Mutex.create ()
+    ; jobs= Queue.create ()
+    ; job_ready= Condition.create ()
+    ; job_done= Condition.create ()
+    ; wakeup_r
+    ; wakeup_w
+    ; threads= 0
+    }
+  in
+  grow t threads ; t
+
+let submit t jobs =
+  let batch = {unfinished= List.length jobs; failure= None} in
+  let wrap job () =
+    let failure = try job () ; None with e -> Some e in
+    ( with_mutex t.mx @@ fun () ->
+      if Option.is_none batch.failure then batch.failure <- failure ;
+      batch.unfinished <- batch.unfinished - 1 ;
+      Condition.broadcast t.job_done
+    ) ;
+    try ignore (Unix.single_write t.wakeup_w wakeup_byte 0 1)
+    with Unix.Unix_error ((Unix.EAGAIN | Unix.EWOULDBLOCK), _, _) -> ()
+  in
+  ( with_mutex t.mx @@ fun () ->
+    List.iter (fun job -> Queue.push (wrap job) t.jobs) jobs ;
+    Condition.broadcast t.job_ready
+  ) ;
+  batch
+
+let run t jobs =
+  let batch = submit t jobs in
+  let failure =
+    with_mutex t.mx @@ fun () ->
+    while batch.unfinished > 0 do
+      Condition.wait t.job_done t.mx
+    done ;
+    batch.failure
+  in
+  Option.iter raise failure
+
+let drain = Bytes.create 64
+
+let run_until t ~deadline jobs =
+  let batch = submit t jobs in
+  let unfinished () = with_mutex t.mx @@ fun () -> batch.unfinished in
+  let rec wait () =
+    let remaining = deadline -. Unix.gettimeofday () in
+    if unfinished () > 0 && remaining > 0.0 then (
+      ( match Unix.select [t.wakeup_r] [] [] remaining with
+      | [], _, _ ->
+          ()
+      | _ :: _, _, _ ->
+          ignore (Unix.read t.wakeup_r drain 0 (Bytes.length drain))
+      | exception Unix.Unix_error (Unix.EINTR, _, _) ->
+          ()
+      ) ;
+      wait ()
+    )
+  in
+  wait () ;
+  let failure, unfinished =
+    with_mutex t.mx @@ fun () -> (batch.failure, batch.unfinished)
+  in
+  Option.iter raise failure ; unfinished
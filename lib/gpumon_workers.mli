@@ -0,0 +1,20 @@
+(** A set of threads running batches of jobs. *)
+
+type t
+
+val create : int -> t
+(** [create n] starts [n] worker threads. They live as long as the
+    process. *)
+
+val grow : t -> int -> unit
+(** [grow t n] starts more threads until there are at least [n], for
+    example to replace threads stuck in jobs that never finish. *)
+
+val run : t -> (unit -> unit) list -> unit
+(** Run all jobs on the workers and wait for them to finish. If any job
+    raised, one of the exceptions is re-raised once all jobs are done. *)
+
+val run_until : t -> deadline:float -> (unit -> unit) list -> int
+(** Like [run], but stop waiting at [deadline] (as [Unix.gettimeofday])
+    and return the number of jobs that had not finished by then; those
+    keep running. An exception of a job finishing late is lost. *)
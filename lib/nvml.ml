@@ -1,53 +1,53 @@
 module D = Debug.Make (struct let name = __MODULE__ end)
 
-exception Library_not_loaded of string
-
-exception Symbol_not_loaded of string
+include Nvml_types
 
 type interface
 
 type device
 
-type enable_state = Disabled | Enabled
-
-type memory_info = {total: int64; free: int64; used: int64}
-
-type pci_info = {
-    bus_id: string  (** domain:bus:device.function PCI identifier *)
-  ; domain: int32
-  ; bus: int32
-  ; device: int32
-  ; pci_device_id: int32
-  ; pci_subsystem_id: int32
-}
-
-type utilization = {gpu: int; memory: int}
-
-type pgpu_metadata = string
-
-type vgpu_metadata = string
-
-type vgpu_instance = int
-
-type vm_domid = string
-
-type vgpu_uuid = string
-
 type vgpu_compatibility_t
 
-type vm_compat = None | Cold | Hybernate | Sleep | Live
-
-type pgpu_compat_limit = None | HostDriver | GuestDriver | GPU | Other
-
-external library_open : unit -> interface = "stub_nvml_open"
+external library_open : string -> interface = "stub_nvml_open"
+
+(** The NVML library loaded by [NVML.attach]. The GPUMON_NVML_LIBRARY
+    environment variable can point it at another implementation, such as
+    the simulator in sim/. *)
+let library_path =
+  ref
+    ( match Sys.getenv_opt "GPUMON_NVML_LIBRARY" with
+    | Some path when path <> "" ->
+        path
+    | Some _ | None ->
+        "libnvidia-ml.so.1"
+    )
 
 let library_open () =
   Callback.register_exception "Library_not_loaded" (Library_not_loaded "") ;
   Callback.register_exception "Symbol_not_loaded" (Symbol_not_loaded "") ;
-  library_open ()
+  Callback.register_exception "Nvml_error" (Error (Error.Unknown 0, "")) ;
+  library_open !library_path
 
 external library_close : interface -> unit = "stub_nvml_close"
 
+external call_count : unit -> int = "stub_nvml_call_count"
+(** Number of calls into the NVML library made by this process so far. *)
+
+module Stats = struct
+  include Nvml_types.Stats
+
+  external read : int array -> unit = "stub_nvml_stats_read"
+  (** [read stats] copies the statistics into a buffer made by [make]: the
+      fields of entry point [i] start at [i * fields]. *)
+end
+
+external capabilities : interface -> int -> int = "stub_nvml_capabilities"
+(** [capabilities interface mask] returns the capabilities of [mask] the
+    library provides, looking up their entry points if not done yet. *)
+
+let supports interface capability =
+  Capability.mem capability (capabilities interface (Capability.bit capability))
+
 external init : interface -> unit = "stub_nvml_init"
 
 external shutdown : interface -> unit = "stub_nvml_shutdown"
@@ -75,6 +75,43 @@ external device_get_power_usage : interface -> device -> int
 external device_get_utilization_rates : interface -> device -> utilization
   = "stub_nvml_device_get_utilization_rates"
 
+external device_sample :
+  interface -> device -> int -> float array -> int array -> unit
+  = "stub_nvml_device_sample"
+
+(** [device_sample interface device mask sample] reads all metrics in [mask]
+    with a single call into the stubs, making each underlying NVML call at
+    most once. NVML errors are reported per metric in [sample.status]
+    instead of being raised. *)
+let device_sample interface device mask sample =
+  device_sample interface device mask sample.values sample.status
+
+external vgpu_instance_sample :
+  interface -> vgpu_instance -> float array -> int array -> unit
+  = "stub_nvml_vgpu_instance_sample"
+
+let vgpu_instance_sample interface vgpu sample =
+  vgpu_instance_sample interface vgpu sample.values sample.status
+
+external device_get_vgpu_utilization :
+  interface -> device -> float -> vgpu_instance array -> float array -> int
+  = "stub_nvml_device_get_vgpu_utilization"
+
+(** Fetch the utilisation samples of the device's vGPUs taken after
+    [last_seen], growing [buffer] if necessary, and return their number. *)
+let rec device_get_vgpu_utilization interface device ~last_seen buffer =
+  match
+    device_get_vgpu_utilization interface device last_seen buffer.instances
+      buffer.samples
+  with
+  | count when count >= 0 ->
+      count
+  | count ->
+      let bigger = make_vgpu_utilization (-count) in
+      buffer.instances <- bigger.instances ;
+      buffer.samples <- bigger.samples ;
+      device_get_vgpu_utilization interface device ~last_seen buffer
+
 external device_set_persistence_mode :
   interface -> device -> enable_state -> unit
   = "stub_nvml_device_set_persistence_mode"
@@ -114,6 +151,28 @@ external vgpu_compat_get_pgpu_compat_limit :
   vgpu_compatibility_t -> pgpu_compat_limit list
   = "stub_vgpu_compat_get_pgpu_compat_limit"
 
+type event_set
+
+external event_set_create : interface -> event_set
+  = "stub_nvml_event_set_create"
+
+external event_set_free : interface -> event_set -> unit
+  = "stub_nvml_event_set_free"
+
+external device_register_events : interface -> event_set -> device -> int -> int
+  = "stub_nvml_device_register_events"
+(** [device_register_events interface set device mask] registers the event
+    types of [mask] that [device] supports, failing if it supports none,
+    and returns the index by which [event_set_wait] identifies the device:
+    0 for the first device registered, and so on. *)
+
+external event_set_wait : interface -> event_set -> int -> int array -> bool
+  = "stub_nvml_event_set_wait"
+(** [event_set_wait interface set timeout_ms event] waits for an event
+    and stores it into [event], a buffer made by [Event.make]. Returns
+    [false] if none arrived within the timeout. The device index is -1 for
+    a device not registered through [device_register_events]. *)
+
 (* The functions below could raise any of the nvml errors raised from the stubs *)
 let get_vgpus_for_vm iface device vm_domid =
   let vgpus = device_get_active_vgpus iface device in
@@ -142,15 +201,32 @@ module NVML : sig
   val attach : unit -> unit
 
   val detach : unit -> unit
+  (** Waits a few seconds at most for NVML calls in flight. If one is hung
+      in the driver the library is not shut down, but left loaded and no
+      longer used, and [Error (Timeout, _)] is raised. *)
 
   val is_attached : unit -> bool
 
   val get : unit -> interface option
+
+  val generation : unit -> int
+  (** Incremented on every successful attach. Anything derived from an
+      interface (device handles, inventories) is only valid while the
+      generation it was built under is current. *)
+
+  val wait_attached : unit -> interface
+  (** Block until the library is attached and return its interface. Returns
+      at once if it already is. *)
 end = struct
   let interface = ref (None : interface option)
 
+  let generation = ref 0
+
   let mx = Mutex.create ()
 
+  (* Broadcast whenever the library is attached or detached *)
+  let changed = Condition.create ()
+
   let finally = Xapi_stdext_pervasives.Pervasiveext.finally
 
   let with_mutex mx f =
@@ -163,6 +239,8 @@ end = struct
 
   let get () = !interface
 
+  let generation () = !generation
+
   let attach () =
     with_mutex mx @@ fun () ->
     match !interface with
@@ -172,6 +250,8 @@ end = struct
       match open_nvml_interface () with
       | i ->
           interface := Some i ;
+          incr generation ;
+          Condition.broadcast changed ;
           D.info "Nvml library attach: success"
       | exception e ->
           interface := None ;
@@ -186,12 +266,21 @@ end = struct
         D.warn "Nvml library detach: no library attached"
     | Some intf ->
         D.info "Nvml library detach: detaching" ;
-        finally
-          (fun () -> shutdown intf)
-          (fun () ->
-            interface := None ;
-            library_close intf
-          )
+        (* Stop handing out the interface before it goes away *)
+        interface := None ;
+        Condition.broadcast changed ;
+        finally (fun () -> shutdown intf) (fun () -> library_close intf)
 
   let is_attached () = match !interface with None -> false | Some _ -> true
+
+  let wait_attached () =
+    with_mutex mx @@ fun () ->
+    let rec wait () =
+      match !interface with
+      | Some interface ->
+          interface
+      | None ->
+          Condition.wait changed mx ; wait ()
+    in
+    wait ()
 end
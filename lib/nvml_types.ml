@@ -0,0 +1,385 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* The parts of the NVML bindings written in OCaml alone, shared by Nvml
+   and the mock that replaces it in CI so that the two cannot drift apart *)
+
+exception Library_not_loaded of string
+
+exception Symbol_not_loaded of string
+
+(** NVML return codes other than success *)
+module Error = struct
+  (* The constant constructors are in the order of their codes, starting at
+     1; the stubs depend on it, as does [constants]. *)
+  type t =
+    | Uninitialized
+    | Invalid_argument
+    | Not_supported
+    | No_permission
+    | Already_initialized
+    | Not_found
+    | Insufficient_size
+    | Insufficient_power
+    | Driver_not_loaded
+    | Timeout
+    | Irq_issue
+    | Library_not_found
+    | Function_not_found
+    | Corrupted_inforom
+    | Gpu_is_lost
+    | Reset_required
+    | Operating_system
+    | Lib_rm_version_mismatch
+    | In_use
+    | Memory
+    | No_data
+    | Vgpu_ecc_not_supported
+    | Unknown of int  (** any other code *)
+
+  let constants =
+    [|
+      Uninitialized
+    ; Invalid_argument
+    ; Not_supported
+    ; No_permission
+    ; Already_initialized
+    ; Not_found
+    ; Insufficient_size
+    ; Insufficient_power
+    ; Driver_not_loaded
+    ; Timeout
+    ; Irq_issue
+    ; Library_not_found
+    ; Function_not_found
+    ; Corrupted_inforom
+    ; Gpu_is_lost
+    ; Reset_required
+    ; Operating_system
+    ; Lib_rm_version_mismatch
+    ; In_use
+    ; Memory
+    ; No_data
+    ; Vgpu_ecc_not_supported
+    |]
+
+  (** The error of an NVML return code, such as those of [sample.status] *)
+  let of_code code =
+    if code >= 1 && code <= Array.length constants then
+      constants.(code - 1)
+    else
+      Unknown code
+
+  let to_code = function
+    | Unknown code ->
+        code
+    | error ->
+        let rec find i =
+          if constants.(i) = error then
+            i + 1
+          else
+            find (i + 1)
+        in
+        find 0
+
+  (** Errors that asking again will not change before the library is
+      re-attached: the device lacks the feature or we may not use it. *)
+  let is_unsupported = function
+    | Not_supported | No_permission ->
+        true
+    | _ ->
+        false
+end
+
+exception Error of Error.t * string
+(** Raised by the stubs when an NVML call fails, with NVML's description of
+    the error. *)
+
+let () =
+  Printexc.register_printer (function
+    | Error (error, msg) ->
+        Some (Printf.sprintf "Nvml.Error(%d, %S)" (Error.to_code error) msg)
+    | _ ->
+        None
+    )
+
+type enable_state = Disabled | Enabled
+
+type memory_info = {total: int64; free: int64; used: int64}
+
+type pci_info = {
+    bus_id: string  (** domain:bus:device.function PCI identifier *)
+  ; domain: int32
+  ; bus: int32
+  ; device: int32
+  ; pci_device_id: int32
+  ; pci_subsystem_id: int32
+}
+
+type utilization = {gpu: int; memory: int}
+
+type pgpu_metadata = string
+
+type vgpu_metadata = string
+
+type vgpu_instance = int
+
+type vm_domid = string
+
+type vgpu_uuid = string
+
+type vm_compat = None | Cold | Hybernate | Sleep | Live
+
+type pgpu_compat_limit = None | HostDriver | GuestDriver | GPU | Other
+
+(** Counts, errors and latency histograms of the calls made to each NVML
+    entry point, kept by the stubs at little cost. *)
+module Stats = struct
+  (** NVML entry points, in the order of their statistics *)
+  let entry_points =
+    [|
+       "init"
+     ; "shutdown"
+     ; "device_get_count"
+     ; "device_get_handle_by_index"
+     ; "device_get_handle_by_pci_bus_id"
+     ; "device_get_memory_info"
+     ; "device_get_pci_info"
+     ; "device_get_temperature"
+     ; "device_get_power_usage"
+     ; "device_get_utilization_rates"
+     ; "device_set_persistence_mode"
+     ; "device_get_vgpu_metadata"
+     ; "vgpu_instance_get_metadata"
+     ; "device_get_active_vgpus"
+     ; "vgpu_instance_get_vm_id"
+     ; "vgpu_instance_get_uuid"
+     ; "get_vgpu_compatibility"
+     ; "vgpu_instance_get_fb_usage"
+     ; "vgpu_instance_get_frame_rate_limit"
+     ; "device_get_vgpu_utilization"
+     ; "device_get_clock_info"
+     ; "device_get_pcie_throughput"
+     ; "device_get_encoder_utilization"
+     ; "device_get_decoder_utilization"
+     ; "device_get_total_ecc_errors"
+     ; "device_get_total_energy_consumption"
+     ; "event_set_create"
+     ; "event_set_free"
+     ; "event_set_wait"
+     ; "device_get_supported_event_types"
+     ; "device_register_events"
+    |]
+
+  (* Fields of the statistics of an entry point *)
+  let calls = 0
+
+  let errors = 1
+
+  let total_us = 2
+
+  (** Bucket 0 counts calls taking less than 1us, bucket [i] those taking
+      from 2^(i-1) up to 2^i us; the last bucket has no upper bound. *)
+  let buckets = 3
+
+  let bucket_count = 16
+
+  let fields = buckets + bucket_count
+
+  let make () = Array.make (Array.length entry_points * fields) 0
+end
+
+(** Groups of optional NVML entry points. Only the entry points needed to
+    find devices are looked up when the library is opened; the others are
+    looked up the first time their capability is asked for, and calls that
+    need a missing one fail without calling into NVML. *)
+module Capability = struct
+  type t = int
+
+  let memory_info = 0
+
+  let temperature = 1
+
+  let power_usage = 2
+
+  let utilization_rates = 3
+
+  let persistence_mode = 4
+
+  (** pGPU and vGPU metadata and their compatibility *)
+  let vgpu_metadata = 5
+
+  (** active vGPUs, their VM and UUID *)
+  let vgpu_instances = 6
+
+  (** framebuffer usage and frame rate limit of a vGPU *)
+  let vgpu_sample = 7
+
+  let vgpu_utilization = 8
+
+  let clock_info = 9
+
+  let pcie_throughput = 10
+
+  let encoder_utilization = 11
+
+  let decoder_utilization = 12
+
+  let total_ecc_errors = 13
+
+  let total_energy_consumption = 14
+
+  (** event sets, to wait for XID errors and other events *)
+  let events = 15
+
+  let count = 16
+
+  let bit capability = 1 lsl capability
+
+  let mask capabilities =
+    List.fold_left (fun acc c -> acc lor bit c) 0 capabilities
+
+  let mem capability capabilities = capabilities land bit capability <> 0
+end
+
+(** Metrics that can be read with [device_sample]. Each metric is an index
+    into the buffers of a [sample] and a bit in the mask selecting which
+    metrics to read. *)
+module Metric = struct
+  type t = int
+
+  let memory_free = 0
+
+  let memory_used = 1
+
+  let temperature = 2
+
+  let power_usage = 3
+
+  let utilisation_compute = 4
+
+  let utilisation_memory_io = 5
+
+  let clock_sm = 6
+
+  let clock_memory = 7
+
+  let pcie_tx = 8
+
+  let pcie_rx = 9
+
+  let utilisation_encoder = 10
+
+  let utilisation_decoder = 11
+
+  let ecc_corrected = 12
+
+  let ecc_uncorrected = 13
+
+  let energy = 14
+
+  let count = 15
+
+  let bit metric = 1 lsl metric
+
+  let mask metrics = List.fold_left (fun acc m -> acc lor bit m) 0 metrics
+end
+
+(** Buffers filled in place by [device_sample], meant to be allocated once
+    per device and reused for every sample. [values.(m)] holds the last
+    successful reading of metric [m] in NVML's units (bytes, degrees C, mW,
+    percent, MHz, bytes/s, errors, mJ) and [status.(m)] the NVML return code
+    of the call that produced it, 0 meaning success. *)
+type sample = {values: float array; status: int array}
+
+let make_sample () =
+  {values= Array.make Metric.count 0.0; status= Array.make Metric.count 0}
+
+(** The metrics of [mask] whose last reading into [sample] failed in a way
+    that will not change before the library is re-attached, see
+    [Error.is_unsupported]. *)
+let unsupported_metrics mask sample =
+  let unsupported = ref 0 in
+  for m = 0 to Metric.count - 1 do
+    if
+      mask land Metric.bit m <> 0
+      && Error.is_unsupported (Error.of_code sample.status.(m))
+    then
+      unsupported := !unsupported lor Metric.bit m
+  done ;
+  !unsupported
+
+(** Readings of a vGPU instance filled by [vgpu_instance_sample] into a
+    [sample], in the same way as [device_sample]. *)
+module Vgpu_metric = struct
+  let fb_usage = 0  (** bytes *)
+
+  let frame_rate_limit = 1  (** frames per second *)
+end
+
+(** Buffers for [device_get_vgpu_utilization]: sample [i] is for vGPU
+    instance [instances.(i)], its fields are
+    [samples.(i * Vgpu_utilization.fields + f)]. Utilisations are percent,
+    timestamps microseconds. *)
+type vgpu_utilization = {
+    mutable instances: vgpu_instance array
+  ; mutable samples: float array
+}
+
+module Vgpu_utilization = struct
+  let timestamp = 0
+
+  let sm = 1
+
+  let memory = 2
+
+  let encoder = 3
+
+  let decoder = 4
+
+  let fields = 5
+end
+
+let make_vgpu_utilization capacity =
+  {
+    instances= Array.make capacity 0
+  ; samples= Array.make (capacity * Vgpu_utilization.fields) 0.0
+  }
+
+(** Events of NVML event sets *)
+module Event = struct
+  (** Event types, as NVML's nvmlEventType bits *)
+
+  let single_bit_ecc_error = 0x1
+
+  let double_bit_ecc_error = 0x2
+
+  let pstate = 0x4
+
+  (** the data of the event is the XID *)
+  let xid_critical_error = 0x8
+
+  let clock = 0x10
+
+  (* Fields of the buffer filled by [event_set_wait] *)
+  let device = 0
+
+  let event_type = 1
+
+  let data = 2
+
+  let fields = 3
+
+  let make () = Array.make fields 0
+end
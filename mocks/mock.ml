@@ -1,26 +1,9 @@
-exception Library_not_loaded of string
-
-exception Symbol_not_loaded of string
+include Nvml_types
 
 type interface = unit
 
 type device = unit
 
-type enable_state = Disabled | Enabled
-
-type memory_info = {total: int64; free: int64; used: int64}
-
-type pci_info = {
-    bus_id: string
-  ; domain: int32
-  ; bus: int32
-  ; device: int32
-  ; pci_device_id: int32
-  ; pci_subsystem_id: int32
-}
-
-type utilization = {gpu: int; memory: int}
-
 let memory_info = {total= 0L; free= 0L; used= 0L}
 
 let pci_info =
@@ -35,23 +18,25 @@ let pci_info =
 
 let utilization = {gpu= 0; memory= 0}
 
-type pgpu_metadata = string
+type vgpu_compatibility_t = unit
 
-type vgpu_metadata = string
+let library_path = ref "libnvidia-ml.so.1"
 
-type vgpu_instance = int
+let library_open () = ()
 
-type vm_domid = string
+let library_close () = ()
 
-type vgpu_compatibility_t = unit
+let call_count () = 0
 
-type vm_compat = None | Cold | Hybernate | Sleep | Live
+module Stats = struct
+  include Nvml_types.Stats
 
-type pgpu_compat_limit = None | HostDriver | GuestDriver | GPU | Other
+  let read _stats = ()
+end
 
-let library_open () = ()
+let capabilities _interface mask = mask
 
-let library_close () = ()
+let supports _interface _capability = true
 
 let init () = ()
 
@@ -73,6 +58,12 @@ let device_get_power_usage _interface _device = 0
 
 let device_get_utilization_rates _interface _device = utilization
 
+let device_sample _interface _device _mask _sample = ()
+
+let vgpu_instance_sample _interface _vgpu _sample = ()
+
+let device_get_vgpu_utilization _interface _device ~last_seen:_ _buffer = 0
+
 let device_set_persistence_mode _interface _device _enable_state = ()
 
 let device_get_pgpu_metadata _interface _device = ""
@@ -97,6 +88,18 @@ let vgpu_compat_get_vm_compat _vgpu_compatibility_t = []
 
 let vgpu_compat_get_pgpu_compat_limit _vgpu_compatibility_t = []
 
+type event_set = unit
+
+let event_set_create _interface = ()
+
+let event_set_free _interface _set = ()
+
+let device_register_events _interface _set _device _mask = 0
+
+let event_set_wait _interface _set timeout _event =
+  Thread.delay (float_of_int timeout /. 1000.0) ;
+  false
+
 let get_vgpus_for_vm _iface _device _vm_domid = []
 
 let get_vgpu_for_uuid _iface _vgpu_uuid _vgpus = []
@@ -109,4 +112,8 @@ module NVML = struct
   let is_attached () = true
 
   let get () : interface option = None
+
+  let generation () = 0
+
+  let wait_attached () = ()
 end
@@ -0,0 +1,955 @@
+/*
+ * A stand-in for libnvidia-ml.so.1 that simulates GPUs described by a
+ * scenario file, so that the real NVML stubs and sampling loop can be run
+ * and profiled without a GPU. Point gpumon at it with the
+ * GPUMON_NVML_LIBRARY environment variable (or the nvml-library option)
+ * and at a scenario with NVML_SIM_SCENARIO; see sim/example.scenario for
+ * the format.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nvml.h>
+
+#define SIM_MAX_GPUS 64
+#define SIM_MAX_VGPUS 64
+#define SIM_MAX_RULES 64
+#define SIM_NAME_SIZE 64
+
+typedef enum {
+    WAVE_CONST,
+    WAVE_SINE,
+    WAVE_RAMP,
+    WAVE_SQUARE
+} waveKind;
+
+typedef struct {
+    waveKind kind;
+    double min;
+    double max;
+    double period;              /* seconds */
+} waveform;
+
+enum {
+    SIM_MEMORY_TOTAL,
+    SIM_MEMORY_USED,
+    SIM_TEMPERATURE,
+    SIM_POWER,
+    SIM_UTILISATION_GPU,
+    SIM_UTILISATION_MEMORY,
+    SIM_CLOCK_SM,
+    SIM_CLOCK_MEMORY,
+    SIM_PCIE_TX,
+    SIM_PCIE_RX,
+    SIM_UTILISATION_ENCODER,
+    SIM_UTILISATION_DECODER,
+    SIM_ECC_CORRECTED,
+    SIM_ECC_UNCORRECTED,
+    SIM_METRIC_COUNT
+};
+
+static const char *metricNames[SIM_METRIC_COUNT] = {
+    "memory_total",
+    "memory_used",
+    "temperature",
+    "power",
+    "utilisation_gpu",
+    "utilisation_memory",
+    "clock_sm",
+    "clock_memory",
+    "pcie_tx",
+    "pcie_rx",
+    "utilisation_encoder",
+    "utilisation_decoder",
+    "ecc_corrected",
+    "ecc_uncorrected",
+};
+
+typedef struct {
+    nvmlVgpuInstance_t instance;
+    char domid[80];
+    char uuid[80];
+} simVgpu;
+
+typedef struct simGpu {
+    char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
+    unsigned int pciDeviceId;
+    unsigned int pciSubSystemId;
+    nvmlEnableState_t persistenceMode;
+    waveform metrics[SIM_METRIC_COUNT];
+    unsigned int vgpuCount;
+    simVgpu vgpus[SIM_MAX_VGPUS];
+    unsigned int xid;           /* reported every xidPeriod seconds */
+    double xidPeriod;
+    double nextXid;
+    nvmlEventSet_t eventSet;    /* the set registeredEvents belong to */
+    unsigned long long registeredEvents;
+} simGpu;
+
+/* Latency and error injection for an NVML entry point, optionally
+ * restricted to one GPU, to a number of calls and to calls made some time
+ * after nvmlInit. */
+typedef struct {
+    char function[SIM_NAME_SIZE];
+    int gpu;                    /* -1 for all GPUs */
+    unsigned int latencyUs;
+    nvmlReturn_t error;
+    int remaining;              /* -1 for unlimited */
+    double after;               /* seconds */
+} simRule;
+
+typedef struct {
+    int initialised;
+    struct timespec start;
+    char driverVersion[80];
+    unsigned int gpuCount;
+    simGpu gpus[SIM_MAX_GPUS];
+    unsigned int ruleCount;
+    simRule rules[SIM_MAX_RULES];
+} simState;
+
+static simState sim;
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int nextVgpuInstance = 1;
+
+static const struct {
+    const char *name;
+    nvmlReturn_t code;
+} errorNames[] = {
+    {"SUCCESS", NVML_SUCCESS},
+    {"UNINITIALIZED", NVML_ERROR_UNINITIALIZED},
+    {"INVALID_ARGUMENT", NVML_ERROR_INVALID_ARGUMENT},
+    {"NOT_SUPPORTED", NVML_ERROR_NOT_SUPPORTED},
+    {"NO_PERMISSION", NVML_ERROR_NO_PERMISSION},
+    {"NOT_FOUND", NVML_ERROR_NOT_FOUND},
+    {"INSUFFICIENT_SIZE", NVML_ERROR_INSUFFICIENT_SIZE},
+    {"INSUFFICIENT_POWER", NVML_ERROR_INSUFFICIENT_POWER},
+    {"DRIVER_NOT_LOADED", NVML_ERROR_DRIVER_NOT_LOADED},
+    {"TIMEOUT", NVML_ERROR_TIMEOUT},
+    {"IRQ_ISSUE", NVML_ERROR_IRQ_ISSUE},
+    {"GPU_IS_LOST", NVML_ERROR_GPU_IS_LOST},
+    {"RESET_REQUIRED", NVML_ERROR_RESET_REQUIRED},
+    {"MEMORY", NVML_ERROR_MEMORY},
+    {"NO_DATA", NVML_ERROR_NO_DATA},
+    {"UNKNOWN", NVML_ERROR_UNKNOWN},
+};
+
+#define ERROR_NAME_COUNT (sizeof(errorNames) / sizeof(errorNames[0]))
+
+/* Scenario parsing */
+
+static int parse_error_name(const char *name, nvmlReturn_t * code)
+{
+    for (size_t i = 0; i < ERROR_NAME_COUNT; i++) {
+        if (strcmp(name, errorNames[i].name) == 0) {
+            *code = errorNames[i].code;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* "const:V", "sine:MIN:MAX:PERIOD", "ramp:MIN:MAX:PERIOD" or
+ * "square:MIN:MAX:PERIOD" */
+static int parse_waveform(const char *spec, waveform * wave)
+{
+    char kind[16];
+    double min, max, period;
+
+    if (sscanf(spec, "const:%lf", &min) == 1) {
+        wave->kind = WAVE_CONST;
+        wave->min = wave->max = min;
+        wave->period = 1.0;
+        return 0;
+    }
+    if (sscanf(spec, "%15[a-z]:%lf:%lf:%lf", kind, &min, &max, &period) != 4
+        || period <= 0.0) {
+        return -1;
+    }
+    if (strcmp(kind, "sine") == 0) {
+        wave->kind = WAVE_SINE;
+    } else if (strcmp(kind, "ramp") == 0) {
+        wave->kind = WAVE_RAMP;
+    } else if (strcmp(kind, "square") == 0) {
+        wave->kind = WAVE_SQUARE;
+    } else {
+        return -1;
+    }
+    wave->min = min;
+    wave->max = max;
+    wave->period = period;
+    return 0;
+}
+
+static void default_gpu(simGpu * gpu)
+{
+    memset(gpu, 0, sizeof(*gpu));
+    gpu->persistenceMode = NVML_FEATURE_DISABLED;
+    gpu->metrics[SIM_MEMORY_TOTAL] =
+        (waveform) { WAVE_CONST, 4294967296.0, 4294967296.0, 1.0 };
+    gpu->metrics[SIM_MEMORY_USED] =
+        (waveform) { WAVE_SINE, 0.0, 4294967296.0, 60.0 };
+    gpu->metrics[SIM_TEMPERATURE] =
+        (waveform) { WAVE_SINE, 35.0, 80.0, 120.0 };
+    gpu->metrics[SIM_POWER] =
+        (waveform) { WAVE_SINE, 30000.0, 150000.0, 30.0 };
+    gpu->metrics[SIM_UTILISATION_GPU] =
+        (waveform) { WAVE_RAMP, 0.0, 100.0, 20.0 };
+    gpu->metrics[SIM_UTILISATION_MEMORY] =
+        (waveform) { WAVE_SQUARE, 10.0, 60.0, 10.0 };
+    gpu->metrics[SIM_CLOCK_SM] =
+        (waveform) { WAVE_SQUARE, 405.0, 1590.0, 30.0 };
+    gpu->metrics[SIM_CLOCK_MEMORY] =
+        (waveform) { WAVE_CONST, 5001.0, 5001.0, 1.0 };
+    gpu->metrics[SIM_PCIE_TX] =
+        (waveform) { WAVE_SINE, 0.0, 2000000.0, 45.0 };
+    gpu->metrics[SIM_PCIE_RX] =
+        (waveform) { WAVE_SINE, 0.0, 500000.0, 45.0 };
+    gpu->metrics[SIM_UTILISATION_ENCODER] =
+        (waveform) { WAVE_RAMP, 0.0, 40.0, 25.0 };
+    gpu->metrics[SIM_UTILISATION_DECODER] =
+        (waveform) { WAVE_CONST, 0.0, 0.0, 1.0 };
+    gpu->metrics[SIM_ECC_CORRECTED] =
+        (waveform) { WAVE_CONST, 0.0, 0.0, 1.0 };
+    gpu->metrics[SIM_ECC_UNCORRECTED] =
+        (waveform) { WAVE_CONST, 0.0, 0.0, 1.0 };
+}
+
+static int parse_line(char *line, int lineno)
+{
+    char *words[8];
+    int count = 0;
+    char *save = NULL;
+    simGpu *gpu = sim.gpuCount ? &sim.gpus[sim.gpuCount - 1] : NULL;
+
+    for (char *word = strtok_r(line, " \t\r\n", &save);
+         word && count < 8; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if (word[0] == '#')
+            break;
+        words[count++] = word;
+    }
+    if (count == 0)
+        return 0;
+
+    if (strcmp(words[0], "driver") == 0 && count == 2) {
+        snprintf(sim.driverVersion, sizeof(sim.driverVersion), "%s",
+                 words[1]);
+        return 0;
+    }
+    if (strcmp(words[0], "gpu") == 0 && count == 4) {
+        if (sim.gpuCount >= SIM_MAX_GPUS)
+            goto Error;
+        gpu = &sim.gpus[sim.gpuCount++];
+        default_gpu(gpu);
+        snprintf(gpu->busId, sizeof(gpu->busId), "%s", words[1]);
+        gpu->pciDeviceId = strtoul(words[2], NULL, 0);
+        gpu->pciSubSystemId = strtoul(words[3], NULL, 0);
+        return 0;
+    }
+    if (strcmp(words[0], "metric") == 0 && count == 3 && gpu) {
+        for (int i = 0; i < SIM_METRIC_COUNT; i++) {
+            if (strcmp(words[1], metricNames[i]) == 0
+                && parse_waveform(words[2], &gpu->metrics[i]) == 0)
+                return 0;
+        }
+        goto Error;
+    }
+    if (strcmp(words[0], "xid") == 0 && count == 3 && gpu) {
+        gpu->xid = strtoul(words[1], NULL, 0);
+        gpu->xidPeriod = strtod(words[2], NULL);
+        if (gpu->xidPeriod <= 0.0)
+            goto Error;
+        return 0;
+    }
+    if (strcmp(words[0], "vgpu") == 0 && count == 3 && gpu) {
+        simVgpu *vgpu;
+
+        if (gpu->vgpuCount >= SIM_MAX_VGPUS)
+            goto Error;
+        vgpu = &gpu->vgpus[gpu->vgpuCount++];
+        vgpu->instance = nextVgpuInstance++;
+        snprintf(vgpu->domid, sizeof(vgpu->domid), "%s", words[1]);
+        snprintf(vgpu->uuid, sizeof(vgpu->uuid), "%s", words[2]);
+        return 0;
+    }
+    if ((strcmp(words[0], "latency") == 0
+         || strcmp(words[0], "error") == 0) && count >= 3) {
+        simRule *rule;
+
+        if (sim.ruleCount >= SIM_MAX_RULES)
+            goto Error;
+        rule = &sim.rules[sim.ruleCount++];
+        memset(rule, 0, sizeof(*rule));
+        snprintf(rule->function, sizeof(rule->function), "%s", words[1]);
+        rule->gpu = -1;
+        rule->remaining = -1;
+        rule->error = NVML_SUCCESS;
+        if (words[0][0] == 'l') {
+            rule->latencyUs = strtoul(words[2], NULL, 0);
+        } else if (parse_error_name(words[2], &rule->error)) {
+            goto Error;
+        }
+        for (int i = 3; i < count; i++) {
+            if (sscanf(words[i], "gpu=%d", &rule->gpu) != 1
+                && sscanf(words[i], "count=%d", &rule->remaining) != 1
+                && sscanf(words[i], "after=%lf", &rule->after) != 1)
+                goto Error;
+        }
+        return 0;
+    }
+
+  Error:
+    fprintf(stderr, "nvml_sim: line %d: cannot parse '%s'\n", lineno,
+            words[0]);
+    return -1;
+}
+
+static nvmlReturn_t load_scenario(void)
+{
+    const char *path = getenv("NVML_SIM_SCENARIO");
+    char line[512];
+    int lineno = 0;
+    FILE *file;
+
+    memset(&sim, 0, sizeof(sim));
+    snprintf(sim.driverVersion, sizeof(sim.driverVersion), "470.82");
+    nextVgpuInstance = 1;
+    if (!path || !*path)
+        return NVML_SUCCESS;
+    file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return NVML_ERROR_DRIVER_NOT_LOADED;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (parse_line(line, ++lineno)) {
+            fclose(file);
+            return NVML_ERROR_UNKNOWN;
+        }
+    }
+    fclose(file);
+    return NVML_SUCCESS;
+}
+
+/* Simulation */
+
+static double elapsed(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - sim.start.tv_sec)
+        + (now.tv_nsec - sim.start.tv_nsec) / 1e9;
+}
+
+static double sample_waveform(const waveform * wave)
+{
+    double phase = fmod(elapsed(), wave->period) / wave->period;
+
+    switch (wave->kind) {
+    case WAVE_SINE:
+        return wave->min + (wave->max - wave->min)
+            * (0.5 + 0.5 * sin(2.0 * M_PI * phase));
+    case WAVE_RAMP:
+        return wave->min + (wave->max - wave->min) * phase;
+    case WAVE_SQUARE:
+        return phase < 0.5 ? wave->min : wave->max;
+    case WAVE_CONST:
+    default:
+        return wave->min;
+    }
+}
+
+/* Running total of a rate given by a waveform, taken at the waveform's
+ * mean so that it never decreases */
+static double accumulate_waveform(const waveform * wave)
+{
+    return elapsed() * (wave->min + wave->max) / 2.0;
+}
+
+static int gpu_index(nvmlDevice_t device)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    if (gpu < sim.gpus || gpu >= sim.gpus + sim.gpuCount)
+        return -1;
+    return gpu - sim.gpus;
+}
+
+/* Apply the latency and error rules for a call; gpu is -1 for calls not
+ * related to a particular device. */
+static nvmlReturn_t sim_call(const char *function, int gpu)
+{
+    unsigned int latencyUs = 0;
+    nvmlReturn_t error = NVML_SUCCESS;
+
+    if (!sim.initialised)
+        return NVML_ERROR_UNINITIALIZED;
+
+    pthread_mutex_lock(&simLock);
+    for (unsigned int i = 0; i < sim.ruleCount; i++) {
+        simRule *rule = &sim.rules[i];
+
+        if (strcmp(rule->function, function) != 0
+            && strcmp(rule->function, "*") != 0)
+            continue;
+        if (rule->gpu >= 0 && rule->gpu != gpu)
+            continue;
+        if (rule->remaining == 0 || elapsed() < rule->after)
+            continue;
+        if (rule->remaining > 0)
+            rule->remaining--;
+        latencyUs += rule->latencyUs;
+        if (error == NVML_SUCCESS)
+            error = rule->error;
+    }
+    pthread_mutex_unlock(&simLock);
+
+    if (latencyUs)
+        usleep(latencyUs);
+    return error;
+}
+
+static simVgpu *find_vgpu(nvmlVgpuInstance_t instance, simGpu ** owner)
+{
+    for (unsigned int i = 0; i < sim.gpuCount; i++) {
+        for (unsigned int j = 0; j < sim.gpus[i].vgpuCount; j++) {
+            if (sim.gpus[i].vgpus[j].instance == instance) {
+                if (owner)
+                    *owner = &sim.gpus[i];
+                return &sim.gpus[i].vgpus[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+#define SIM_CALL(function, gpu) \
+    do { \
+        nvmlReturn_t injected = sim_call(function, gpu); \
+        if (injected != NVML_SUCCESS) \
+            return injected; \
+    } while (0)
+
+#define SIM_DEVICE(device) \
+    do { \
+        if (gpu_index(device) < 0) \
+            return NVML_ERROR_INVALID_ARGUMENT; \
+    } while (0)
+
+/* NVML entry points */
+
+const char *nvmlErrorString(nvmlReturn_t result)
+{
+    for (size_t i = 0; i < ERROR_NAME_COUNT; i++) {
+        if (errorNames[i].code == result)
+            return errorNames[i].name;
+    }
+    return "UNKNOWN";
+}
+
+nvmlReturn_t nvmlInit(void)
+{
+    nvmlReturn_t error;
+
+    if (sim.initialised)
+        return NVML_SUCCESS;
+    error = load_scenario();
+    if (error != NVML_SUCCESS)
+        return error;
+    clock_gettime(CLOCK_MONOTONIC, &sim.start);
+    sim.initialised = 1;
+    return sim_call("Init", -1);
+}
+
+nvmlReturn_t nvmlShutdown(void)
+{
+    SIM_CALL("Shutdown", -1);
+    sim.initialised = 0;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetCount(unsigned int *deviceCount)
+{
+    SIM_CALL("DeviceGetCount", -1);
+    *deviceCount = sim.gpuCount;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t
+nvmlDeviceGetHandleByIndex(unsigned int index, nvmlDevice_t * device)
+{
+    SIM_CALL("DeviceGetHandleByIndex", index);
+    if (index >= sim.gpuCount)
+        return NVML_ERROR_INVALID_ARGUMENT;
+    *device = (nvmlDevice_t) & sim.gpus[index];
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t
+nvmlDeviceGetHandleByPciBusId(const char *pciBusId, nvmlDevice_t * device)
+{
+    SIM_CALL("DeviceGetHandleByPciBusId", -1);
+    for (unsigned int i = 0; i < sim.gpuCount; i++) {
+        if (strcasecmp(sim.gpus[i].busId, pciBusId) == 0) {
+            *device = (nvmlDevice_t) & sim.gpus[i];
+            return NVML_SUCCESS;
+        }
+    }
+    return NVML_ERROR_NOT_FOUND;
+}
+
+nvmlReturn_t nvmlDeviceGetMemoryInfo(nvmlDevice_t device,
+                                     nvmlMemory_t * memory)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetMemoryInfo", gpu_index(device));
+    memory->total = sample_waveform(&gpu->metrics[SIM_MEMORY_TOTAL]);
+    memory->used = sample_waveform(&gpu->metrics[SIM_MEMORY_USED]);
+    if (memory->used > memory->total)
+        memory->used = memory->total;
+    memory->free = memory->total - memory->used;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPciInfo(nvmlDevice_t device, nvmlPciInfo_t * pci)
+{
+    simGpu *gpu = (simGpu *) device;
+    unsigned int domain = 0, bus = 0, dev = 0, function = 0;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetPciInfo", gpu_index(device));
+    memset(pci, 0, sizeof(*pci));
+    sscanf(gpu->busId, "%x:%x:%x.%x", &domain, &bus, &dev, &function);
+    snprintf(pci->busId, sizeof(pci->busId), "%s", gpu->busId);
+    pci->domain = domain;
+    pci->bus = bus;
+    pci->device = dev;
+    pci->pciDeviceId = gpu->pciDeviceId;
+    pci->pciSubSystemId = gpu->pciSubSystemId;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTemperature(nvmlDevice_t device,
+                                      nvmlTemperatureSensors_t sensor,
+                                      unsigned int *temp)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetTemperature", gpu_index(device));
+    if (sensor != NVML_TEMPERATURE_GPU)
+        return NVML_ERROR_INVALID_ARGUMENT;
+    *temp = sample_waveform(&gpu->metrics[SIM_TEMPERATURE]);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerUsage(nvmlDevice_t device,
+                                     unsigned int *power)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetPowerUsage", gpu_index(device));
+    *power = sample_waveform(&gpu->metrics[SIM_POWER]);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUtilizationRates(nvmlDevice_t device,
+                                           nvmlUtilization_t * utilization)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetUtilizationRates", gpu_index(device));
+    utilization->gpu = sample_waveform(&gpu->metrics[SIM_UTILISATION_GPU]);
+    utilization->memory =
+        sample_waveform(&gpu->metrics[SIM_UTILISATION_MEMORY]);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetClockInfo(nvmlDevice_t device,
+                                    nvmlClockType_t type,
+                                    unsigned int *clock)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetClockInfo", gpu_index(device));
+    switch (type) {
+    case NVML_CLOCK_SM:
+        *clock = sample_waveform(&gpu->metrics[SIM_CLOCK_SM]);
+        return NVML_SUCCESS;
+    case NVML_CLOCK_MEM:
+        *clock = sample_waveform(&gpu->metrics[SIM_CLOCK_MEMORY]);
+        return NVML_SUCCESS;
+    default:
+        return NVML_ERROR_NOT_SUPPORTED;
+    }
+}
+
+nvmlReturn_t nvmlDeviceGetPcieThroughput(nvmlDevice_t device,
+                                         nvmlPcieUtilCounter_t counter,
+                                         unsigned int *value)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetPcieThroughput", gpu_index(device));
+    if (counter == NVML_PCIE_UTIL_TX_BYTES)
+        *value = sample_waveform(&gpu->metrics[SIM_PCIE_TX]);
+    else if (counter == NVML_PCIE_UTIL_RX_BYTES)
+        *value = sample_waveform(&gpu->metrics[SIM_PCIE_RX]);
+    else
+        return NVML_ERROR_INVALID_ARGUMENT;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetEncoderUtilization(nvmlDevice_t device,
+                                             unsigned int *utilization,
+                                             unsigned int *samplingPeriodUs)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetEncoderUtilization", gpu_index(device));
+    *utilization = sample_waveform(&gpu->metrics[SIM_UTILISATION_ENCODER]);
+    *samplingPeriodUs = 1000000;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetDecoderUtilization(nvmlDevice_t device,
+                                             unsigned int *utilization,
+                                             unsigned int *samplingPeriodUs)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetDecoderUtilization", gpu_index(device));
+    *utilization = sample_waveform(&gpu->metrics[SIM_UTILISATION_DECODER]);
+    *samplingPeriodUs = 1000000;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTotalEccErrors(nvmlDevice_t device,
+                                         nvmlMemoryErrorType_t errorType,
+                                         nvmlEccCounterType_t counterType,
+                                         unsigned long long *eccCounts)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetTotalEccErrors", gpu_index(device));
+    if (errorType == NVML_MEMORY_ERROR_TYPE_CORRECTED)
+        *eccCounts = accumulate_waveform(&gpu->metrics[SIM_ECC_CORRECTED]);
+    else if (errorType == NVML_MEMORY_ERROR_TYPE_UNCORRECTED)
+        *eccCounts =
+            accumulate_waveform(&gpu->metrics[SIM_ECC_UNCORRECTED]);
+    else
+        return NVML_ERROR_INVALID_ARGUMENT;
+    return NVML_SUCCESS;
+}
+
+/* Power is in mW, so its running total is in mJ */
+nvmlReturn_t nvmlDeviceGetTotalEnergyConsumption(nvmlDevice_t device,
+                                                 unsigned long long *energy)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetTotalEnergyConsumption", gpu_index(device));
+    *energy = accumulate_waveform(&gpu->metrics[SIM_POWER]);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceSetPersistenceMode(nvmlDevice_t device,
+                                          nvmlEnableState_t mode)
+{
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceSetPersistenceMode", gpu_index(device));
+    ((simGpu *) device)->persistenceMode = mode;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetVgpuMetadata(nvmlDevice_t device,
+                                       nvmlVgpuPgpuMetadata_t * metadata,
+                                       unsigned int *bufferSize)
+{
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetVgpuMetadata", gpu_index(device));
+    if (!metadata || *bufferSize < sizeof(*metadata)) {
+        *bufferSize = sizeof(*metadata);
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    }
+    memset(metadata, 0, sizeof(*metadata));
+    metadata->version = 1;
+    metadata->revision = 1;
+    snprintf(metadata->hostDriverVersion,
+             sizeof(metadata->hostDriverVersion), "%s", sim.driverVersion);
+    *bufferSize = sizeof(*metadata);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlVgpuInstanceGetMetadata(nvmlVgpuInstance_t instance,
+                                         nvmlVgpuMetadata_t * metadata,
+                                         unsigned int *bufferSize)
+{
+    simGpu *gpu = NULL;
+
+    if (!find_vgpu(instance, &gpu))
+        return NVML_ERROR_NOT_FOUND;
+    SIM_CALL("VgpuInstanceGetMetadata", gpu - sim.gpus);
+    if (!metadata || *bufferSize < sizeof(*metadata)) {
+        *bufferSize = sizeof(*metadata);
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    }
+    memset(metadata, 0, sizeof(*metadata));
+    metadata->version = 1;
+    metadata->revision = 1;
+    snprintf(metadata->hostDriverVersion,
+             sizeof(metadata->hostDriverVersion), "%s", sim.driverVersion);
+    snprintf(metadata->guestDriverVersion,
+             sizeof(metadata->guestDriverVersion), "%s", sim.driverVersion);
+    *bufferSize = sizeof(*metadata);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetActiveVgpus(nvmlDevice_t device,
+                                      unsigned int *vgpuCount,
+                                      nvmlVgpuInstance_t * vgpuInstances)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetActiveVgpus", gpu_index(device));
+    if (*vgpuCount < gpu->vgpuCount) {
+        *vgpuCount = gpu->vgpuCount;
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    }
+    *vgpuCount = gpu->vgpuCount;
+    for (unsigned int i = 0; i < gpu->vgpuCount; i++)
+        vgpuInstances[i] = gpu->vgpus[i].instance;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlVgpuInstanceGetVmID(nvmlVgpuInstance_t instance,
+                                     char *vmId, unsigned int size,
+                                     nvmlVgpuVmIdType_t * vmIdType)
+{
+    simGpu *gpu = NULL;
+    simVgpu *vgpu = find_vgpu(instance, &gpu);
+
+    if (!vgpu)
+        return NVML_ERROR_NOT_FOUND;
+    SIM_CALL("VgpuInstanceGetVmID", gpu - sim.gpus);
+    if (size <= strlen(vgpu->domid))
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    strcpy(vmId, vgpu->domid);
+    *vmIdType = NVML_VGPU_VM_ID_DOMAIN_ID;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlVgpuInstanceGetUUID(nvmlVgpuInstance_t instance,
+                                     char *uuid, unsigned int size)
+{
+    simGpu *gpu = NULL;
+    simVgpu *vgpu = find_vgpu(instance, &gpu);
+
+    if (!vgpu)
+        return NVML_ERROR_NOT_FOUND;
+    SIM_CALL("VgpuInstanceGetUUID", gpu - sim.gpus);
+    if (size <= strlen(vgpu->uuid))
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    strcpy(uuid, vgpu->uuid);
+    return NVML_SUCCESS;
+}
+
+/* The vGPUs of a GPU share its framebuffer and engines equally. */
+nvmlReturn_t nvmlVgpuInstanceGetFbUsage(nvmlVgpuInstance_t instance,
+                                        unsigned long long *fbUsage)
+{
+    simGpu *gpu = NULL;
+
+    if (!find_vgpu(instance, &gpu))
+        return NVML_ERROR_NOT_FOUND;
+    SIM_CALL("VgpuInstanceGetFbUsage", gpu - sim.gpus);
+    *fbUsage = sample_waveform(&gpu->metrics[SIM_MEMORY_USED])
+        / gpu->vgpuCount;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlVgpuInstanceGetFrameRateLimit(nvmlVgpuInstance_t instance,
+                                               unsigned int *frameRateLimit)
+{
+    simGpu *gpu = NULL;
+
+    if (!find_vgpu(instance, &gpu))
+        return NVML_ERROR_NOT_FOUND;
+    SIM_CALL("VgpuInstanceGetFrameRateLimit", gpu - sim.gpus);
+    *frameRateLimit = 60;
+    return NVML_SUCCESS;
+}
+
+/* Every call returns one fresh sample per vGPU, timestamped now. */
+nvmlReturn_t nvmlDeviceGetVgpuUtilization(nvmlDevice_t device,
+                                          unsigned long long
+                                          lastSeenTimeStamp,
+                                          nvmlValueType_t * sampleValType,
+                                          unsigned int
+                                          *vgpuInstanceSamplesCount,
+                                          nvmlVgpuInstanceUtilizationSample_t
+                                          * utilizationSamples)
+{
+    simGpu *gpu = (simGpu *) device;
+    struct timespec now;
+    unsigned long long timeStamp;
+    unsigned int sm, memory;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetVgpuUtilization", gpu_index(device));
+    if (gpu->vgpuCount == 0)
+        return NVML_ERROR_NOT_FOUND;
+    if (*vgpuInstanceSamplesCount < gpu->vgpuCount) {
+        *vgpuInstanceSamplesCount = gpu->vgpuCount;
+        return NVML_ERROR_INSUFFICIENT_SIZE;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    timeStamp = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    if (timeStamp <= lastSeenTimeStamp)
+        return NVML_ERROR_NOT_FOUND;
+    sm = sample_waveform(&gpu->metrics[SIM_UTILISATION_GPU])
+        / gpu->vgpuCount;
+    memory = sample_waveform(&gpu->metrics[SIM_UTILISATION_MEMORY])
+        / gpu->vgpuCount;
+    *sampleValType = NVML_VALUE_TYPE_UNSIGNED_INT;
+    *vgpuInstanceSamplesCount = gpu->vgpuCount;
+    for (unsigned int i = 0; i < gpu->vgpuCount; i++) {
+        nvmlVgpuInstanceUtilizationSample_t *sample = &utilizationSamples[i];
+
+        memset(sample, 0, sizeof(*sample));
+        sample->vgpuInstance = gpu->vgpus[i].instance;
+        sample->timeStamp = timeStamp;
+        sample->smUtil.uiVal = sm;
+        sample->memUtil.uiVal = memory;
+    }
+    return NVML_SUCCESS;
+}
+
+/* Live migration is possible between identical host drivers; anything
+ * else is only cold-migratable and limited by the host driver. */
+nvmlReturn_t nvmlGetVgpuCompatibility(nvmlVgpuMetadata_t * vgpuMetadata,
+                                      nvmlVgpuPgpuMetadata_t * pgpuMetadata,
+                                      nvmlVgpuPgpuCompatibility_t * compat)
+{
+    SIM_CALL("GetVgpuCompatibility", -1);
+    if (strcmp(vgpuMetadata->hostDriverVersion,
+               pgpuMetadata->hostDriverVersion) == 0) {
+        compat->vgpuVmCompatibility = NVML_VGPU_VM_COMPATIBILITY_LIVE;
+        compat->compatibilityLimitCode = NVML_VGPU_COMPATIBILITY_LIMIT_NONE;
+    } else {
+        compat->vgpuVmCompatibility = NVML_VGPU_VM_COMPATIBILITY_COLD;
+        compat->compatibilityLimitCode =
+            NVML_VGPU_COMPATIBILITY_LIMIT_HOST_DRIVER;
+    }
+    return NVML_SUCCESS;
+}
+
+/* The events a GPU is registered for are kept with the GPU, together with
+ * the set they were registered on. */
+struct nvmlEventSet_st {
+    int unused;
+};
+
+nvmlReturn_t nvmlEventSetCreate(nvmlEventSet_t * set)
+{
+    SIM_CALL("EventSetCreate", -1);
+    *set = calloc(1, sizeof(**set));
+    return *set ? NVML_SUCCESS : NVML_ERROR_MEMORY;
+}
+
+nvmlReturn_t nvmlEventSetFree(nvmlEventSet_t set)
+{
+    SIM_CALL("EventSetFree", -1);
+    for (unsigned int i = 0; i < sim.gpuCount; i++) {
+        simGpu *gpu = &sim.gpus[i];
+
+        if (gpu->eventSet != set)
+            continue;
+        gpu->eventSet = NULL;
+        gpu->registeredEvents = 0;
+    }
+    free(set);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetSupportedEventTypes(nvmlDevice_t device,
+                                              unsigned long long
+                                              *eventTypes)
+{
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceGetSupportedEventTypes", gpu_index(device));
+    *eventTypes = nvmlEventTypeXidCriticalError;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceRegisterEvents(nvmlDevice_t device,
+                                      unsigned long long eventTypes,
+                                      nvmlEventSet_t set)
+{
+    simGpu *gpu = (simGpu *) device;
+
+    SIM_DEVICE(device);
+    SIM_CALL("DeviceRegisterEvents", gpu_index(device));
+    if (eventTypes & ~nvmlEventTypeXidCriticalError)
+        return NVML_ERROR_NOT_SUPPORTED;
+    gpu->eventSet = set;
+    gpu->registeredEvents = eventTypes;
+    gpu->nextXid = elapsed() + gpu->xidPeriod;
+    return NVML_SUCCESS;
+}
+
+/* Report the XID of the GPU of the set whose next one is due first,
+ * sleeping until then if it is due within the timeout */
+nvmlReturn_t nvmlEventSetWait(nvmlEventSet_t set, nvmlEventData_t * data,
+                              unsigned int timeoutms)
+{
+    simGpu *next = NULL;
+    double now, wait;
+
+    SIM_CALL("EventSetWait", -1);
+    for (unsigned int i = 0; i < sim.gpuCount; i++) {
+        simGpu *gpu = &sim.gpus[i];
+
+        if (gpu->eventSet != set
+            || !(gpu->registeredEvents & nvmlEventTypeXidCriticalError)
+            || gpu->xidPeriod <= 0.0)
+            continue;
+        if (!next || gpu->nextXid < next->nextXid)
+            next = gpu;
+    }
+    now = elapsed();
+    if (!next || next->nextXid - now > timeoutms / 1000.0) {
+        usleep(timeoutms * 1000);
+        return NVML_ERROR_TIMEOUT;
+    }
+    wait = next->nextXid - now;
+    if (wait > 0.0)
+        usleep(wait * 1e6);
+    next->nextXid += next->xidPeriod;
+    memset(data, 0, sizeof(*data));
+    data->device = (nvmlDevice_t) next;
+    data->eventType = nvmlEventTypeXidCriticalError;
+    data->eventData = next->xid;
+    return NVML_SUCCESS;
+}
@@ -1,4 +1,9 @@
 #include <dlfcn.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <nvml.h>
 
@@ -50,11 +55,324 @@ typedef struct nvmlInterface {
      nvmlReturn_t(*getVgpuCompatibility) (nvmlVgpuMetadata_t *,
                                           nvmlVgpuPgpuMetadata_t *,
                                           nvmlVgpuPgpuCompatibility_t *);
+     nvmlReturn_t(*vgpuInstanceGetFbUsage) (nvmlVgpuInstance_t,
+                                            unsigned long long *);
+     nvmlReturn_t(*vgpuInstanceGetFrameRateLimit) (nvmlVgpuInstance_t,
+                                                   unsigned int *);
+     nvmlReturn_t(*deviceGetVgpuUtilization) (nvmlDevice_t,
+                                              unsigned long long,
+                                              nvmlValueType_t *,
+                                              unsigned int *,
+                                              nvmlVgpuInstanceUtilizationSample_t
+                                              *);
+     nvmlReturn_t(*deviceGetClockInfo) (nvmlDevice_t, nvmlClockType_t,
+                                        unsigned int *);
+     nvmlReturn_t(*deviceGetPcieThroughput) (nvmlDevice_t,
+                                             nvmlPcieUtilCounter_t,
+                                             unsigned int *);
+     nvmlReturn_t(*deviceGetEncoderUtilization) (nvmlDevice_t,
+                                                 unsigned int *,
+                                                 unsigned int *);
+     nvmlReturn_t(*deviceGetDecoderUtilization) (nvmlDevice_t,
+                                                 unsigned int *,
+                                                 unsigned int *);
+     nvmlReturn_t(*deviceGetTotalEccErrors) (nvmlDevice_t,
+                                             nvmlMemoryErrorType_t,
+                                             nvmlEccCounterType_t,
+                                             unsigned long long *);
+     nvmlReturn_t(*deviceGetTotalEnergyConsumption) (nvmlDevice_t,
+                                                     unsigned long long *);
+     nvmlReturn_t(*eventSetCreate) (nvmlEventSet_t *);
+     nvmlReturn_t(*eventSetFree) (nvmlEventSet_t);
+     nvmlReturn_t(*eventSetWait) (nvmlEventSet_t, nvmlEventData_t *,
+                                  unsigned int);
+     nvmlReturn_t(*deviceGetSupportedEventTypes) (nvmlDevice_t,
+                                                  unsigned long long *);
+     nvmlReturn_t(*deviceRegisterEvents) (nvmlDevice_t, unsigned long long,
+                                          nvmlEventSet_t);
+
+    /* Capabilities whose entry points have been looked up, and those of
+     * them the library provides; see nvml_resolve. */
+    int resolved;
+    int available;
+
+    /* Set by stub_nvml_close, normally with nvml_lock held for writing.
+     * The interface itself is never freed, as other threads may still hold
+     * it after a detach; from then on every call fails as uninitialised. */
+    int closed;
 } nvmlInterface;
 
-CAMLprim value stub_nvml_open(value unit)
+/* NVML calls are made without holding the OCaml runtime lock, so that
+ * other threads (such as the RPC server) keep running while the driver is
+ * busy. Between nvml_enter and nvml_leave no OCaml value may be accessed:
+ * arguments have to be copied out before and results stored after.
+ *
+ * nvml_lock is held for reading by every call in flight; shutting the
+ * library down or closing it takes it for writing so that it never happens
+ * underneath a concurrent call. NVML_CALL checks under the lock that the
+ * interface has not been closed since.
+ *
+ * A call hung in the driver keeps the lock for reading indefinitely, so
+ * shutting down and closing wait for it at most NVML_EXCLUSIVE_TIMEOUT
+ * seconds: gpumon must still be able to detach and stop in that case. */
+static pthread_rwlock_t nvml_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define NVML_EXCLUSIVE_TIMEOUT 5
+
+static void nvml_enter(void)
 {
-    CAMLparam1(unit);
+    caml_enter_blocking_section();
+    pthread_rwlock_rdlock(&nvml_lock);
+}
+
+static void nvml_leave(void)
+{
+    pthread_rwlock_unlock(&nvml_lock);
+    caml_leave_blocking_section();
+}
+
+/* Release the runtime lock and take nvml_lock for writing. Returns 0 if
+ * the calls in flight did not all return in time, in which case nvml_lock
+ * is not held and caml_leave_blocking_section must be called instead of
+ * nvml_leave. */
+static int nvml_enter_exclusive(void)
+{
+    struct timespec deadline;
+
+    caml_enter_blocking_section();
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += NVML_EXCLUSIVE_TIMEOUT;
+    return pthread_rwlock_timedwrlock(&nvml_lock, &deadline) == 0;
+}
+
+/* NVML entry points, for the statistics kept on each. These must be kept
+ * in sync with Nvml.Stats.entry_points. */
+enum {
+    NVML_FN_INIT,
+    NVML_FN_SHUTDOWN,
+    NVML_FN_DEVICE_GET_COUNT,
+    NVML_FN_DEVICE_GET_HANDLE_BY_INDEX,
+    NVML_FN_DEVICE_GET_HANDLE_BY_PCI_BUS_ID,
+    NVML_FN_DEVICE_GET_MEMORY_INFO,
+    NVML_FN_DEVICE_GET_PCI_INFO,
+    NVML_FN_DEVICE_GET_TEMPERATURE,
+    NVML_FN_DEVICE_GET_POWER_USAGE,
+    NVML_FN_DEVICE_GET_UTILIZATION_RATES,
+    NVML_FN_DEVICE_SET_PERSISTENCE_MODE,
+    NVML_FN_DEVICE_GET_VGPU_METADATA,
+    NVML_FN_VGPU_INSTANCE_GET_METADATA,
+    NVML_FN_DEVICE_GET_ACTIVE_VGPUS,
+    NVML_FN_VGPU_INSTANCE_GET_VM_ID,
+    NVML_FN_VGPU_INSTANCE_GET_UUID,
+    NVML_FN_GET_VGPU_COMPATIBILITY,
+    NVML_FN_VGPU_INSTANCE_GET_FB_USAGE,
+    NVML_FN_VGPU_INSTANCE_GET_FRAME_RATE_LIMIT,
+    NVML_FN_DEVICE_GET_VGPU_UTILIZATION,
+    NVML_FN_DEVICE_GET_CLOCK_INFO,
+    NVML_FN_DEVICE_GET_PCIE_THROUGHPUT,
+    NVML_FN_DEVICE_GET_ENCODER_UTILIZATION,
+    NVML_FN_DEVICE_GET_DECODER_UTILIZATION,
+    NVML_FN_DEVICE_GET_TOTAL_ECC_ERRORS,
+    NVML_FN_DEVICE_GET_TOTAL_ENERGY_CONSUMPTION,
+    NVML_FN_EVENT_SET_CREATE,
+    NVML_FN_EVENT_SET_FREE,
+    NVML_FN_EVENT_SET_WAIT,
+    NVML_FN_DEVICE_GET_SUPPORTED_EVENT_TYPES,
+    NVML_FN_DEVICE_REGISTER_EVENTS,
+    NVML_FN_COUNT
+};
+
+/* Statistics of each entry point: calls, failed calls, total latency in
+ * microseconds and a histogram of latencies, where bucket 0 counts calls
+ * under 1us and bucket i those from 2^(i-1) up to 2^i us; the last bucket
+ * has no upper bound. Layout shared with Nvml.Stats. */
+enum {
+    NVML_STAT_CALLS,
+    NVML_STAT_ERRORS,
+    NVML_STAT_TOTAL_US,
+    NVML_STAT_BUCKETS,
+    NVML_STAT_BUCKET_COUNT = 16,
+    NVML_STAT_FIELDS = NVML_STAT_BUCKETS + NVML_STAT_BUCKET_COUNT
+};
+
+/* Updated outside the runtime lock by concurrent calls, hence atomically;
+ * readers may see the fields of one entry point slightly out of step. */
+static unsigned long nvml_stats[NVML_FN_COUNT][NVML_STAT_FIELDS];
+
+static void
+nvml_record(int fn, nvmlReturn_t error, const struct timespec *start)
+{
+    struct timespec end;
+    unsigned long us;
+    int bucket = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    us = (end.tv_sec - start->tv_sec) * 1000000UL
+        + (end.tv_nsec - start->tv_nsec) / 1000;
+    while (bucket < NVML_STAT_BUCKET_COUNT - 1 && (us >> bucket) > 0)
+        bucket++;
+
+    __atomic_fetch_add(&nvml_stats[fn][NVML_STAT_CALLS], 1,
+                       __ATOMIC_RELAXED);
+    if (error != NVML_SUCCESS)
+        __atomic_fetch_add(&nvml_stats[fn][NVML_STAT_ERRORS], 1,
+                           __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nvml_stats[fn][NVML_STAT_TOTAL_US], us,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nvml_stats[fn][NVML_STAT_BUCKETS + bucket], 1,
+                       __ATOMIC_RELAXED);
+}
+
+/* Assign the result of an NVML call to result, recording it against entry
+ * point fn. Must be used between nvml_enter and nvml_leave: the call is not
+ * made once the library has been closed. */
+#define NVML_CALL(interface, fn, result, call) \
+    do { \
+        struct timespec start_; \
+        if (__atomic_load_n(&(interface)->closed, __ATOMIC_ACQUIRE)) { \
+            (result) = NVML_ERROR_UNINITIALIZED; \
+            break; \
+        } \
+        clock_gettime(CLOCK_MONOTONIC, &start_); \
+        (result) = (call); \
+        nvml_record((fn), (result), &start_); \
+    } while (0)
+
+/* Only the entry points needed to find devices are looked up when the
+ * library is opened. The others are grouped into capabilities, looked up
+ * the first time a capability is asked for, so that a driver lacking some
+ * of them still provides the rest and nothing is resolved that the
+ * configuration does not use. These must be kept in sync with
+ * Nvml.Capability. */
+enum {
+    CAP_MEMORY_INFO,
+    CAP_TEMPERATURE,
+    CAP_POWER_USAGE,
+    CAP_UTILIZATION_RATES,
+    CAP_PERSISTENCE_MODE,
+    CAP_VGPU_METADATA,
+    CAP_VGPU_INSTANCES,
+    CAP_VGPU_SAMPLE,
+    CAP_VGPU_UTILIZATION,
+    CAP_CLOCK_INFO,
+    CAP_PCIE_THROUGHPUT,
+    CAP_ENCODER_UTILIZATION,
+    CAP_DECODER_UTILIZATION,
+    CAP_TOTAL_ECC_ERRORS,
+    CAP_TOTAL_ENERGY_CONSUMPTION,
+    CAP_EVENTS,
+    CAP_COUNT
+};
+
+#define CAP_BIT(cap) (1 << (cap))
+
+#define CAP_MAX_SYMBOLS 5
+
+#define SYMBOL(name, field) {STR(name), offsetof(nvmlInterface, field)}
+
+/* The entry points of each capability, all of which must be present */
+static const struct {
+    const char *name;
+    size_t offset;
+} capability_symbols[CAP_COUNT][CAP_MAX_SYMBOLS] = {
+    [CAP_MEMORY_INFO] = {
+        SYMBOL(nvmlDeviceGetMemoryInfo, deviceGetMemoryInfo)},
+    [CAP_TEMPERATURE] = {
+        SYMBOL(nvmlDeviceGetTemperature, deviceGetTemperature)},
+    [CAP_POWER_USAGE] = {
+        SYMBOL(nvmlDeviceGetPowerUsage, deviceGetPowerUsage)},
+    [CAP_UTILIZATION_RATES] = {
+        SYMBOL(nvmlDeviceGetUtilizationRates, deviceGetUtilizationRates)},
+    [CAP_PERSISTENCE_MODE] = {
+        SYMBOL(nvmlDeviceSetPersistenceMode, deviceSetPersistenceMode)},
+    [CAP_VGPU_METADATA] = {
+        SYMBOL(nvmlDeviceGetVgpuMetadata, deviceGetVgpuMetadata),
+        SYMBOL(nvmlVgpuInstanceGetMetadata, vgpuInstanceGetMetadata),
+        SYMBOL(nvmlGetVgpuCompatibility, getVgpuCompatibility)},
+    [CAP_VGPU_INSTANCES] = {
+        SYMBOL(nvmlDeviceGetActiveVgpus, deviceGetActiveVgpus),
+        SYMBOL(nvmlVgpuInstanceGetVmID, vgpuInstanceGetVmID),
+        SYMBOL(nvmlVgpuInstanceGetUUID, vgpuInstanceGetUUID)},
+    [CAP_VGPU_SAMPLE] = {
+        SYMBOL(nvmlVgpuInstanceGetFbUsage, vgpuInstanceGetFbUsage),
+        SYMBOL(nvmlVgpuInstanceGetFrameRateLimit,
+               vgpuInstanceGetFrameRateLimit)},
+    [CAP_VGPU_UTILIZATION] = {
+        SYMBOL(nvmlDeviceGetVgpuUtilization, deviceGetVgpuUtilization)},
+    [CAP_CLOCK_INFO] = {
+        SYMBOL(nvmlDeviceGetClockInfo, deviceGetClockInfo)},
+    [CAP_PCIE_THROUGHPUT] = {
+        SYMBOL(nvmlDeviceGetPcieThroughput, deviceGetPcieThroughput)},
+    [CAP_ENCODER_UTILIZATION] = {
+        SYMBOL(nvmlDeviceGetEncoderUtilization,
+               deviceGetEncoderUtilization)},
+    [CAP_DECODER_UTILIZATION] = {
+        SYMBOL(nvmlDeviceGetDecoderUtilization,
+               deviceGetDecoderUtilization)},
+    [CAP_TOTAL_ECC_ERRORS] = {
+        SYMBOL(nvmlDeviceGetTotalEccErrors, deviceGetTotalEccErrors)},
+    [CAP_TOTAL_ENERGY_CONSUMPTION] = {
+        SYMBOL(nvmlDeviceGetTotalEnergyConsumption,
+               deviceGetTotalEnergyConsumption)},
+    [CAP_EVENTS] = {
+        SYMBOL(nvmlEventSetCreate, eventSetCreate),
+        SYMBOL(nvmlEventSetFree, eventSetFree),
+        SYMBOL(nvmlEventSetWait, eventSetWait),
+        SYMBOL(nvmlDeviceGetSupportedEventTypes,
+               deviceGetSupportedEventTypes),
+        SYMBOL(nvmlDeviceRegisterEvents, deviceRegisterEvents)},
+};
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Look up the entry points of the capabilities in caps that have not been
+ * looked up yet, and return those of caps the library provides. Once a
+ * capability is resolved this is a single atomic load, so it may be
+ * called on every sample. Does not touch the OCaml heap. */
+static int nvml_resolve(nvmlInterface * interface, int caps)
+{
+    int resolved = __atomic_load_n(&interface->resolved, __ATOMIC_ACQUIRE);
+
+    if (caps & ~resolved) {
+        pthread_mutex_lock(&resolve_lock);
+        /* stub_nvml_close sets closed under resolve_lock before dlclose */
+        if (interface->closed) {
+            pthread_mutex_unlock(&resolve_lock);
+            return caps & resolved
+                & __atomic_load_n(&interface->available, __ATOMIC_RELAXED);
+        }
+        resolved = interface->resolved;
+        for (int cap = 0; cap < CAP_COUNT; cap++) {
+            int found = 1;
+
+            if (!(caps & ~resolved & CAP_BIT(cap)))
+                continue;
+            for (int i = 0; i < CAP_MAX_SYMBOLS; i++) {
+                const char *name = capability_symbols[cap][i].name;
+                void *symbol;
+
+                if (!name)
+                    break;
+                symbol = dlsym(interface->handle, name);
+                *(void **) ((char *) interface +
+                            capability_symbols[cap][i].offset) = symbol;
+                found = found && symbol;
+            }
+            if (found)
+                __atomic_fetch_or(&interface->available, CAP_BIT(cap),
+                                  __ATOMIC_RELAXED);
+            resolved |= CAP_BIT(cap);
+        }
+        /* Publishes the entry points stored above */
+        __atomic_store_n(&interface->resolved, resolved, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&resolve_lock);
+    }
+    return caps & __atomic_load_n(&interface->available, __ATOMIC_RELAXED);
+}
+
+CAMLprim value stub_nvml_open(value ml_path)
+{
+    CAMLparam1(ml_path);
     CAMLlocal1(ml_interface);
 
     nvmlInterface *interface;
@@ -65,7 +383,7 @@ CAMLprim value stub_nvml_open(value unit)
         caml_failwith("malloc failed in stub_nvml_open()");
 
     // Open the library.
-    interface->handle = dlopen("libnvidia-ml.so.1", RTLD_LAZY);
+    interface->handle = dlopen(String_val(ml_path), RTLD_LAZY);
     if (!interface->handle) {
         free(interface);
         exn = caml_named_value("Library_not_loaded");
@@ -109,79 +427,16 @@ CAMLprim value stub_nvml_open(value unit)
     if (!interface->deviceGetHandleByPciBusId) {
         goto SymbolError;
     }
-    // Load nvmlDeviceGetMemoryInfo.
-    interface->deviceGetMemoryInfo =
-        dlsym(interface->handle, STR(nvmlDeviceGetMemoryInfo));
-    if (!interface->deviceGetMemoryInfo) {
-        goto SymbolError;
-    }
     // Load nvmlDeviceGetPciInfo.
     interface->deviceGetPciInfo =
         dlsym(interface->handle, STR(nvmlDeviceGetPciInfo));
     if (!interface->deviceGetPciInfo) {
         goto SymbolError;
     }
-    // Load nvmlDeviceGetTemperature.
-    interface->deviceGetTemperature =
-        dlsym(interface->handle, STR(nvmlDeviceGetTemperature));
-    if (!interface->deviceGetTemperature) {
-        goto SymbolError;
-    }
-    // Load nvmlDeviceGetPowerUsage.
-    interface->deviceGetPowerUsage =
-        dlsym(interface->handle, STR(nvmlDeviceGetPowerUsage));
-    if (!interface->deviceGetPowerUsage) {
-        goto SymbolError;
-    }
-    // Load nvmlDeviceGetUtilizationRates.
-    interface->deviceGetUtilizationRates =
-        dlsym(interface->handle, STR(nvmlDeviceGetUtilizationRates));
-    if (!interface->deviceGetUtilizationRates) {
-        goto SymbolError;
-    }
-    // Load nvmlDeviceSetPersistenceMode.
-    interface->deviceSetPersistenceMode =
-        dlsym(interface->handle, STR(nvmlDeviceSetPersistenceMode));
-    if (!interface->deviceSetPersistenceMode) {
-        goto SymbolError;
-    }
-    // Load nvmlDeviceGetVgpuMetadata.
-    interface->deviceGetVgpuMetadata =
-        dlsym(interface->handle, STR(nvmlDeviceGetVgpuMetadata));
-    if (!interface->deviceGetVgpuMetadata) {
-        goto SymbolError;
-    }
-    // Load nvmlVgpuInstanceGetMetadata.
-    interface->vgpuInstanceGetMetadata =
-        dlsym(interface->handle, STR(nvmlVgpuInstanceGetMetadata));
-    if (!interface->vgpuInstanceGetMetadata) {
-        goto SymbolError;
-    }
-    // Load nvmlDeviceGetActiveVgpus.
-    interface->deviceGetActiveVgpus =
-        dlsym(interface->handle, STR(nvmlDeviceGetActiveVgpus));
-    if (!interface->deviceGetActiveVgpus) {
-        goto SymbolError;
-    }
-    // Load nvmlVgpuInstanceGetVmID.
-    interface->vgpuInstanceGetVmID =
-        dlsym(interface->handle, STR(nvmlVgpuInstanceGetVmID));
-    if (!interface->vgpuInstanceGetVmID) {
-        goto SymbolError;
-    }
-    // Load nvmlVgpuInstanceGetUUID.
-    interface->vgpuInstanceGetUUID =
-        dlsym(interface->handle, STR(nvmlVgpuInstanceGetUUID));
-    if (!interface->vgpuInstanceGetUUID) {
-        goto SymbolError;
-    }
-    // Load nvmlGetVgpuCompatibility.
-    interface->getVgpuCompatibility =
-        dlsym(interface->handle, STR(nvmlGetVgpuCompatibility));
-    if (!interface->getVgpuCompatibility) {
-        goto SymbolError;
-    }
-
+    // Everything else is looked up on first use by nvml_resolve.
+    interface->resolved = 0;
+    interface->available = 0;
+    interface->closed = 0;
 
     ml_interface = (value) interface;
     CAMLreturn(ml_interface);
@@ -202,17 +457,97 @@ CAMLprim value stub_nvml_close(value ml_interface)
     nvmlInterface *interface;
 
     interface = (nvmlInterface *) ml_interface;
-    dlclose((void *) (interface->handle));
-    free(interface);
+    if (nvml_enter_exclusive()) {
+        pthread_mutex_lock(&resolve_lock);
+        interface->closed = 1;
+        pthread_mutex_unlock(&resolve_lock);
+        dlclose((void *) (interface->handle));
+        nvml_leave();
+    } else {
+        /* A call is still in the library: stop any more from being made,
+         * but leave it loaded underneath the one in flight. */
+        pthread_mutex_lock(&resolve_lock);
+        __atomic_store_n(&interface->closed, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&resolve_lock);
+        caml_leave_blocking_section();
+    }
 
     CAMLreturn(Val_unit);
 }
 
+/* The return codes from NVML_ERROR_UNINITIALIZED to ML_ERROR_LAST are the
+ * constant constructors of Nvml.Error.t, in order; any other code becomes
+ * Unknown of the code. */
+#define ML_ERROR_LAST NVML_ERROR_VGPU_ECC_NOT_SUPPORTED
+
+static value ml_error_of_return(nvmlReturn_t error)
+{
+    CAMLparam0();
+    CAMLlocal1(ml_error);
+
+    if (error >= NVML_ERROR_UNINITIALIZED && error <= ML_ERROR_LAST) {
+        ml_error = Val_int(error - NVML_ERROR_UNINITIALIZED);
+    } else {
+        ml_error = caml_alloc(1, 0);
+        Store_field(ml_error, 0, Val_int(error));
+    }
+    CAMLreturn(ml_error);
+}
+
+/* Copy NVML's description of error into buf, unless the library has been
+ * closed. The copy is made under nvml_lock, as the description lives in
+ * the library. */
+static void
+nvml_error_string(nvmlInterface * interface, nvmlReturn_t error,
+                  char *buf, size_t size)
+{
+    pthread_rwlock_rdlock(&nvml_lock);
+    if (interface->closed)
+        snprintf(buf, size, "NVML library closed (error %d)", error);
+    else
+        snprintf(buf, size, "%s", interface->errorString(error));
+    pthread_rwlock_unlock(&nvml_lock);
+}
+
+/* Raise Nvml.Error with the return code and NVML's description of it. */
 void check_error(nvmlInterface * interface, nvmlReturn_t error)
 {
+    CAMLparam0();
+    CAMLlocalN(args, 2);
+    const value *exn;
+    char message[256];
+
     if (NVML_SUCCESS != error) {
-        caml_failwith(interface->errorString(error));
+        nvml_error_string(interface, error, message, sizeof(message));
+        exn = caml_named_value("Nvml_error");
+        if (!exn)
+            caml_failwith(message);
+        args[0] = ml_error_of_return(error);
+        args[1] = caml_copy_string(message);
+        caml_raise_with_args(*exn, 2, args);
     }
+    CAMLreturn0;
+}
+
+/* Fail as NVML would, but without calling it, if the library lacks
+ * capability cap or has been closed. */
+static void nvml_require(nvmlInterface * interface, int cap)
+{
+    if (!nvml_resolve(interface, CAP_BIT(cap)))
+        check_error(interface,
+                    __atomic_load_n(&interface->closed, __ATOMIC_ACQUIRE)
+                    ? NVML_ERROR_UNINITIALIZED
+                    : NVML_ERROR_FUNCTION_NOT_FOUND);
+}
+
+/* The capabilities of ml_mask that the library provides, looking up their
+ * entry points if this has not been done yet. */
+CAMLprim value stub_nvml_capabilities(value ml_interface, value ml_mask)
+{
+    CAMLparam2(ml_interface, ml_mask);
+    nvmlInterface *interface = (nvmlInterface *) ml_interface;
+
+    CAMLreturn(Val_int(nvml_resolve(interface, Int_val(ml_mask))));
 }
 
 CAMLprim value stub_nvml_init(value ml_interface)
@@ -222,7 +557,9 @@ CAMLprim value stub_nvml_init(value ml_interface)
     nvmlInterface *interface;
 
     interface = (nvmlInterface *) ml_interface;
-    error = interface->init();
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_INIT, error, interface->init());
+    nvml_leave();
     check_error(interface, error);
 
     CAMLreturn(Val_unit);
@@ -235,7 +572,15 @@ CAMLprim value stub_nvml_shutdown(value ml_interface)
     nvmlInterface *interface;
 
     interface = (nvmlInterface *) ml_interface;
-    error = interface->shutdown();
+    if (nvml_enter_exclusive()) {
+        NVML_CALL(interface, NVML_FN_SHUTDOWN, error,
+                  interface->shutdown());
+        nvml_leave();
+    } else {
+        /* Shutting down underneath a hung call is not safe */
+        error = NVML_ERROR_TIMEOUT;
+        caml_leave_blocking_section();
+    }
     check_error(interface, error);
 
     CAMLreturn(Val_unit);
@@ -249,7 +594,10 @@ CAMLprim value stub_nvml_device_get_count(value ml_interface)
     unsigned int count;
 
     interface = (nvmlInterface *) ml_interface;
-    error = interface->deviceGetCount(&count);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_COUNT, error,
+              interface->deviceGetCount(&count));
+    nvml_leave();
     check_error(interface, error);
 
     CAMLreturn(Val_int(count));
@@ -268,7 +616,10 @@ stub_nvml_device_get_handle_by_index(value ml_interface, value ml_index)
 
     interface = (nvmlInterface *) ml_interface;
     index = Int_val(ml_index);
-    error = interface->deviceGetHandleByIndex(index, &device);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_HANDLE_BY_INDEX, error,
+              interface->deviceGetHandleByIndex(index, &device));
+    nvml_leave();
     check_error(interface, error);
 
     unsigned int deviceSize = sizeof(nvmlDevice_t);
@@ -287,12 +638,18 @@ stub_nvml_device_get_handle_by_pci_bus_id(value ml_interface,
 
     nvmlReturn_t error;
     nvmlInterface *interface;
-    const char *pciBusId;
+    char pciBusId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
     nvmlDevice_t device;
 
     interface = (nvmlInterface *) ml_interface;
-    pciBusId = String_val(ml_pci_bus_id);
-    error = interface->deviceGetHandleByPciBusId(pciBusId, &device);
+    if (caml_string_length(ml_pci_bus_id) >= sizeof(pciBusId)) {
+        check_error(interface, NVML_ERROR_INVALID_ARGUMENT);
+    }
+    strcpy(pciBusId, String_val(ml_pci_bus_id));
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_HANDLE_BY_PCI_BUS_ID, error,
+              interface->deviceGetHandleByPciBusId(pciBusId, &device));
+    nvml_leave();
     check_error(interface, error);
 
     unsigned int deviceSize = sizeof(nvmlDevice_t);
@@ -313,8 +670,12 @@ stub_nvml_device_get_memory_info(value ml_interface, value ml_device)
     nvmlDevice_t device;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_MEMORY_INFO);
     device = *(nvmlDevice_t *) ml_device;
-    error = interface->deviceGetMemoryInfo(device, &memory_info);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_MEMORY_INFO, error,
+              interface->deviceGetMemoryInfo(device, &memory_info));
+    nvml_leave();
     check_error(interface, error);
 
     ml_memory_info = caml_alloc(3, 0);
@@ -337,7 +698,10 @@ stub_nvml_device_get_pci_info(value ml_interface, value ml_device)
 
     interface = (nvmlInterface *) ml_interface;
     device = *(nvmlDevice_t *) ml_device;
-    error = interface->deviceGetPciInfo(device, &pci_info);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_PCI_INFO, error,
+              interface->deviceGetPciInfo(device, &pci_info));
+    nvml_leave();
     check_error(interface, error);
 
     ml_pci_info = caml_alloc(6, 0);
@@ -361,9 +725,13 @@ stub_nvml_device_get_temperature(value ml_interface, value ml_device)
     nvmlDevice_t device;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_TEMPERATURE);
     device = *(nvmlDevice_t *) ml_device;
-    error = interface->deviceGetTemperature(device, NVML_TEMPERATURE_GPU,
-                                            &temp);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_TEMPERATURE, error,
+              interface->deviceGetTemperature(device, NVML_TEMPERATURE_GPU,
+                                              &temp));
+    nvml_leave();
     check_error(interface, error);
 
     CAMLreturn(Val_int(temp));
@@ -379,8 +747,12 @@ stub_nvml_device_get_power_usage(value ml_interface, value ml_device)
     unsigned int power_usage;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_POWER_USAGE);
     device = *(nvmlDevice_t *) ml_device;
-    error = interface->deviceGetPowerUsage(device, &power_usage);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_POWER_USAGE, error,
+              interface->deviceGetPowerUsage(device, &power_usage));
+    nvml_leave();
     check_error(interface, error);
 
     CAMLreturn(Val_int(power_usage));
@@ -397,8 +769,12 @@ stub_nvml_device_get_utilization_rates(value ml_interface, value ml_device)
     nvmlUtilization_t utilization;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_UTILIZATION_RATES);
     device = *(nvmlDevice_t *) ml_device;
-    error = interface->deviceGetUtilizationRates(device, &utilization);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_UTILIZATION_RATES, error,
+              interface->deviceGetUtilizationRates(device, &utilization));
+    nvml_leave();
     check_error(interface, error);
 
     ml_utilization = caml_alloc(2, 0);
@@ -408,6 +784,348 @@ stub_nvml_device_get_utilization_rates(value ml_interface, value ml_device)
     CAMLreturn(ml_utilization);
 }
 
+CAMLprim value stub_nvml_call_count(value unit)
+{
+    CAMLparam1(unit);
+    unsigned long calls = 0;
+
+    for (int fn = 0; fn < NVML_FN_COUNT; fn++) {
+        calls += __atomic_load_n(&nvml_stats[fn][NVML_STAT_CALLS],
+                                 __ATOMIC_RELAXED);
+    }
+    CAMLreturn(Val_long(calls));
+}
+
+/* Copy the statistics of all entry points into an int array of at least
+ * NVML_FN_COUNT * NVML_STAT_FIELDS elements, entry point after entry
+ * point. */
+CAMLprim value stub_nvml_stats_read(value ml_stats)
+{
+    CAMLparam1(ml_stats);
+
+    if (caml_array_length(ml_stats) < NVML_FN_COUNT * NVML_STAT_FIELDS) {
+        caml_invalid_argument("stub_nvml_stats_read");
+    }
+    for (int fn = 0; fn < NVML_FN_COUNT; fn++) {
+        for (int i = 0; i < NVML_STAT_FIELDS; i++) {
+            Field(ml_stats, fn * NVML_STAT_FIELDS + i) =
+                Val_long(__atomic_load_n(&nvml_stats[fn][i],
+                                         __ATOMIC_RELAXED));
+        }
+    }
+    CAMLreturn(Val_unit);
+}
+
+/* Slots of the buffers filled by stub_nvml_device_sample. These must be
+ * kept in sync with Nvml.Metric. */
+enum {
+    METRIC_MEMORY_FREE,
+    METRIC_MEMORY_USED,
+    METRIC_TEMPERATURE,
+    METRIC_POWER_USAGE,
+    METRIC_UTILISATION_COMPUTE,
+    METRIC_UTILISATION_MEMORY_IO,
+    METRIC_CLOCK_SM,
+    METRIC_CLOCK_MEMORY,
+    METRIC_PCIE_TX,
+    METRIC_PCIE_RX,
+    METRIC_UTILISATION_ENCODER,
+    METRIC_UTILISATION_DECODER,
+    METRIC_ECC_CORRECTED,
+    METRIC_ECC_UNCORRECTED,
+    METRIC_ENERGY,
+    METRIC_COUNT
+};
+
+#define METRIC_BIT(metric) (1 << (metric))
+
+/* Readers of the sample_calls table. Each makes one NVML call for the
+ * metrics in mask and stores their values only if it succeeds. */
+typedef nvmlReturn_t(*metric_reader) (nvmlInterface *, nvmlDevice_t, int,
+                                      double *);
+
+static nvmlReturn_t
+read_memory_info(nvmlInterface * interface, nvmlDevice_t device, int mask,
+                 double *values)
+{
+    nvmlMemory_t memory_info;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetMemoryInfo(device, &memory_info);
+    if (error == NVML_SUCCESS) {
+        values[METRIC_MEMORY_FREE] = (double) memory_info.free;
+        values[METRIC_MEMORY_USED] = (double) memory_info.used;
+    }
+    return error;
+}
+
+static nvmlReturn_t
+read_temperature(nvmlInterface * interface, nvmlDevice_t device, int mask,
+                 double *values)
+{
+    unsigned int temp;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetTemperature(device, NVML_TEMPERATURE_GPU,
+                                            &temp);
+    if (error == NVML_SUCCESS)
+        values[METRIC_TEMPERATURE] = (double) temp;
+    return error;
+}
+
+static nvmlReturn_t
+read_power_usage(nvmlInterface * interface, nvmlDevice_t device, int mask,
+                 double *values)
+{
+    unsigned int power_usage;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetPowerUsage(device, &power_usage);
+    if (error == NVML_SUCCESS)
+        values[METRIC_POWER_USAGE] = (double) power_usage;
+    return error;
+}
+
+static nvmlReturn_t
+read_utilization_rates(nvmlInterface * interface, nvmlDevice_t device,
+                       int mask, double *values)
+{
+    nvmlUtilization_t utilization;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetUtilizationRates(device, &utilization);
+    if (error == NVML_SUCCESS) {
+        values[METRIC_UTILISATION_COMPUTE] = (double) utilization.gpu;
+        values[METRIC_UTILISATION_MEMORY_IO] = (double) utilization.memory;
+    }
+    return error;
+}
+
+/* The SM and memory clocks are separate queries of the same function; both
+ * have to succeed for the call to count as successful. */
+static nvmlReturn_t
+read_clock_info(nvmlInterface * interface, nvmlDevice_t device, int mask,
+                double *values)
+{
+    unsigned int sm = 0, memory = 0;
+    nvmlReturn_t error = NVML_SUCCESS;
+
+    if (mask & METRIC_BIT(METRIC_CLOCK_SM))
+        error = interface->deviceGetClockInfo(device, NVML_CLOCK_SM, &sm);
+    if (error == NVML_SUCCESS && (mask & METRIC_BIT(METRIC_CLOCK_MEMORY)))
+        error = interface->deviceGetClockInfo(device, NVML_CLOCK_MEM,
+                                              &memory);
+    if (error == NVML_SUCCESS) {
+        values[METRIC_CLOCK_SM] = (double) sm;
+        values[METRIC_CLOCK_MEMORY] = (double) memory;
+    }
+    return error;
+}
+
+/* NVML reports PCIe throughput in KB/s */
+static nvmlReturn_t
+read_pcie_throughput(nvmlInterface * interface, nvmlDevice_t device,
+                     int mask, double *values)
+{
+    unsigned int tx = 0, rx = 0;
+    nvmlReturn_t error = NVML_SUCCESS;
+
+    if (mask & METRIC_BIT(METRIC_PCIE_TX))
+        error = interface->deviceGetPcieThroughput(device,
+                                                   NVML_PCIE_UTIL_TX_BYTES,
+                                                   &tx);
+    if (error == NVML_SUCCESS && (mask & METRIC_BIT(METRIC_PCIE_RX)))
+        error = interface->deviceGetPcieThroughput(device,
+                                                   NVML_PCIE_UTIL_RX_BYTES,
+                                                   &rx);
+    if (error == NVML_SUCCESS) {
+        values[METRIC_PCIE_TX] = (double) tx * 1024.0;
+        values[METRIC_PCIE_RX] = (double) rx * 1024.0;
+    }
+    return error;
+}
+
+static nvmlReturn_t
+read_encoder_utilization(nvmlInterface * interface, nvmlDevice_t device,
+                         int mask, double *values)
+{
+    unsigned int utilization, period_us;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetEncoderUtilization(device, &utilization,
+                                                   &period_us);
+    if (error == NVML_SUCCESS)
+        values[METRIC_UTILISATION_ENCODER] = (double) utilization;
+    return error;
+}
+
+static nvmlReturn_t
+read_decoder_utilization(nvmlInterface * interface, nvmlDevice_t device,
+                         int mask, double *values)
+{
+    unsigned int utilization, period_us;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetDecoderUtilization(device, &utilization,
+                                                   &period_us);
+    if (error == NVML_SUCCESS)
+        values[METRIC_UTILISATION_DECODER] = (double) utilization;
+    return error;
+}
+
+/* Volatile counts, i.e. since the driver was last loaded */
+static nvmlReturn_t
+read_total_ecc_errors(nvmlInterface * interface, nvmlDevice_t device,
+                      int mask, double *values)
+{
+    unsigned long long corrected = 0, uncorrected = 0;
+    nvmlReturn_t error = NVML_SUCCESS;
+
+    if (mask & METRIC_BIT(METRIC_ECC_CORRECTED))
+        error = interface->deviceGetTotalEccErrors(device,
+                                                   NVML_MEMORY_ERROR_TYPE_CORRECTED,
+                                                   NVML_VOLATILE_ECC,
+                                                   &corrected);
+    if (error == NVML_SUCCESS
+        && (mask & METRIC_BIT(METRIC_ECC_UNCORRECTED)))
+        error = interface->deviceGetTotalEccErrors(device,
+                                                   NVML_MEMORY_ERROR_TYPE_UNCORRECTED,
+                                                   NVML_VOLATILE_ECC,
+                                                   &uncorrected);
+    if (error == NVML_SUCCESS) {
+        values[METRIC_ECC_CORRECTED] = (double) corrected;
+        values[METRIC_ECC_UNCORRECTED] = (double) uncorrected;
+    }
+    return error;
+}
+
+static nvmlReturn_t
+read_total_energy_consumption(nvmlInterface * interface,
+                              nvmlDevice_t device, int mask, double *values)
+{
+    unsigned long long energy;
+    nvmlReturn_t error;
+
+    error = interface->deviceGetTotalEnergyConsumption(device, &energy);
+    if (error == NVML_SUCCESS)
+        values[METRIC_ENERGY] = (double) energy;
+    return error;
+}
+
+/* The NVML calls made to sample a device, with the metrics each provides.
+ * This mirrors the call field of the entries of Gpumon_metric.registry. */
+static const struct {
+    int fn;
+    int cap;
+    int metrics;
+    metric_reader read;
+} sample_calls[] = {
+    {NVML_FN_DEVICE_GET_MEMORY_INFO, CAP_MEMORY_INFO,
+     METRIC_BIT(METRIC_MEMORY_FREE) | METRIC_BIT(METRIC_MEMORY_USED),
+     read_memory_info},
+    {NVML_FN_DEVICE_GET_TEMPERATURE, CAP_TEMPERATURE,
+     METRIC_BIT(METRIC_TEMPERATURE),
+     read_temperature},
+    {NVML_FN_DEVICE_GET_POWER_USAGE, CAP_POWER_USAGE,
+     METRIC_BIT(METRIC_POWER_USAGE),
+     read_power_usage},
+    {NVML_FN_DEVICE_GET_UTILIZATION_RATES, CAP_UTILIZATION_RATES,
+     METRIC_BIT(METRIC_UTILISATION_COMPUTE)
+     | METRIC_BIT(METRIC_UTILISATION_MEMORY_IO),
+     read_utilization_rates},
+    {NVML_FN_DEVICE_GET_CLOCK_INFO, CAP_CLOCK_INFO,
+     METRIC_BIT(METRIC_CLOCK_SM) | METRIC_BIT(METRIC_CLOCK_MEMORY),
+     read_clock_info},
+    {NVML_FN_DEVICE_GET_PCIE_THROUGHPUT, CAP_PCIE_THROUGHPUT,
+     METRIC_BIT(METRIC_PCIE_TX) | METRIC_BIT(METRIC_PCIE_RX),
+     read_pcie_throughput},
+    {NVML_FN_DEVICE_GET_ENCODER_UTILIZATION, CAP_ENCODER_UTILIZATION,
+     METRIC_BIT(METRIC_UTILISATION_ENCODER),
+     read_encoder_utilization},
+    {NVML_FN_DEVICE_GET_DECODER_UTILIZATION, CAP_DECODER_UTILIZATION,
+     METRIC_BIT(METRIC_UTILISATION_DECODER),
+     read_decoder_utilization},
+    {NVML_FN_DEVICE_GET_TOTAL_ECC_ERRORS, CAP_TOTAL_ECC_ERRORS,
+     METRIC_BIT(METRIC_ECC_CORRECTED) | METRIC_BIT(METRIC_ECC_UNCORRECTED),
+     read_total_ecc_errors},
+    {NVML_FN_DEVICE_GET_TOTAL_ENERGY_CONSUMPTION, CAP_TOTAL_ENERGY_CONSUMPTION,
+     METRIC_BIT(METRIC_ENERGY),
+     read_total_energy_consumption},
+};
+
+#define SAMPLE_CALL_COUNT (sizeof(sample_calls) / sizeof(sample_calls[0]))
+
+/* Read every metric in mask, making each NVML call at most once. The
+ * status of the call a metric depends on is recorded for each metric, so
+ * a failing call only affects the metrics it provides; the call is not
+ * made at all if the library lacks it. Must be called
+ * between nvml_enter and nvml_leave. */
+static void
+sample_device(nvmlInterface * interface, nvmlDevice_t device, int mask,
+              double *values, nvmlReturn_t * status)
+{
+    nvmlReturn_t error;
+
+    for (size_t i = 0; i < SAMPLE_CALL_COUNT; i++) {
+        int metrics = sample_calls[i].metrics & mask;
+
+        if (!metrics)
+            continue;
+        if (nvml_resolve(interface, CAP_BIT(sample_calls[i].cap)))
+            NVML_CALL(interface, sample_calls[i].fn, error,
+                      sample_calls[i].read(interface, device, metrics,
+                                           values));
+        else
+            error = NVML_ERROR_FUNCTION_NOT_FOUND;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            if (metrics & METRIC_BIT(m))
+                status[m] = error;
+        }
+    }
+}
+
+/* Sample all metrics selected by ml_mask into the caller's buffers:
+ * ml_values is a float array and ml_status an int array, both with at
+ * least METRIC_COUNT elements. Slots not selected by the mask are left
+ * untouched, as is the value of a metric whose NVML call failed. Nothing
+ * is allocated on the OCaml heap and NVML errors are reported through
+ * ml_status rather than raised. */
+CAMLprim value
+stub_nvml_device_sample(value ml_interface, value ml_device,
+                        value ml_mask, value ml_values, value ml_status)
+{
+    CAMLparam5(ml_interface, ml_device, ml_mask, ml_values, ml_status);
+    nvmlInterface *interface;
+    nvmlDevice_t device;
+    int mask;
+    double values[METRIC_COUNT];
+    nvmlReturn_t status[METRIC_COUNT];
+
+    if (caml_array_length(ml_values) < METRIC_COUNT
+        || caml_array_length(ml_status) < METRIC_COUNT) {
+        caml_invalid_argument("stub_nvml_device_sample");
+    }
+
+    interface = (nvmlInterface *) ml_interface;
+    device = *(nvmlDevice_t *) ml_device;
+    mask = Int_val(ml_mask);
+
+    nvml_enter();
+    sample_device(interface, device, mask, values, status);
+    nvml_leave();
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (mask & METRIC_BIT(i)) {
+            if (status[i] == NVML_SUCCESS) {
+                Store_double_field(ml_values, i, values[i]);
+            }
+            Field(ml_status, i) = Val_int(status[i]);
+        }
+    }
+
+    CAMLreturn(Val_unit);
+}
+
 CAMLprim value
 stub_nvml_device_set_persistence_mode(value ml_interface,
                                       value ml_device, value ml_mode)
@@ -419,9 +1137,13 @@ stub_nvml_device_set_persistence_mode(value ml_interface,
     nvmlEnableState_t mode;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_PERSISTENCE_MODE);
     device = *(nvmlDevice_t *) ml_device;
     mode = (nvmlEnableState_t) (Int_val(ml_mode));
-    error = interface->deviceSetPersistenceMode(device, mode);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_SET_PERSISTENCE_MODE, error,
+              interface->deviceSetPersistenceMode(device, mode));
+    nvml_leave();
     check_error(interface, error);
 
     CAMLreturn(Val_unit);
@@ -440,10 +1162,14 @@ stub_nvml_device_get_pgpu_metadata(value ml_interface, value ml_device)
     nvmlVgpuPgpuMetadata_t *metadata = NULL;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_METADATA);
     device = *(nvmlDevice_t *) ml_device;
 
-    error =
-        interface->deviceGetVgpuMetadata(device, metadata, &metadataSize);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_VGPU_METADATA, error,
+              interface->deviceGetVgpuMetadata(device, metadata,
+                                               &metadataSize));
+    nvml_leave();
     if (error == NVML_SUCCESS) {
         check_error(interface, NVML_ERROR_MEMORY);      /* should not happen */
     }
@@ -454,8 +1180,11 @@ stub_nvml_device_get_pgpu_metadata(value ml_interface, value ml_device)
     if (!metadata) {
         check_error(interface, NVML_ERROR_MEMORY);
     }
-    error =
-        interface->deviceGetVgpuMetadata(device, metadata, &metadataSize);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_VGPU_METADATA, error,
+              interface->deviceGetVgpuMetadata(device, metadata,
+                                               &metadataSize));
+    nvml_leave();
     if (error != NVML_SUCCESS) {
         free(metadata);
         check_error(interface, error);
@@ -480,10 +1209,14 @@ stub_nvml_get_vgpu_metadata(value ml_interface, value ml_vgpu_instance)
     nvmlVgpuMetadata_t *metadata = NULL;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_METADATA);
     vgpu = (nvmlVgpuInstance_t) (Int_val(ml_vgpu_instance));
 
-    error =
-        interface->vgpuInstanceGetMetadata(vgpu, metadata, &metadataSize);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_METADATA, error,
+              interface->vgpuInstanceGetMetadata(vgpu, metadata,
+                                                 &metadataSize));
+    nvml_leave();
     if (error == NVML_SUCCESS) {
         check_error(interface, NVML_ERROR_MEMORY);      /* should not happen */
     }
@@ -494,8 +1227,11 @@ stub_nvml_get_vgpu_metadata(value ml_interface, value ml_vgpu_instance)
     if (!metadata) {
         check_error(interface, NVML_ERROR_MEMORY);
     }
-    error =
-        interface->vgpuInstanceGetMetadata(vgpu, metadata, &metadataSize);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_METADATA, error,
+              interface->vgpuInstanceGetMetadata(vgpu, metadata,
+                                                 &metadataSize));
+    nvml_leave();
     if (error != NVML_SUCCESS) {
         free(metadata);
         check_error(interface, error);
@@ -553,11 +1289,15 @@ stub_nvml_device_get_active_vgpus(value ml_interface, value ml_device)
     nvmlVgpuInstance_t *vgpuInstances = NULL;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_INSTANCES);
     device = *(nvmlDevice_t *) ml_device;
     list = Val_emptylist;
 
-    error =
-        interface->deviceGetActiveVgpus(device, &vgpuCount, vgpuInstances);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_ACTIVE_VGPUS, error,
+              interface->deviceGetActiveVgpus(device, &vgpuCount,
+                                              vgpuInstances));
+    nvml_leave();
     if (error == NVML_SUCCESS) {
         CAMLreturn(list);       /* no active vGPU */
     }
@@ -569,8 +1309,11 @@ stub_nvml_device_get_active_vgpus(value ml_interface, value ml_device)
     if (!vgpuInstances) {
         check_error(interface, NVML_ERROR_MEMORY);
     }
-    error =
-        interface->deviceGetActiveVgpus(device, &vgpuCount, vgpuInstances);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_ACTIVE_VGPUS, error,
+              interface->deviceGetActiveVgpus(device, &vgpuCount,
+                                              vgpuInstances));
+    nvml_leave();
     if (error != NVML_SUCCESS) {
         free(vgpuInstances);
         check_error(interface, error);
@@ -603,6 +1346,7 @@ stub_nvml_vgpu_instance_get_vm_id(value ml_interface,
     nvmlVgpuVmIdType_t *vmIdType;
 
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_INSTANCES);
     vgpuInstance = (nvmlVgpuInstance_t) Int_val(ml_vgpu_instance);
 
     vmIdType = (nvmlVgpuVmIdType_t *) malloc(sizeof(nvmlVgpuVmIdType_t));
@@ -610,8 +1354,11 @@ stub_nvml_vgpu_instance_get_vm_id(value ml_interface,
         check_error(interface, NVML_ERROR_MEMORY);
     }
 
-    error = interface->vgpuInstanceGetVmID(vgpuInstance, vmID, 80,
-                                           vmIdType);
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_VM_ID, error,
+              interface->vgpuInstanceGetVmID(vgpuInstance, vmID, 80,
+                                             vmIdType));
+    nvml_leave();
     if (error != NVML_SUCCESS) {
         free(vmIdType);
         check_error(interface, error);
@@ -624,6 +1371,168 @@ stub_nvml_vgpu_instance_get_vm_id(value ml_interface,
     CAMLreturn(ml_vm_id);
 }
 
+/* Slots of the buffers filled by stub_nvml_vgpu_instance_sample. These
+ * must be kept in sync with Nvml.Vgpu_metric. */
+enum {
+    VGPU_METRIC_FB_USAGE,
+    VGPU_METRIC_FRAME_RATE_LIMIT,
+    VGPU_METRIC_COUNT
+};
+
+/* Like stub_nvml_device_sample, but for the per-instance readings of a
+ * vGPU. Both metrics are always read. */
+CAMLprim value
+stub_nvml_vgpu_instance_sample(value ml_interface, value ml_vgpu_instance,
+                               value ml_values, value ml_status)
+{
+    CAMLparam4(ml_interface, ml_vgpu_instance, ml_values, ml_status);
+    nvmlInterface *interface;
+    nvmlVgpuInstance_t vgpuInstance;
+    unsigned long long fbUsage;
+    unsigned int frameRateLimit;
+    nvmlReturn_t fbStatus, frameRateStatus;
+
+    if (caml_array_length(ml_values) < VGPU_METRIC_COUNT
+        || caml_array_length(ml_status) < VGPU_METRIC_COUNT) {
+        caml_invalid_argument("stub_nvml_vgpu_instance_sample");
+    }
+
+    interface = (nvmlInterface *) ml_interface;
+    vgpuInstance = (nvmlVgpuInstance_t) Int_val(ml_vgpu_instance);
+
+    if (nvml_resolve(interface, CAP_BIT(CAP_VGPU_SAMPLE))) {
+        nvml_enter();
+        NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_FB_USAGE, fbStatus,
+                  interface->vgpuInstanceGetFbUsage(vgpuInstance, &fbUsage));
+        NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_FRAME_RATE_LIMIT,
+                  frameRateStatus,
+                  interface->vgpuInstanceGetFrameRateLimit(vgpuInstance,
+                                                           &frameRateLimit));
+        nvml_leave();
+    } else {
+        fbStatus = frameRateStatus = NVML_ERROR_FUNCTION_NOT_FOUND;
+    }
+
+    if (fbStatus == NVML_SUCCESS) {
+        Store_double_field(ml_values, VGPU_METRIC_FB_USAGE,
+                           (double) fbUsage);
+    }
+    Field(ml_status, VGPU_METRIC_FB_USAGE) = Val_int(fbStatus);
+    if (frameRateStatus == NVML_SUCCESS) {
+        Store_double_field(ml_values, VGPU_METRIC_FRAME_RATE_LIMIT,
+                           (double) frameRateLimit);
+    }
+    Field(ml_status, VGPU_METRIC_FRAME_RATE_LIMIT) = Val_int(frameRateStatus);
+
+    CAMLreturn(Val_unit);
+}
+
+static double value_to_double(nvmlValueType_t type, nvmlValue_t value)
+{
+    switch (type) {
+    case NVML_VALUE_TYPE_DOUBLE:
+        return value.dVal;
+    case NVML_VALUE_TYPE_UNSIGNED_INT:
+        return (double) value.uiVal;
+    case NVML_VALUE_TYPE_UNSIGNED_LONG:
+        return (double) value.ulVal;
+    case NVML_VALUE_TYPE_UNSIGNED_LONG_LONG:
+        return (double) value.ullVal;
+    case NVML_VALUE_TYPE_SIGNED_LONG_LONG:
+        return (double) value.sllVal;
+    default:
+        return 0.0;
+    }
+}
+
+/* Fields per sample in the float array filled by
+ * stub_nvml_device_get_vgpu_utilization. These must be kept in sync with
+ * Nvml.vgpu_utilization. */
+enum {
+    VGPU_UTIL_TIMESTAMP,
+    VGPU_UTIL_SM,
+    VGPU_UTIL_MEMORY,
+    VGPU_UTIL_ENCODER,
+    VGPU_UTIL_DECODER,
+    VGPU_UTIL_FIELDS
+};
+
+/* Fetch the vGPU utilisation samples taken after ml_last_seen (a
+ * timestamp in microseconds, as a float) into the caller's buffers:
+ * sample i is for instance ml_instances[i] and occupies VGPU_UTIL_FIELDS
+ * consecutive slots of ml_samples. Returns the number of samples, or
+ * minus the number of samples available if the buffers are too small. */
+CAMLprim value
+stub_nvml_device_get_vgpu_utilization(value ml_interface, value ml_device,
+                                      value ml_last_seen,
+                                      value ml_instances, value ml_samples)
+{
+    CAMLparam5(ml_interface, ml_device, ml_last_seen, ml_instances,
+               ml_samples);
+    nvmlReturn_t error;
+    nvmlInterface *interface;
+    nvmlDevice_t device;
+    unsigned long long lastSeen;
+    nvmlValueType_t type;
+    unsigned int capacity, count;
+    nvmlVgpuInstanceUtilizationSample_t *samples;
+
+    interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_UTILIZATION);
+    device = *(nvmlDevice_t *) ml_device;
+    lastSeen = (unsigned long long) Double_val(ml_last_seen);
+    capacity = caml_array_length(ml_instances);
+    if (caml_array_length(ml_samples) < capacity * VGPU_UTIL_FIELDS) {
+        caml_invalid_argument("stub_nvml_device_get_vgpu_utilization");
+    }
+
+    samples = (nvmlVgpuInstanceUtilizationSample_t *)
+        malloc(sizeof(nvmlVgpuInstanceUtilizationSample_t) *
+               (capacity ? capacity : 1));
+    if (!samples) {
+        check_error(interface, NVML_ERROR_MEMORY);
+    }
+
+    count = capacity;
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_VGPU_UTILIZATION, error,
+              interface->deviceGetVgpuUtilization(device, lastSeen, &type,
+                                                  &count, samples));
+    nvml_leave();
+
+    if (error == NVML_ERROR_INSUFFICIENT_SIZE) {
+        free(samples);
+        CAMLreturn(Val_int(-(int) count));
+    }
+    if (error != NVML_SUCCESS) {
+        free(samples);
+        /* No sample has been taken since lastSeen */
+        if (error == NVML_ERROR_NOT_FOUND) {
+            CAMLreturn(Val_int(0));
+        }
+        check_error(interface, error);
+    }
+
+    for (unsigned int i = 0; i < count && i < capacity; i++) {
+        mlsize_t base = i * VGPU_UTIL_FIELDS;
+
+        Field(ml_instances, i) = Val_int(samples[i].vgpuInstance);
+        Store_double_field(ml_samples, base + VGPU_UTIL_TIMESTAMP,
+                           (double) samples[i].timeStamp);
+        Store_double_field(ml_samples, base + VGPU_UTIL_SM,
+                           value_to_double(type, samples[i].smUtil));
+        Store_double_field(ml_samples, base + VGPU_UTIL_MEMORY,
+                           value_to_double(type, samples[i].memUtil));
+        Store_double_field(ml_samples, base + VGPU_UTIL_ENCODER,
+                           value_to_double(type, samples[i].encUtil));
+        Store_double_field(ml_samples, base + VGPU_UTIL_DECODER,
+                           value_to_double(type, samples[i].decUtil));
+    }
+    free(samples);
+
+    CAMLreturn(Val_int(count < capacity ? count : capacity));
+}
+
 CAMLprim value
 stub_nvml_vgpu_instance_get_vgpu_uuid(value ml_interface,
                                       value ml_vgpu_instance)
@@ -639,13 +1548,14 @@ stub_nvml_vgpu_instance_get_vgpu_uuid(value ml_interface,
     // The VGPU UUID is returned as a string,
     // not exceeding 80 characters in length (including the NUL terminator).
     interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_VGPU_INSTANCES);
     vgpuInstance = (nvmlVgpuInstance_t) Int_val(ml_vgpu_instance);
 
-    error = interface->vgpuInstanceGetUUID(vgpuInstance, uuid, 80);
-    if (error != NVML_SUCCESS) {
-        caml_failwith("Failed to obtain UUID.");
-        check_error(interface, error);
-    }
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_VGPU_INSTANCE_GET_UUID, error,
+              interface->vgpuInstanceGetUUID(vgpuInstance, uuid, 80));
+    nvml_leave();
+    check_error(interface, error);
 
     ml_vgpu_uuid = caml_copy_string(uuid);
 
@@ -666,12 +1576,31 @@ stub_nvml_get_pgpu_vgpu_compatibility(value ml_interface,
     nvmlVgpuPgpuCompatibility_t vgpuCompatibility;
 
     interface = (nvmlInterface *) ml_interface;
-    vgpuMetadata = (nvmlVgpuMetadata_t *) ml_vgpu_metadata;
-    pgpuMetadata = (nvmlVgpuPgpuMetadata_t *) ml_pgpu_metadata;
-
-    error = interface->getVgpuCompatibility(vgpuMetadata,
-                                            pgpuMetadata,
-                                            &vgpuCompatibility);
+    nvml_require(interface, CAP_VGPU_METADATA);
+
+    /* The metadata blobs live on the OCaml heap, which may be compacted
+     * while the runtime lock is released, so work on copies. */
+    vgpuMetadata = (nvmlVgpuMetadata_t *)
+        malloc(caml_string_length(ml_vgpu_metadata));
+    pgpuMetadata = (nvmlVgpuPgpuMetadata_t *)
+        malloc(caml_string_length(ml_pgpu_metadata));
+    if (!vgpuMetadata || !pgpuMetadata) {
+        free(vgpuMetadata);
+        free(pgpuMetadata);
+        check_error(interface, NVML_ERROR_MEMORY);
+    }
+    memcpy(vgpuMetadata, String_val(ml_vgpu_metadata),
+           caml_string_length(ml_vgpu_metadata));
+    memcpy(pgpuMetadata, String_val(ml_pgpu_metadata),
+           caml_string_length(ml_pgpu_metadata));
+
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_GET_VGPU_COMPATIBILITY, error,
+              interface->getVgpuCompatibility(vgpuMetadata, pgpuMetadata,
+                                              &vgpuCompatibility));
+    nvml_leave();
+    free(vgpuMetadata);
+    free(pgpuMetadata);
     check_error(interface, error);
 
     size_t compatSize = sizeof(nvmlVgpuPgpuCompatibility_t);
@@ -774,3 +1703,152 @@ CAMLprim value stub_vgpu_compat_get_pgpu_compat_limit(value ml_vgpu_compat)
 
     CAMLreturn(tail);
 }
+
+/* An NVML event set together with the devices registered in it, so that
+ * an event can be attributed to the device's position in that list. */
+#define EVENT_SET_MAX_DEVICES 64
+
+typedef struct {
+    nvmlEventSet_t set;
+    unsigned int count;
+    nvmlDevice_t devices[EVENT_SET_MAX_DEVICES];
+} eventSet;
+
+CAMLprim value stub_nvml_event_set_create(value ml_interface)
+{
+    CAMLparam1(ml_interface);
+    nvmlReturn_t error;
+    nvmlInterface *interface;
+    eventSet *events;
+
+    interface = (nvmlInterface *) ml_interface;
+    nvml_require(interface, CAP_EVENTS);
+    events = malloc(sizeof(eventSet));
+    if (!events)
+        check_error(interface, NVML_ERROR_MEMORY);
+    events->count = 0;
+
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_EVENT_SET_CREATE, error,
+              interface->eventSetCreate(&events->set));
+    nvml_leave();
+    if (error != NVML_SUCCESS) {
+        free(events);
+        check_error(interface, error);
+    }
+
+    CAMLreturn((value) events);
+}
+
+CAMLprim value stub_nvml_event_set_free(value ml_interface, value ml_events)
+{
+    CAMLparam2(ml_interface, ml_events);
+    nvmlReturn_t error;
+    nvmlInterface *interface;
+    eventSet *events;
+
+    interface = (nvmlInterface *) ml_interface;
+    events = (eventSet *) ml_events;
+    nvml_require(interface, CAP_EVENTS);
+
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_EVENT_SET_FREE, error,
+              interface->eventSetFree(events->set));
+    nvml_leave();
+    free(events);
+    check_error(interface, error);
+
+    CAMLreturn(Val_unit);
+}
+
+/* Register the events of ml_mask the device supports and return the
+ * device's position in the set, which stub_nvml_event_set_wait reports
+ * with each of its events. */
+CAMLprim value
+stub_nvml_device_register_events(value ml_interface, value ml_events,
+                                 value ml_device, value ml_mask)
+{
+    CAMLparam4(ml_interface, ml_events, ml_device, ml_mask);
+    nvmlReturn_t error;
+    nvmlInterface *interface;
+    eventSet *events;
+    nvmlDevice_t device;
+    unsigned long long supported = 0;
+
+    interface = (nvmlInterface *) ml_interface;
+    events = (eventSet *) ml_events;
+    device = *(nvmlDevice_t *) ml_device;
+    nvml_require(interface, CAP_EVENTS);
+    if (events->count >= EVENT_SET_MAX_DEVICES)
+        check_error(interface, NVML_ERROR_INSUFFICIENT_SIZE);
+
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_DEVICE_GET_SUPPORTED_EVENT_TYPES, error,
+              interface->deviceGetSupportedEventTypes(device, &supported));
+    supported &= (unsigned long long) Long_val(ml_mask);
+    if (error == NVML_SUCCESS && !supported)
+        error = NVML_ERROR_NOT_SUPPORTED;
+    if (error == NVML_SUCCESS)
+        NVML_CALL(interface, NVML_FN_DEVICE_REGISTER_EVENTS, error,
+                  interface->deviceRegisterEvents(device, supported,
+                                                  events->set));
+    nvml_leave();
+    check_error(interface, error);
+
+    events->devices[events->count] = device;
+    CAMLreturn(Val_int(events->count++));
+}
+
+/* Layout of the buffer filled by stub_nvml_event_set_wait. These must be
+ * kept in sync with Nvml.Event. */
+enum {
+    EVENT_FIELD_DEVICE,
+    EVENT_FIELD_TYPE,
+    EVENT_FIELD_DATA,
+    EVENT_FIELD_COUNT
+};
+
+/* Wait up to ml_timeout milliseconds for an event and store it into the
+ * int array ml_event. Returns false if none arrived in time. The wait
+ * holds nvml_lock for reading, so detaching the library waits for it to
+ * end: keep the timeout short. */
+CAMLprim value
+stub_nvml_event_set_wait(value ml_interface, value ml_events,
+                         value ml_timeout, value ml_event)
+{
+    CAMLparam4(ml_interface, ml_events, ml_timeout, ml_event);
+    nvmlReturn_t error;
+    nvmlInterface *interface;
+    eventSet *events;
+    nvmlEventData_t data;
+    unsigned int timeout;
+    int device = -1;
+
+    if (caml_array_length(ml_event) < EVENT_FIELD_COUNT)
+        caml_invalid_argument("stub_nvml_event_set_wait");
+
+    interface = (nvmlInterface *) ml_interface;
+    events = (eventSet *) ml_events;
+    timeout = Int_val(ml_timeout);
+    nvml_require(interface, CAP_EVENTS);
+
+    nvml_enter();
+    NVML_CALL(interface, NVML_FN_EVENT_SET_WAIT, error,
+              interface->eventSetWait(events->set, &data, timeout));
+    nvml_leave();
+    if (error == NVML_ERROR_TIMEOUT)
+        CAMLreturn(Val_false);
+    check_error(interface, error);
+
+    for (unsigned int i = 0; i < events->count; i++) {
+        if (events->devices[i] == data.device) {
+            device = i;
+            break;
+        }
+    }
+    Field(ml_event, EVENT_FIELD_DEVICE) = Val_int(device);
+    Field(ml_event, EVENT_FIELD_TYPE) = Val_long((long) data.eventType);
+    Field(ml_event, EVENT_FIELD_DATA) = Val_long((long) data.eventData);
+
+    CAMLreturn(Val_true);
+}
@@ -0,0 +1,40 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <caml/memory.h>
+#include <caml/mlvalues.h>
+#include <caml/signals.h>
+
+/* Longest sysfs attribute read; the values read are short numbers. */
+#define SYSFS_READ_MAX 64
+
+/* Read up to len bytes of the file open as ml_fd from its start into
+ * ml_buf, which need not stay put while the runtime lock is released.
+ * Returns the number of bytes read, or minus errno. Reading a sysfs
+ * attribute from offset 0 makes the kernel produce its current value, so
+ * the file can stay open from one sample to the next. */
+CAMLprim value stub_gpumon_pread(value ml_fd, value ml_buf, value ml_len)
+{
+    CAMLparam3(ml_fd, ml_buf, ml_len);
+    char buf[SYSFS_READ_MAX];
+    int fd = Int_val(ml_fd);
+    size_t len = Int_val(ml_len);
+    ssize_t n;
+
+    if (len > SYSFS_READ_MAX)
+        len = SYSFS_READ_MAX;
+    if (len > caml_string_length(ml_buf))
+        len = caml_string_length(ml_buf);
+
+    caml_enter_blocking_section();
+    n = pread(fd, buf, len, 0);
+    if (n < 0)
+        n = -errno;
+    caml_leave_blocking_section();
+
+    if (n > 0)
+        memcpy(Bytes_val(ml_buf), buf, n);
+
+    CAMLreturn(Val_long(n));
+}
@@ -0,0 +1,50 @@
+open OUnit
+
+(* A cache on its own generation counter, and a compute function counting
+   how often it runs *)
+let setup ?capacity () =
+  let generation = ref 0 in
+  let cache =
+    Gpumon_cache.create ?capacity ~generation:(fun () -> !generation) "test"
+  in
+  let computed = ref 0 in
+  let compute v () = incr computed ; v in
+  (generation, cache, computed, compute)
+
+let test_generation () =
+  let generation, cache, computed, compute = setup () in
+  assert_equal 1 (Gpumon_cache.find_or_add cache "a" (compute 1)) ;
+  assert_equal 1 (Gpumon_cache.find_or_add cache "a" (compute 2)) ;
+  assert_equal ~printer:string_of_int 1 !computed ;
+  incr generation ;
+  assert_equal 3 (Gpumon_cache.find_or_add cache "a" (compute 3)) ;
+  assert_equal ~printer:string_of_int 2 !computed ;
+  assert_equal ~printer:string_of_int 1 (Gpumon_cache.hits cache) ;
+  assert_equal ~printer:string_of_int 2 (Gpumon_cache.misses cache)
+
+let test_capacity () =
+  let _, cache, computed, compute = setup ~capacity:2 () in
+  List.iter
+    (fun k -> ignore (Gpumon_cache.find_or_add cache k (compute k)))
+    [1; 2; 1; 2] ;
+  assert_equal ~printer:string_of_int 2 !computed ;
+  (* Adding a third entry empties the cache first *)
+  ignore (Gpumon_cache.find_or_add cache 3 (compute 3)) ;
+  ignore (Gpumon_cache.find_or_add cache 1 (compute 1)) ;
+  assert_equal ~printer:string_of_int 4 !computed
+
+let test_failure () =
+  let _, cache, computed, compute = setup () in
+  assert_raises Exit (fun () ->
+      Gpumon_cache.find_or_add cache "a" (fun () -> raise Exit)
+  ) ;
+  assert_equal 1 (Gpumon_cache.find_or_add cache "a" (compute 1)) ;
+  assert_equal ~printer:string_of_int 1 !computed
+
+let test =
+  "test_cache"
+  >::: [
+         "test_generation" >:: test_generation
+       ; "test_capacity" >:: test_capacity
+       ; "test_failure" >:: test_failure
+       ]
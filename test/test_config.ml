@@ -26,28 +26,30 @@ let default_config =
           device_id= 0x0ff2l
         ; subsystem_device_id= Any
         ; metrics=
-            [
-              Memory Free
-            ; Memory Used
-            ; Other Temperature
-            ; Other PowerUsage
-            ; Utilisation Compute
-            ; Utilisation MemoryIO
-            ]
+            Gpumon_metric.
+              [
+                memory_free
+              ; memory_used
+              ; temperature
+              ; power_usage
+              ; compute
+              ; memory_io
+              ]
         }
       ; (* GRID K2 *)
         {
           device_id= 0x11bfl
         ; subsystem_device_id= Any
         ; metrics=
-            [
-              Memory Free
-            ; Memory Used
-            ; Other Temperature
-            ; Other PowerUsage
-            ; Utilisation Compute
-            ; Utilisation MemoryIO
-            ]
+            Gpumon_metric.
+              [
+                memory_free
+              ; memory_used
+              ; temperature
+              ; power_usage
+              ; compute
+              ; memory_io
+              ]
         }
       ]
   }
@@ -62,28 +64,30 @@ let default_with_match_config =
           device_id= 0x0ff2l
         ; subsystem_device_id= Match 0x1012l
         ; metrics=
-            [
-              Memory Free
-            ; Memory Used
-            ; Other Temperature
-            ; Other PowerUsage
-            ; Utilisation Compute
-            ; Utilisation MemoryIO
-            ]
+            Gpumon_metric.
+              [
+                memory_free
+              ; memory_used
+              ; temperature
+              ; power_usage
+              ; compute
+              ; memory_io
+              ]
         }
       ; (* GRID K2 *)
         {
           device_id= 0x11bfl
         ; subsystem_device_id= Match 0x100al
         ; metrics=
-            [
-              Memory Free
-            ; Memory Used
-            ; Other Temperature
-            ; Other PowerUsage
-            ; Utilisation Compute
-            ; Utilisation MemoryIO
-            ]
+            Gpumon_metric.
+              [
+                memory_free
+              ; memory_used
+              ; temperature
+              ; power_usage
+              ; compute
+              ; memory_io
+              ]
         }
       ]
   }
@@ -96,7 +100,7 @@ let subsystem_device_id_config =
         {
           device_id= 0x1234l
         ; subsystem_device_id= Match 0x5687l
-        ; metrics= [Memory Free; Memory Used]
+        ; metrics= Gpumon_metric.[memory_free; memory_used]
         }
       ]
   }
@@ -109,12 +113,12 @@ let v2_mixed_config =
         {
           device_id= 0x1234l
         ; subsystem_device_id= Any
-        ; metrics= [Other Temperature; Other PowerUsage]
+        ; metrics= Gpumon_metric.[temperature; power_usage]
         }
       ; {
           device_id= 0x5678l
         ; subsystem_device_id= Match 0x9abcl
-        ; metrics= [Utilisation Compute; Utilisation MemoryIO]
+        ; metrics= Gpumon_metric.[compute; memory_io]
         }
       ]
   }
@@ -133,6 +137,86 @@ let tests =
   ; ("test_v2_mixed.conf", Ok v2_mixed_config)
   ]
 
+let test_lookup () =
+  let open Gpumon_config in
+  let index =
+    index (List.map string_of_metric)
+      [
+        ( 0x10del
+        , {
+            device_types=
+              v2_mixed_config.device_types
+              @ [
+                  {
+                    device_id= 0x5678l
+                  ; subsystem_device_id= Any
+                  ; metrics= [Gpumon_metric.memory_free]
+                  }
+                ]
+          }
+        )
+      ]
+  in
+  let lookup vendor_id device_id subsystem_device_id =
+    lookup index ~vendor_id ~device_id ~subsystem_device_id
+  in
+  let printer = function
+    | Some metrics ->
+        String.concat "," metrics
+    | None ->
+        "None"
+  in
+  assert_equal ~printer
+    (Some ["temperature"; "powerusage"])
+    (lookup 0x10del 0x1234l 0x1111l) ;
+  assert_equal ~printer
+    (Some ["compute"; "memoryio"])
+    (lookup 0x10del 0x5678l 0x9abcl) ;
+  assert_equal ~printer (Some ["memoryfree"]) (lookup 0x10del 0x5678l 0x1111l) ;
+  assert_equal ~printer None (lookup 0x10del 0x9999l 0x9abcl) ;
+  assert_equal ~printer None (lookup 0x1002l 0x1234l 0x1111l)
+
+let test_watch () =
+  let module Unixext = Xapi_stdext_unix.Unixext in
+  let path = Filename.temp_file "gpumon" ".conf" in
+  let copies = ref 0 in
+  let copy config_file =
+    Filename.concat "data" config_file
+    |> Unixext.string_of_file
+    |> Unixext.write_string_to_file path ;
+    (* Make sure every copy has a distinct mtime *)
+    incr copies ;
+    let mtime = 1000.0 *. float_of_int !copies in
+    Unix.utimes path mtime mtime
+  in
+  let errors = ref 0 in
+  let watch =
+    Gpumon_config.Watch.create ~path
+      ~load:(fun config -> List.length config.Gpumon_config.device_types)
+      ~default:(-1)
+      ~on_error:(fun _ -> incr errors)
+  in
+  let check msg expected_value expected_generation =
+    assert_equal ~msg ~printer:string_of_int expected_value
+      (Gpumon_config.Watch.get watch) ;
+    assert_equal ~msg ~printer:string_of_int expected_generation
+      (Gpumon_config.Watch.generation watch)
+  in
+  Fun.protect
+    ~finally:(fun () -> if Sys.file_exists path then Sys.remove path)
+    (fun () ->
+      copy "test_v2_default.conf" ;
+      check "initial load" 2 1 ;
+      check "unchanged file is not reloaded" 2 1 ;
+      copy "test_v2_with_subsystem_device_id.conf" ;
+      check "changed file is reloaded" 1 2 ;
+      copy "test_unknown_version.conf" ;
+      check "broken file keeps last good config" 1 2 ;
+      assert_equal ~printer:string_of_int 1 !errors ;
+      Sys.remove path ;
+      check "missing file falls back to default" (-1) 3
+    )
+
 let test =
   "test_config"
   >::: List.map
@@ -140,3 +224,4 @@ let test =
            config_file >:: fun () -> test_file config_file expected_result
          )
          tests
+  @ ["test_lookup" >:: test_lookup; "test_watch" >:: test_watch]
@@ -0,0 +1,48 @@
+open OUnit
+
+let make_templates sample n =
+  List.init n (fun slot ->
+      Gpumon_dss.make ~owner:Rrd.Host ~sample ~slot ~value:Gpumon_dss.int64
+        ~name:(Printf.sprintf "test_%d" slot)
+        ~description:"Test datasource" ~units:"B" ()
+  )
+
+let test_values () =
+  let sample = Nvml.make_sample () in
+  let templates = make_templates sample 2 in
+  sample.Nvml.values.(0) <- 42.0 ;
+  sample.Nvml.status.(0) <- 0 ;
+  sample.Nvml.status.(1) <- 3 ;
+  match Gpumon_dss.generate templates [] with
+  | [(Rrd.Host, ds)] ->
+      assert_equal ~printer:(fun x -> x) "test_0" ds.Ds.ds_name ;
+      assert_equal (Rrd.VT_Int64 42L) ds.Ds.ds_value
+  | dss ->
+      assert_failure
+        (Printf.sprintf "expected one datasource, got %d" (List.length dss))
+
+(* Only the values and the list holding the datasources should be
+   allocated on each report. *)
+let words_per_ds_bound = 32.0
+
+let test_allocation () =
+  let sample = Nvml.make_sample () in
+  Array.fill sample.Nvml.status 0 Nvml.Metric.count 0 ;
+  let templates = make_templates sample Nvml.Metric.count in
+  let reports = 1000 in
+  let before = Gc.minor_words () in
+  for i = 1 to reports do
+    sample.Nvml.values.(0) <- float_of_int i ;
+    ignore (Gpumon_dss.generate templates [])
+  done ;
+  let per_ds =
+    (Gc.minor_words () -. before)
+    /. float_of_int (reports * Nvml.Metric.count)
+  in
+  assert_bool
+    (Printf.sprintf "%.1f words allocated per datasource" per_ds)
+    (per_ds < words_per_ds_bound)
+
+let test =
+  "test_dss"
+  >::: ["test_values" >:: test_values; "test_allocation" >:: test_allocation]
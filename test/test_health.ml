@@ -0,0 +1,38 @@
+open OUnit
+
+let test_backoff () =
+  let h = Gpumon_health.create () in
+  let now = 1000.0 in
+  assert_bool "first sample is due" (Gpumon_health.start h now) ;
+  assert_bool "not due while busy" (not (Gpumon_health.start h now)) ;
+  assert_bool "stale while busy" (Gpumon_health.stale h) ;
+  let failures = Gpumon_health.finish h now ~ok:false in
+  assert_equal ~printer:string_of_int 1 failures ;
+  assert_bool "backing off" (not (Gpumon_health.start h (now +. 1.0))) ;
+  assert_bool "stale after a failure" (Gpumon_health.stale h) ;
+  let retry = now +. Gpumon_health.initial_backoff in
+  assert_bool "due after the backoff" (Gpumon_health.start h retry) ;
+  ignore (Gpumon_health.finish h retry ~ok:false) ;
+  assert_bool "backoff doubles"
+    (not (Gpumon_health.start h (retry +. Gpumon_health.initial_backoff))) ;
+  assert_equal ~printer:string_of_float Gpumon_health.max_backoff
+    (Gpumon_health.backoff 100) ;
+  let later = retry +. (2.0 *. Gpumon_health.initial_backoff) in
+  assert_bool "due after the doubled backoff" (Gpumon_health.start h later) ;
+  ignore (Gpumon_health.finish h later ~ok:true) ;
+  assert_bool "fresh after a success" (not (Gpumon_health.stale h)) ;
+  assert_bool "due again" (Gpumon_health.start h later)
+
+let test_overrun () =
+  let h = Gpumon_health.create () in
+  assert_bool "idle device does not overrun" (not (Gpumon_health.overrun h)) ;
+  ignore (Gpumon_health.start h 0.0) ;
+  assert_bool "first overrun is reported" (Gpumon_health.overrun h) ;
+  assert_bool "later ones are not" (not (Gpumon_health.overrun h)) ;
+  Gpumon_health.update h ;
+  assert_equal ~printer:string_of_float 1.0
+    h.Gpumon_health.sample.Nvml.values.(0)
+
+let test =
+  "test_health"
+  >::: ["test_backoff" >:: test_backoff; "test_overrun" >:: test_overrun]
@@ -0,0 +1,57 @@
+open OUnit
+
+let with_file f =
+  let path = Filename.temp_file "gpumon-history" "" in
+  Fun.protect ~finally:(fun () -> Sys.remove path) (fun () -> f path)
+
+let records history =
+  let acc = ref [] in
+  Gpumon_history.iter history (fun r -> acc := r :: !acc) ;
+  List.rev !acc
+
+let append history timestamp =
+  let sample = Nvml.make_sample () in
+  sample.Nvml.values.(Nvml.Metric.temperature) <- timestamp ;
+  sample.Nvml.status.(Nvml.Metric.power_usage) <- 3 ;
+  Gpumon_history.append history ~timestamp
+    ~bus_id:(Gpumon_history.encode_bus_id "0000:0a:1f.7")
+    ~mask:Nvml.Metric.(mask [temperature; power_usage])
+    sample
+
+let timestamps history =
+  List.map (fun r -> r.Gpumon_history.timestamp) (records history)
+
+let printer l = String.concat " " (List.map string_of_float l)
+
+(* The oldest records are overwritten, and the records survive reopening *)
+let test_ring () =
+  with_file @@ fun path ->
+  let history = Gpumon_history.create path ~capacity:3 in
+  List.iter (append history) [1.0; 2.0; 3.0; 4.0] ;
+  assert_equal ~printer [2.0; 3.0; 4.0] (timestamps history) ;
+  let history = Gpumon_history.create path ~capacity:3 in
+  append history 5.0 ;
+  assert_equal ~printer [3.0; 4.0; 5.0]
+    (timestamps (Gpumon_history.open_in path)) ;
+  match records history with
+  | r :: _ ->
+      assert_equal ~printer:Fun.id "0000:0a:1f.7" r.Gpumon_history.bus_id ;
+      let values = r.Gpumon_history.values in
+      assert_equal ~printer:string_of_float 3.0
+        values.(Nvml.Metric.temperature) ;
+      assert_bool "failed reading"
+        (Float.is_nan values.(Nvml.Metric.power_usage)) ;
+      assert_bool "unselected metric"
+        (Float.is_nan values.(Nvml.Metric.memory_free))
+  | [] ->
+      assert_failure "no records"
+
+(* A file of another capacity starts afresh *)
+let test_resize () =
+  with_file @@ fun path ->
+  append (Gpumon_history.create path ~capacity:3) 1.0 ;
+  let history = Gpumon_history.create path ~capacity:4 in
+  assert_equal ~printer [] (timestamps history)
+
+let test =
+  "test_history" >::: ["test_ring" >:: test_ring; "test_resize" >:: test_resize]
@@ -0,0 +1,33 @@
+open OUnit
+
+let gpu bus_id device_id metrics =
+  {
+    Gpumon_inventory_cache.bus_id
+  ; ids=
+      {
+        Gpumon_backend.vendor_id= 0x10del
+      ; device_id
+      ; subsystem_device_id= 0x100al
+      }
+  ; metrics
+  }
+
+let test_round_trip () =
+  let cache =
+    {
+      Gpumon_inventory_cache.pages= 3
+    ; gpus=
+        [
+          gpu "0000:03:00.0" 0x13f2l ["memory_free"; "power_usage"]
+        ; gpu "0000:04:00.0" 0x1db4l []
+        ]
+    }
+  in
+  let s = Gpumon_inventory_cache.to_string cache in
+  assert_equal (Some cache) (Gpumon_inventory_cache.of_string s) ;
+  (* A cache written by another version is not used *)
+  let other = "gpumon-inventory 0" ^ String.sub s 18 (String.length s - 18) in
+  assert_equal None (Gpumon_inventory_cache.of_string other) ;
+  assert_equal None (Gpumon_inventory_cache.of_string "")
+
+let test = "test_inventory_cache" >::: ["test_round_trip" >:: test_round_trip]
@@ -1,5 +1,18 @@
 open OUnit
 
-let base_suite = "base_suite" >::: [Test_config.test]
+let base_suite =
+  "base_suite"
+  >::: [
+         Test_config.test
+       ; Test_ring.test
+       ; Test_cache.test
+       ; Test_dss.test
+       ; Test_health.test
+       ; Test_stats.test
+       ; Test_sysfs.test
+       ; Test_openmetrics.test
+       ; Test_history.test
+       ; Test_inventory_cache.test
+       ]
 
 let () = OUnit2.run_test_tt_main (OUnit.ounit2_of_ounit1 base_suite)
@@ -0,0 +1,37 @@
+open OUnit
+
+let ds ?(ty = Rrd.Gauge) name description value =
+  Ds.ds_make ~name ~description ~value ~ty ~default:false ~units:"" ()
+
+let vgpu vm used =
+  (Rrd.VM vm, ds "vgpu_memory_used_0000:03:00.0" "Memory" (Rrd.VT_Int64 used))
+
+let test_render () =
+  let dss =
+    [
+      vgpu "a" 1L
+    ; ( Rrd.Host
+      , ds ~ty:Rrd.Derive "gpu_xid_errors_0000:03:00.0" "XID errors\nseen"
+          (Rrd.VT_Int64 3L)
+      )
+    ; vgpu "b" 2L
+    ; ( Rrd.Host
+      , ds "gpu_utilisation_compute_0000:03:00.0" "Busy" (Rrd.VT_Float 0.25)
+      )
+    ]
+  in
+  assert_equal ~printer:Fun.id
+    "# TYPE gpu_utilisation_compute_0000_03_00_0 gauge\n\
+     # HELP gpu_utilisation_compute_0000_03_00_0 Busy\n\
+     gpu_utilisation_compute_0000_03_00_0 0.25\n\
+     # TYPE gpu_xid_errors_0000_03_00_0 counter\n\
+     # HELP gpu_xid_errors_0000_03_00_0 XID errors\\nseen\n\
+     gpu_xid_errors_0000_03_00_0_total 3\n\
+     # TYPE vgpu_memory_used_0000_03_00_0 gauge\n\
+     # HELP vgpu_memory_used_0000_03_00_0 Memory\n\
+     vgpu_memory_used_0000_03_00_0{vm=\"a\"} 1\n\
+     vgpu_memory_used_0000_03_00_0{vm=\"b\"} 2\n\
+     # EOF\n"
+    (Gpumon_openmetrics.render dss)
+
+let test = "test_openmetrics" >::: ["test_render" >:: test_render]
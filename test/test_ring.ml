@@ -0,0 +1,55 @@
+open OUnit
+
+let summary ring =
+  let s = Gpumon_ring.make_summary () in
+  assert_bool "ring is not empty" (Gpumon_ring.summarise ring s) ;
+  s
+
+let test_summary () =
+  let ring = Gpumon_ring.create 200 in
+  for i = 100 downto 1 do
+    Gpumon_ring.push ring (float_of_int i)
+  done ;
+  let s = summary ring in
+  let check msg expected actual =
+    assert_equal ~msg ~printer:string_of_float expected actual
+  in
+  check "min" 1.0 s.Gpumon_ring.min ;
+  check "max" 100.0 s.Gpumon_ring.max ;
+  check "mean" 50.5 s.Gpumon_ring.mean ;
+  check "p99" 99.0 s.Gpumon_ring.p99
+
+let test_wrap () =
+  let ring = Gpumon_ring.create 4 in
+  List.iter (Gpumon_ring.push ring) [9.0; 9.0; 1.0; 2.0; 3.0; 4.0] ;
+  assert_equal ~printer:string_of_int 4 (Gpumon_ring.length ring) ;
+  let s = summary ring in
+  assert_equal ~msg:"oldest readings are overwritten"
+    ~printer:string_of_float 4.0 s.Gpumon_ring.max ;
+  Gpumon_ring.clear ring ;
+  assert_bool "cleared ring has no summary"
+    (not (Gpumon_ring.summarise ring (Gpumon_ring.make_summary ())))
+
+(* Many equal readings, in no particular order, as an idle GPU gives *)
+let test_p99_repeated () =
+  let n = 1000 in
+  let ring = Gpumon_ring.create n in
+  let readings = Array.init n (fun i -> float_of_int (i * 7919 mod 13 / 4)) in
+  Array.iter (Gpumon_ring.push ring) readings ;
+  let sorted = Array.copy readings in
+  Array.sort compare sorted ;
+  let s = summary ring in
+  assert_equal ~msg:"p99" ~printer:string_of_float sorted.(989)
+    s.Gpumon_ring.p99 ;
+  assert_equal ~msg:"min" ~printer:string_of_float sorted.(0)
+    s.Gpumon_ring.min ;
+  assert_equal ~msg:"max" ~printer:string_of_float sorted.(n - 1)
+    s.Gpumon_ring.max
+
+let test =
+  "test_ring"
+  >::: [
+         "test_summary" >:: test_summary
+       ; "test_wrap" >:: test_wrap
+       ; "test_p99_repeated" >:: test_p99_repeated
+       ]
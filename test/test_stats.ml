@@ -0,0 +1,35 @@
+open OUnit
+
+let assert_seconds msg expected actual =
+  assert_equal ~msg ~printer:string_of_float
+    ~cmp:(cmp_float ~epsilon:1e-12)
+    expected actual
+
+let test_update () =
+  let series = Gpumon_stats.series "gpumon_test" "Test" in
+  let value i = series.Gpumon_stats.sample.Nvml.values.(i) in
+  let status i = series.Gpumon_stats.sample.Nvml.status.(i) in
+  (* The half microseconds keep the conversion to us from rounding down *)
+  for _ = 1 to 99 do
+    Gpumon_stats.record series ~failed:false 3.5e-6
+  done ;
+  Gpumon_stats.record series ~failed:true 1000.5e-6 ;
+  Gpumon_stats.update series ;
+  assert_equal ~printer:string_of_float 100.0 (value Gpumon_stats.calls) ;
+  assert_equal ~printer:string_of_float 1.0 (value Gpumon_stats.errors) ;
+  assert_seconds "mean" 12.97e-6 (value Gpumon_stats.latency) ;
+  (* 99 of the 100 calls took from 2 up to 4us *)
+  assert_seconds "p99" 4e-6 (value Gpumon_stats.latency_p99) ;
+  (* Only the calls since the last update count *)
+  Gpumon_stats.record series ~failed:false 1000.5e-6 ;
+  Gpumon_stats.record series ~failed:false 1000.5e-6 ;
+  Gpumon_stats.update series ;
+  assert_seconds "mean of the period" 1000e-6 (value Gpumon_stats.latency) ;
+  assert_seconds "p99 of the period" 1024e-6
+    (value Gpumon_stats.latency_p99) ;
+  Gpumon_stats.update series ;
+  assert_equal ~printer:string_of_int 0 (status Gpumon_stats.calls) ;
+  assert_equal ~msg:"no latency without calls" ~printer:string_of_int 1
+    (status Gpumon_stats.latency)
+
+let test = "test_stats" >::: ["test_update" >:: test_update]
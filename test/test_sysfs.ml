@@ -0,0 +1,105 @@
+open OUnit
+
+let with_devices root f =
+  Gpumon_sysfs.root := root ;
+  let devices = Gpumon_sysfs.devices () in
+  Fun.protect
+    ~finally:(fun () -> List.iter Gpumon_sysfs.close devices)
+    (fun () -> f devices)
+
+let sample device =
+  let sample = Nvml.make_sample () in
+  Gpumon_sysfs.sample device (Gpumon_sysfs.capabilities device) sample ;
+  sample
+
+let assert_metric sample metric expected =
+  assert_equal ~printer:string_of_int 0 sample.Nvml.status.(metric) ;
+  assert_equal ~printer:string_of_float ~cmp:(cmp_float ~epsilon:1e-9) expected
+    sample.Nvml.values.(metric)
+
+let fake_tree = "data/sysfs/class/drm"
+
+(* Connectors and NVIDIA GPUs are skipped *)
+let test_discovery () =
+  with_devices fake_tree @@ fun devices ->
+  assert_equal ~printer:(String.concat ", ")
+    ["0000:03:00.0"; "0000:0a:00.0"]
+    (List.map Gpumon_sysfs.bus_id devices)
+
+let test_amd () =
+  with_devices fake_tree @@ function
+  | amd :: _ ->
+      let ids = Gpumon_sysfs.pci_ids amd in
+      assert_equal 0x1002l ids.Gpumon_backend.vendor_id ;
+      assert_equal 0x73bfl ids.Gpumon_backend.device_id ;
+      let s = sample amd in
+      let open Nvml.Metric in
+      assert_metric s temperature 45.0 ;
+      assert_metric s power_usage 35000.0 ;
+      assert_metric s utilisation_compute 37.0 ;
+      assert_metric s utilisation_memory_io 12.0 ;
+      assert_metric s clock_sm 500.0 ;
+      assert_metric s clock_memory 96.0 ;
+      assert_metric s memory_used 1073741824.0 ;
+      assert_metric s memory_free (17163091968.0 -. 1073741824.0) ;
+      assert_bool "no energy counter"
+        (Gpumon_sysfs.capabilities amd land bit energy = 0)
+  | [] ->
+      assert_failure "no GPU found"
+
+let test_intel () =
+  with_devices fake_tree @@ function
+  | [_; intel] ->
+      assert_equal ~printer:string_of_int
+        (Nvml.Metric.bit Nvml.Metric.energy)
+        (Gpumon_sysfs.capabilities intel) ;
+      assert_metric (sample intel) Nvml.Metric.energy 123456.789
+  | _ ->
+      assert_failure "expected two GPUs"
+
+let write path contents =
+  let oc = open_out path in
+  Fun.protect
+    ~finally:(fun () -> close_out oc)
+    (fun () -> output_string oc contents)
+
+(* Attributes stay open and are re-read from the start on every sample *)
+let test_reread () =
+  let root = Filename.temp_file "gpumon-sysfs" "" in
+  Sys.remove root ;
+  let card = Filename.concat root "card0" in
+  let dir = Filename.concat card "device" in
+  List.iter (fun d -> Unix.mkdir d 0o755) [root; card; dir] ;
+  let file name = Filename.concat dir name in
+  write (file "vendor") "0x1002\n" ;
+  write (file "device") "0x73bf\n" ;
+  write (file "uevent") "PCI_SLOT_NAME=0000:03:00.0\n" ;
+  write (file "gpu_busy_percent") "100\n" ;
+  Fun.protect
+    ~finally:(fun () ->
+      List.iter Sys.remove
+        (List.map file ["vendor"; "device"; "uevent"; "gpu_busy_percent"]) ;
+      List.iter Unix.rmdir [dir; card; root]
+    )
+    (fun () ->
+      with_devices root @@ function
+      | [gpu] ->
+          let metric = Nvml.Metric.utilisation_compute in
+          assert_metric (sample gpu) metric 100.0 ;
+          write (file "gpu_busy_percent") "7\n" ;
+          assert_metric (sample gpu) metric 7.0 ;
+          write (file "gpu_busy_percent") "busy\n" ;
+          assert_bool "unparsable value"
+            ((sample gpu).Nvml.status.(metric) <> 0)
+      | _ ->
+          assert_failure "expected one GPU"
+    )
+
+let test =
+  "test_sysfs"
+  >::: [
+         "test_discovery" >:: test_discovery
+       ; "test_amd" >:: test_amd
+       ; "test_intel" >:: test_intel
+       ; "test_reread" >:: test_reread
+       ]
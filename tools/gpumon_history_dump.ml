@@ -0,0 +1,100 @@
+(*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *)
+
+(* Print the records of a gpumon history file within a time window, as CSV
+   or as one JSON object per line. Readings that failed are left out. *)
+
+let file = ref !Gpumon_history.path
+
+let since = ref 0.0
+
+let until = ref infinity
+
+let last = ref 0.0
+
+let bus_id = ref ""
+
+let format = ref "csv"
+
+(* Metric names by Nvml.Metric slot *)
+let names =
+  let names = Array.make Nvml.Metric.count "" in
+  List.iter
+    (fun m -> names.(m.Gpumon_metric.slot) <- m.Gpumon_metric.name)
+    Gpumon_metric.registry ;
+  names
+
+let print_csv_header () =
+  print_string "timestamp,bus_id" ;
+  Array.iter (fun name -> print_string ("," ^ name)) names ;
+  print_char '\n'
+
+let print_csv r =
+  Printf.printf "%.3f,%s" r.Gpumon_history.timestamp r.Gpumon_history.bus_id ;
+  Array.iter
+    (fun x ->
+      if Float.is_nan x then print_char ',' else Printf.printf ",%.15g" x
+    )
+    r.Gpumon_history.values ;
+  print_char '\n'
+
+let print_json r =
+  Printf.printf "{\"timestamp\": %.3f, \"bus_id\": \"%s\""
+    r.Gpumon_history.timestamp r.Gpumon_history.bus_id ;
+  Array.iteri
+    (fun m x ->
+      if not (Float.is_nan x) then Printf.printf ", \"%s\": %.15g" names.(m) x
+    )
+    r.Gpumon_history.values ;
+  print_string "}\n"
+
+let () =
+  Arg.parse
+    [
+      ("-file", Arg.Set_string file, "History file to read")
+    ; ("-since", Arg.Set_float since, "Oldest record to print, in Unix time")
+    ; ("-until", Arg.Set_float until, "Newest record to print, in Unix time")
+    ; ("-last", Arg.Set_float last, "Print the records of the last N seconds")
+    ; ("-bus-id", Arg.Set_string bus_id, "Only print the records of this GPU")
+    ; ( "-format"
+      , Arg.Symbol (["csv"; "json"], fun f -> format := f)
+      , " Output format"
+      )
+    ]
+    (fun _ -> raise (Arg.Bad "unexpected argument"))
+    "Print the GPU readings recorded by gpumon" ;
+  if !last > 0.0 then since := Unix.gettimeofday () -. !last ;
+  let history =
+    try Gpumon_history.open_in !file
+    with e ->
+      prerr_endline (Printexc.to_string e) ;
+      exit 1
+  in
+  let print = if !format = "json" then print_json else print_csv in
+  (* Bus IDs are stored with a 4-digit domain *)
+  let bus_id =
+    if !bus_id = "" then
+      ""
+    else
+      Gpumon_history.(decode_bus_id (encode_bus_id !bus_id))
+  in
+  if !format = "csv" then print_csv_header () ;
+  Gpumon_history.iter history (fun r ->
+      if
+        r.Gpumon_history.timestamp >= !since
+        && r.Gpumon_history.timestamp <= !until
+        && (bus_id = "" || bus_id = r.Gpumon_history.bus_id)
+      then
+        print r
+  )